@@ -0,0 +1,129 @@
+#! /usr/bin/env python
+
+#
+# Tiny assembler for the bytecode interpreter, used by the tests.
+#
+# Source format: one instruction per line, ';' starts a comment,
+# 'name:' defines a label.  Jump (and spawn) operands may be labels or
+# numbers.
+# '.byte n' emits a raw byte (useful for testing invalid opcodes).
+#
+# With --wide the output is in the wide format (see bci.h): a header,
+# then the program with 4-byte jump operands.
+#
+# usage: bcasm.py [--wide] in.bca out.bcm
+#
+
+import sys, struct
+
+# Opcode and operand width (in bytes) for each mnemonic; see bci.h.
+OPCODES = {
+    "nop":   (0x00, 0),
+    "push":  (0x01, 4),
+    "pop":   (0x02, 0),
+    "load":  (0x03, 1),
+    "store": (0x04, 1),
+    "jmp":   (0x05, 2),
+    "jz":    (0x06, 2),
+    "jnz":   (0x07, 2),
+    "add":   (0x08, 0),
+    "sub":   (0x09, 0),
+    "mul":   (0x0a, 0),
+    "div":   (0x0b, 0),
+    "print": (0x0c, 0),
+    "stop":  (0x0d, 0),
+    "ldm":   (0x0e, 0),
+    "stm":   (0x0f, 0),
+    "msize": (0x10, 0),
+    "spawn": (0x11, 2),
+    "join":  (0x12, 0),
+}
+
+FORMATS = {1: "<B", 2: "<H", 4: "<i"}
+
+# Instructions whose operand is an address (and widens with --wide).
+JUMPS = ("jmp", "jz", "jnz", "spawn")
+
+WIDE_HEADER = b"\xbcBCX\x01\x00\x00\x00"
+
+
+def width(name, wide):
+    """The operand width of an instruction."""
+    if wide and name in JUMPS:
+        return 4
+    return OPCODES[name][1]
+
+
+def parse(text, wide=False):
+    """Split the source into a list of (mnemonic, operand) pairs and
+    a dictionary of label addresses."""
+    insts = []
+    labels = {}
+    addr = 0
+
+    for line in text.split("\n"):
+        line = line.split(";")[0].strip()
+
+        while ":" in line:
+            label, line = line.split(":", 1)
+            labels[label.strip()] = addr
+            line = line.strip()
+
+        if not line:
+            continue
+
+        words = line.split()
+        name = words[0].lower()
+        arg = None
+        if len(words) > 1:
+            arg = words[1]
+
+        if name == ".byte":
+            addr += 1
+        elif name in OPCODES:
+            addr += 1 + width(name, wide)
+        else:
+            raise ValueError("unknown instruction: %s" % line)
+
+        insts.append((name, arg))
+
+    return insts, labels
+
+
+def assemble(text, wide=False):
+    """Assemble source text into a bytecode string, in the wide format
+    if 'wide' is set."""
+    insts, labels = parse(text, wide)
+    out = [WIDE_HEADER] if wide else []
+
+    for name, arg in insts:
+        if name == ".byte":
+            out.append(struct.pack("<B", int(arg, 0)))
+            continue
+
+        op = OPCODES[name][0]
+        n = width(name, wide)
+        out.append(struct.pack("<B", op))
+
+        if n:
+            if arg in labels:
+                value = labels[arg]
+            else:
+                value = int(arg, 0)
+            out.append(struct.pack(FORMATS[n], value))
+
+    return b"".join(out)
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    wide = "--wide" in args
+    if wide:
+        args.remove("--wide")
+    if len(args) != 2:
+        sys.stderr.write("usage: %s [--wide] in.bca out.bcm\n" % sys.argv[0])
+        sys.exit(1)
+
+    f = open(args[1], "wb")
+    f.write(assemble(open(args[0]).read(), wide))
+    f.close()
@@ -9,72 +9,152 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <limits.h>
 #include "bci.h"
+#include "bci_decode.h"
 
 
-/* Define the virtual machine. */
-vm_type vm;
+/*
+ * Does: Checks the result of an allocation, aborting the program if
+ * it failed.
+ * Arguments:
+ * -- result: What the allocator returned.
+ * Returns: 'result'.
+ */
+static void *check_allocation(void *result)
+{
+    if (result == NULL)
+    {
+        fprintf(stderr, "Fatal error: out of memory. "
+                "Terminating program.\n");
+        exit(1);
+    }
+
+    return result;
+}
+
+
+/*
+ * Does: Allocates memory, aborting the program if there is none.  A
+ * size of 0 is taken as 1, so the result is never NULL.
+ * Arguments:
+ * -- size: The number of bytes to allocate.
+ * Returns: A pointer to the new memory.
+ */
+void *checked_malloc(size_t size)
+{
+    return check_allocation(malloc(size > 0 ? size : 1));
+}
+
+
+/*
+ * Does: Allocates zeroed memory, aborting the program if there is
+ * none.
+ * Arguments:
+ * -- n: The number of elements.
+ * -- size: The size of each element.
+ * Returns: A pointer to the new memory.
+ */
+void *checked_calloc(size_t n, size_t size)
+{
+    return check_allocation(calloc(n > 0 ? n : 1, size > 0 ? size : 1));
+}
+
+
+/*
+ * Does: Resizes memory, aborting the program if there is none.
+ * Arguments:
+ * -- ptr: Memory to resize, or NULL to allocate new memory.
+ * -- size: The number of bytes needed.
+ * Returns: A pointer to the memory.
+ */
+void *checked_realloc(void *ptr, size_t size)
+{
+    return check_allocation(realloc(ptr, size > 0 ? size : 1));
+}
 
 
 /*
  * Does: Initializes the virtual machine.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void init_vm(void)
+void init_vm(vm_type *vm)
 {
-    int i;
+    reset_vm(vm);
 
     /*
-     * Initialize the stack.  It grows to the right i.e.
-     * to higher memory.
+     * Initialize the instruction buffer to all zeroes.  Past
+     * 'inst_dirty' it already is: only the bytes the last program
+     * loaded into it need clearing.
      */
 
-    vm.sp = 0;
+    vm_unmap(vm);
+    memset(vm->inst_buf, 0, vm->inst_dirty);
+    vm->inst_dirty = 0;
+    vm->ninsts = 0;
+}
 
-    for (i = 0; i < STACK_SIZE; i++)
-    {
-        vm.stack[i] = 0;
-    }
+
+/*
+ * Does: Resets the VM's stack, registers and instruction pointer,
+ * leaving the loaded program alone, so that it can be run (or stepped)
+ * from the start.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void reset_vm(vm_type *vm)
+{
+    int i;
 
     /*
-     * Initialize the registers to all zeroes.
+     * Initialize the stack.  It grows to the right i.e.
+     * to higher memory.  Only the part in use needs clearing: every
+     * slot above 'sp' is pushed before it is read.
      */
 
-    for (i = 0; i < NREGS; i++)
+    for (i = 0; i < vm->sp; i++)
     {
-        vm.reg[i] = 0;
+        vm->stack[i] = 0;
     }
 
+    vm->sp = 0;
+
     /*
-     * Initialize the instruction buffer to all zeroes.
+     * Initialize the registers to all zeroes.
      */
 
-    for (i = 0; i < MAX_INSTS; i++)
+    for (i = 0; i < NREGS; i++)
     {
-        vm.inst[i] = 0;
+        vm->reg[i] = 0;
     }
 
-    vm.ip = 0;
+    vm->ip = 0;
+    vm->status = VM_RUNNING;
 }
 
 
 /*
  * Does: Helper function to read in integer values which take up varying
- * numbers of bytes from the instruction array 'vm.inst'.
+ * numbers of bytes from the instruction array 'vm->inst'.
  *
  * NOTES:
- * 1) This function moves 'vm.ip' past the integer's location
- *    in memory.
+ * 1) This function moves 'vm->ip' past the integer's location
+ *    in memory, wrapping around at the end of the address space.
  * 2) This function assumes that integers take up 4 bytes and are
  *    arranged in a little-endian order (low-order bytes at the
  *    beginning).  This should hold for any pentium-based microprocessor.
  * 3) This function only works for n = 1, 2, or 4 bytes.
- * Arguments: The integer value (which takes up a varying number of bytes).
+ * Arguments:
+ * -- vm: The VM.
+ * -- n: The width of the integer in bytes.
  * Returns: An integer representing a valid location to jump to or
  * value to push.
  */
-int read_n_byte_integer(int n)
+int read_n_byte_integer(vm_type *vm, int n)
 {
     int i;
     unsigned char *val_ptr;
@@ -87,56 +167,107 @@ int read_n_byte_integer(int n)
 
     for (i = 0; i < n; i++)
     {
-        *val_ptr = vm.inst[vm.ip];
+        *val_ptr = vm->inst[vm->ip];
         val_ptr++;
-        vm.ip++;
+        vm->ip++;
+
+        if (vm->ip == (unsigned int)vm->nspace)
+        {
+            vm->ip = 0;
+        }
     }
 
     return val;
 }
 
 
+/*
+ * Does: Reads a jump operand: 2 bytes, or 4 in a wide program.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: The address to jump to.
+ */
+static int read_jump_target(vm_type *vm)
+{
+    /* Constant widths, so that 'read_n_byte_integer' is inlined. */
+    if (vm->wide)
+    {
+        return read_n_byte_integer(vm, 4);
+    }
+
+    return read_n_byte_integer(vm, 2);
+}
+
+
 /*
  * Machine operations.
  */
 
+/*
+ * Does: Reports a stack overflow and stops the VM's program; control
+ * goes back to 'vm_execute', which returns VM_ERROR.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Does not return.
+ */
+void stack_overflow(vm_type *vm)
+{
+    fprintf(stderr, "Stack overflow");
+    longjmp(vm->on_error, VM_ERROR);
+}
+
+
+/*
+ * Does: Reports a stack underflow and stops the VM's program; control
+ * goes back to 'vm_execute', which returns VM_ERROR.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Does not return.
+ */
+void stack_underflow(vm_type *vm)
+{
+    fprintf(stderr, "Stack underflow");
+    longjmp(vm->on_error, VM_ERROR);
+}
+
+
 /*
  * Does: Pushes an element to the current stack pointer,
  * then increments the stack pointer.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The value to be pushed.
  * Returns: Void.
  */
-void do_push(int n)
+void do_push(vm_type *vm, int n)
 {
-    if (vm.sp < STACK_SIZE - 1)
+    if (vm->sp < STACK_SIZE - 1)
     {
-        vm.stack[vm.sp] = n;
-        vm.sp++;
+        vm->stack[vm->sp] = n;
+        vm->sp++;
     }
     else
     {
-        fprintf(stderr, "Stack overflow");
-        exit(1);
+        stack_overflow(vm);
     }
 }
 
 
 /*
  * Does: Decrements the stack pointer.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_pop(void)
+void do_pop(vm_type *vm)
 {
-    if (vm.sp > 0)
+    if (vm->sp > 0)
     {
-        vm.sp--;
+        vm->sp--;
     }
     else
     {
-        fprintf(stderr, "Stack underflow");
-        exit(1);
+        stack_underflow(vm);
     }
 }
 
@@ -145,15 +276,16 @@ void do_pop(void)
  * Does: Pushes an integer from the n-th index
  * of the register onto the stack.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The index of the register whose value
  * we will push.
  * Returns: Void.
  */
-void do_load(int n)
+void do_load(vm_type *vm, int n)
 {
     if (n >= 0 && n < NREGS)
     {
-        do_push(vm.reg[n]);
+        do_push(vm, vm->reg[n]);
     }
 }
 
@@ -162,15 +294,16 @@ void do_load(int n)
  * Does: Stores and pops the element from the top of the stack
  * in the n-th index of the register.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The index of the register at which we will store the popped value.
  * Returns: Void.
  */
-void do_store(int n)
+void do_store(vm_type *vm, int n)
 {
-    do_pop();
+    do_pop(vm);
     if (n >= 0 && n < NREGS)
     {
-        vm.reg[n] = vm.stack[vm.sp];
+        vm->reg[n] = vm->stack[vm->sp];
     }
 }
 
@@ -178,14 +311,15 @@ void do_store(int n)
 /*
  * Does: Jumps to instruction number n.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The instruction number to jump to.
  * Returns: Void.
  */
-void do_jmp(int n)
+void do_jmp(vm_type *vm, int n)
 {
-    if (n >= 0 && n < MAX_INSTS)
+    if (n >= 0 && n < vm->nspace)
     {
-        vm.ip = n;
+        vm->ip = n;
     }
 }
 
@@ -194,15 +328,16 @@ void do_jmp(int n)
  * Does: Jumps to instruction number n if the top of
  * the stack is zero.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The instruction number to jump to.
  * Returns: Void.
  */
-void do_jz(int n)
+void do_jz(vm_type *vm, int n)
 {
-    do_pop();
-    if (vm.stack[vm.sp] == 0)
+    do_pop(vm);
+    if (vm->stack[vm->sp] == 0)
     {
-        do_jmp(n);
+        do_jmp(vm, n);
     }
 }
 
@@ -211,15 +346,16 @@ void do_jz(int n)
  * Does: Jumps to instruction number n if the top of
  * the stack is not zero.
  * Arguments:
+ * -- vm: The VM.
  * -- n: The instruction number to jump to.
  * Returns: Void.
  */
-void do_jnz(int n)
+void do_jnz(vm_type *vm, int n)
 {
-    do_pop();
-    if (vm.stack[vm.sp] != 0)
+    do_pop(vm);
+    if (vm->stack[vm->sp] != 0)
     {
-        do_jmp(n);
+        do_jmp(vm, n);
     }
 }
 
@@ -227,17 +363,18 @@ void do_jnz(int n)
 /*
  * Does: Adds the top two elements of the stack, pops them both,
  * and pushes the sum onto the stack.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_add(void)
+void do_add(vm_type *vm)
 {
     int sum = 0;
-    do_pop();
-    sum += vm.stack[vm.sp];
-    do_pop();
-    sum += vm.stack[vm.sp];
-    do_push(sum);
+    do_pop(vm);
+    sum += vm->stack[vm->sp];
+    do_pop(vm);
+    sum += vm->stack[vm->sp];
+    do_push(vm, sum);
 }
 
 
@@ -246,34 +383,36 @@ void do_add(void)
  * on top of the stack is subtract from the element below
  * it), pops them both,
  * and pushes the difference onto the stack.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_sub(void)
+void do_sub(vm_type *vm)
 {
     int diff = 0;
-    do_pop();
-    diff -= vm.stack[vm.sp];
-    do_pop();
-    diff += vm.stack[vm.sp];
-    do_push(diff);
+    do_pop(vm);
+    diff -= vm->stack[vm->sp];
+    do_pop(vm);
+    diff += vm->stack[vm->sp];
+    do_push(vm, diff);
 }
 
 
 /*
  * Does: Multiplies the top two elements of the stack, pops them both,
  * and pushes the multiple onto the stack.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_mul(void)
+void do_mul(vm_type *vm)
 {
     int mul = 1;
-    do_pop();
-    mul *= vm.stack[vm.sp];
-    do_pop();
-    mul *= vm.stack[vm.sp];
-    do_push(mul);
+    do_pop(vm);
+    mul *= vm->stack[vm->sp];
+    do_pop(vm);
+    mul *= vm->stack[vm->sp];
+    do_push(vm, mul);
 }
 
 
@@ -282,211 +421,1258 @@ void do_mul(void)
  * on top of the stack is divided into the element below
  * it), pops them both,
  * and pushes the fraction onto the stack.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_div(void)
+void do_div(vm_type *vm)
 {
-    int div = 1;
-    do_pop();
-    div /= vm.stack[vm.sp];
-    do_pop();
-    div *= vm.stack[vm.sp];
-    do_push(div);
+    int div;
+    do_pop(vm);
+    div = RECIPROCAL(vm->stack[vm->sp]);
+    do_pop(vm);
+    div *= vm->stack[vm->sp];
+    do_push(vm, div);
 }
 
 
 /*
  * Does: Prints the element on the top of the stack and pops it.
- * Arguments: Void.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void do_print(void)
+void do_print(vm_type *vm)
 {
-    do_pop();
-    printf("%d\n", vm.stack[vm.sp]);
+    do_pop(vm);
+    vm_print(vm, vm->stack[vm->sp]);
 }
 
 
 /*
- * Stored program execution.
+ * Does: Loads a word from the data memory, stopping the program if the
+ * address is outside it.  Control then goes back to 'vm_execute',
+ * which returns VM_ERROR.
+ * Arguments:
+ * -- vm: The VM.
+ * -- n: The address.
+ * Returns: The word.
  */
+int data_load(vm_type *vm, int n)
+{
+    if (n >= 0 && n < vm->ndata_in)
+    {
+        return vm->data_in[n];
+    }
+
+    if (n >= vm->ndata_in && n - vm->ndata_in < vm->ndata_out)
+    {
+        return vm->data_out[n - vm->ndata_in];
+    }
+
+    fprintf(stderr, "Bad data address %d\n", n);
+    longjmp(vm->on_error, VM_ERROR);
+}
+
 
 /*
- * Does: Loads the stored program into the VM.
+ * Does: Stores a word to the output part of the data memory, stopping
+ * the program (as 'data_load' does) if the address is outside it.
  * Arguments:
- * -- fp: The name of the file to read.
+ * -- vm: The VM.
+ * -- n: The address.
+ * -- x: The word.
  * Returns: Void.
  */
-void load_program(FILE *fp)
+void data_store(vm_type *vm, int n, int x)
 {
-    int nread;
-    unsigned char *inst = vm.inst;
-
-    do
+    if (n >= vm->ndata_in && n - vm->ndata_in < vm->ndata_out)
     {
-        /*
-         * Read a single byte at a time and load it into the
-         * 'vm.insts' array.  'fread' returns the number of bytes read,
-         * or 0 if EOF is hit.
-         */
+        vm->data_out[n - vm->ndata_in] = x;
+        return;
+    }
 
-        nread = fread(inst, 1, 1, fp);
-        inst++;
+    if (n >= 0 && n < vm->ndata_in)
+    {
+        fprintf(stderr, "Data word %d is read-only\n", n);
+    }
+    else
+    {
+        fprintf(stderr, "Bad data address %d\n", n);
     }
-    while (nread > 0);
+
+    longjmp(vm->on_error, VM_ERROR);
 }
 
 
 /*
- * Does: Executes the stored program in the VM.
- * Arguments: Void.
+ * Does: Pops an address and pushes the data word at that address.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void execute_program(void)
+void do_ldm(vm_type *vm)
 {
-    int val;
+    do_pop(vm);
+    do_push(vm, data_load(vm, vm->stack[vm->sp]));
+}
 
-    vm.ip = 0;
-    vm.sp = 0;
 
-    while (1)
-    {
-        /*
-         * Read each instruction and select what to do based on the
-         * instruction.  For each instruction you may also have to
-         * read in some number of bytes as the arguments to the
-         * instruction.
-         */
+/*
+ * Does: Pops an address, then a value, and stores the value to the
+ * data word at that address.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void do_stm(vm_type *vm)
+{
+    int n;
 
-        switch (vm.inst[vm.ip])
-        {
-        case NOP:
-            /* Skip to the next instruction. */
-            vm.ip++;
-            break;
+    do_pop(vm);
+    n = vm->stack[vm->sp];
+    do_pop(vm);
+    data_store(vm, n, vm->stack[vm->sp]);
+}
 
-        case PUSH:
-            vm.ip++;
 
-            /* Read in the next 4 bytes. */
-            val = read_n_byte_integer(4);
-            do_push(val);
-            break;
+/*
+ * Does: Pushes the number of words of input in the data memory.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void do_msize(vm_type *vm)
+{
+    do_push(vm, vm->ndata_in);
+}
 
-        case POP:
-            vm.ip++;
 
-            do_pop();
-            break;
+/*
+ * Does: Starts a child at an instruction and pushes its handle.  The
+ * stack is checked first, so that a SPAWN that overflows starts
+ * nothing.
+ * Arguments:
+ * -- vm: The VM.
+ * -- n: The address where the child starts.
+ * Returns: Void.
+ */
+void do_spawn(vm_type *vm, int n)
+{
+    if (vm->sp >= STACK_SIZE - 1)
+    {
+        stack_overflow(vm);
+    }
 
-        case LOAD:
-            vm.ip++;
+    do_push(vm, vm_spawn(vm, n, vm->reg));
+}
 
-            /* Read in the next byte. */
-            val = read_n_byte_integer(1);
-            do_load(val);
-            break;
 
-        case STORE:
-            vm.ip++;
+/*
+ * Does: Pops a child's handle, waits for the child and pushes its
+ * result.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void do_join(vm_type *vm)
+{
+    do_pop(vm);
+    do_push(vm, vm_join(vm, vm->stack[vm->sp]));
+}
 
-            /* Read in the next byte. */
-            val = read_n_byte_integer(1);
-            do_store(val);
-            break;
 
-        case JMP:
-            vm.ip++;
+/*
+ * Does: Writes a number in decimal, followed by a newline.  This is
+ * what 'printf("%d\n", n)' does, without parsing a format.
+ * Arguments:
+ * -- p: Where to write it; there must be room for 12 characters.
+ * -- n: The number.
+ * Returns: The number of characters written (no NUL is added).
+ */
+static int format_int(char *p, int n)
+{
+    char digits[10];
+    unsigned int u = n < 0 ? 0u - (unsigned int)n : (unsigned int)n;
+    int len = 0, i = 0;
 
-            /* Read in the next two bytes. */
-            val = read_n_byte_integer(2);
-            do_jmp(val);
-            break;
+    if (n < 0)
+    {
+        p[len++] = '-';
+    }
 
-        case JZ:
-            vm.ip++;
+    do
+    {
+        digits[i++] = (char)('0' + u % 10);
+        u /= 10;
+    }
+    while (u != 0);
 
-            /* Read in the next two bytes. */
-            val = read_n_byte_integer(2);
-            do_jz(val);
-            break;
+    while (i > 0)
+    {
+        p[len++] = digits[--i];
+    }
 
-        case JNZ:
-            vm.ip++;
+    p[len++] = '\n';
+    return len;
+}
 
-            /* Read in the next two bytes. */
-            val = read_n_byte_integer(2);
-            do_jnz(val);
-            break;
 
-        case ADD:
-            vm.ip++;
-            do_add();
-            break;
+/*
+ * Does: Makes room in the VM's output buffer for one more value:
+ * allocates the buffer, empties it into the sink, or (when capturing)
+ * doubles it.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+static void make_room(vm_type *vm)
+{
+    if (vm->out == NULL)
+    {
+        vm->out_size = vm->sink == SINK_MEMORY ? 256 : OUT_BUFFER;
+        vm->out_len = 0;
+        vm->out = (char *)checked_malloc(vm->out_size);
+    }
+    else if (vm->sink == SINK_MEMORY)
+    {
+        vm->out = (char *)checked_realloc(vm->out, 2 * vm->out_size);
+        vm->out_size *= 2;
+    }
+    else
+    {
+        vm_flush_output(vm);
+    }
+}
 
-        case SUB:
-            vm.ip++;
-            do_sub();
-            break;
 
-        case MUL:
-            vm.ip++;
-            do_mul();
-            break;
+/*
+ * Does: Outputs the value of a PRINT instruction to the VM's output
+ * buffer, which is emptied into the sink when it is full and when the
+ * program finishes.
+ * Arguments:
+ * -- vm: The VM.
+ * -- n: The value to print.
+ * Returns: Void.
+ */
+void vm_print(vm_type *vm, int n)
+{
+    unsigned char *p;
 
-        case DIV:
-            vm.ip++;
-            do_div();
-            break;
+    if (vm->out_size - vm->out_len < MAX_PRINT)
+    {
+        make_room(vm);
+    }
 
-        case PRINT:
-            vm.ip++;
-            do_print();
-            break;
+    if (vm->out_binary)
+    {
+        /* Little-endian, whatever the host. */
+        p = (unsigned char *)vm->out + vm->out_len;
+        p[0] = (unsigned char)n;
+        p[1] = (unsigned char)((unsigned int)n >> 8);
+        p[2] = (unsigned char)((unsigned int)n >> 16);
+        p[3] = (unsigned char)((unsigned int)n >> 24);
+        vm->out_len += 4;
+    }
+    else
+    {
+        vm->out_len += format_int(vm->out + vm->out_len, n);
+    }
+}
 
-        case STOP:
-            return;
 
-        default:
-            fprintf(stderr, "execute_program: invalid instruction: %x\n",
-                    vm.inst[vm.ip]);
-            fprintf(stderr, "\taborting program!\n");
-            return;
+/*
+ * Does: Outputs bytes that are already formatted (as PRINT would have
+ * formatted them for this VM), e.g. what a child printed.
+ * Arguments:
+ * -- vm: The VM.
+ * -- bytes: The output.
+ * -- len: Its length.
+ * Returns: Void.
+ */
+void vm_write_output(vm_type *vm, const char *bytes, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        if (vm->out_size - vm->out_len < MAX_PRINT)
+        {
+            make_room(vm);
+        }
+
+        /* Leave a byte free for the NUL 'vm_take_output' adds. */
+        n = vm->out_size - vm->out_len - 1;
+
+        if (n > len)
+        {
+            n = len;
         }
+
+        memcpy(vm->out + vm->out_len, bytes, n);
+        vm->out_len += n;
+        bytes += n;
+        len -= n;
     }
 }
 
 
 /*
- * Does: Runs the program given the file name in which it's stored.
- * Arguments: The file name where the program is stored.
+ * Does: Empties the VM's output buffer into its sink: writes it to the
+ * file, or throws it away.  Captured output is left where it is.
+ * Arguments:
+ * -- vm: The VM.
  * Returns: Void.
  */
-void run_program(char *filename)
+void vm_flush_output(vm_type *vm)
 {
-    FILE *fp;
-
-    /* Open the file containing the bytecode. */
-    fp = fopen(filename, "r");
+    FILE *fp = vm->out_fp != NULL ? vm->out_fp : stdout;
 
-    if (fp == NULL)
+    if (vm->sink == SINK_MEMORY)
     {
-        fprintf(stderr, "bci.c: run_program: "
-               "error opening file %s; aborting.\n", filename);
-        exit(1);
+        return;
     }
 
-    /* Initialize the virtual machine. */
-    init_vm();
+    if (vm->sink == SINK_FILE && vm->out_len > 0)
+    {
+        fwrite(vm->out, 1, vm->out_len, fp);
+        fflush(fp);
+    }
 
-    /* Read the bytecode into the instruction buffer. */
-    load_program(fp);
+    vm->out_len = 0;
+}
 
-    /* Execute the program. */
-    execute_program();
 
-    /* Clean up. */
-    fclose(fp);
-}
+/*
+ * Stored program execution.
+ */
 
+/*
+ * Does: Recognizes the header of a wide program.
+ * Arguments:
+ * -- bytes: The start of the program file.
+ * -- len: How many bytes of it there are.
+ * Returns: The format version in the header, or 0 if it isn't one.
+ */
+int wide_version(unsigned char *bytes, long len)
+{
+    if (len < WIDE_HEADER || bytes[0] != 0xbc || bytes[1] != 'B'
+        || bytes[2] != 'C' || bytes[3] != 'X')
+    {
+        return 0;
+    }
+
+    return bytes[4];
+}
+
+
+/*
+ * Does: Finishes loading a wide program whose first 'vm->ninsts' bytes,
+ * header and all, have been read into 'inst_buf': moves the program to
+ * a buffer of its own, which grows as the rest of it is read.
+ * Arguments:
+ * -- vm: The VM.
+ * -- fp: The file to read the rest from.
+ * Returns: 1 on success, 0 if the header has the wrong version or the
+ * program is empty or longer than MAX_WIDE_INSTS.
+ */
+static int load_wide(vm_type *vm, FILE *fp)
+{
+    unsigned char *buf;
+    size_t len, size, n;
+
+    if (wide_version(vm->inst_buf, vm->ninsts) != WIDE_VERSION)
+    {
+        return 0;
+    }
+
+    size = MAX_INSTS;
+    len = vm->ninsts - WIDE_HEADER;
+    buf = (unsigned char *)checked_malloc(size);
+
+    memcpy(buf, vm->inst_buf + WIDE_HEADER, len);
+
+    while ((n = fread(buf + len, 1, size - len, fp)) > 0)
+    {
+        len += n;
+
+        if (len > MAX_WIDE_INSTS)
+        {
+            free(buf);
+            return 0;
+        }
+
+        if (len == size)
+        {
+            buf = (unsigned char *)checked_realloc(buf, 2 * size);
+            size *= 2;
+        }
+    }
+
+    if (len == 0)
+    {
+        free(buf);
+        return 0;
+    }
+
+    vm->wide_buf = buf;
+    vm->inst = buf;
+    vm->ninsts = (int)len;
+    vm->nspace = (int)len;
+    vm->wide = 1;
+    return 1;
+}
+
+
+/*
+ * Does: Loads the stored program into the VM.
+ * Arguments:
+ * -- vm: The VM.
+ * -- fp: The file to read.
+ * Returns: 1 on success, 0 if the program is longer than MAX_INSTS
+ * (or is a wide program that 'load_wide' rejects).
+ */
+int load_program(vm_type *vm, FILE *fp)
+{
+    /*
+     * Read the whole file with one call; if it fills the buffer, make
+     * sure nothing is left over.
+     */
+
+    vm->ninsts = fread(vm->inst, 1, MAX_INSTS, fp);
+
+    if (vm->inst == vm->inst_buf && vm->ninsts > vm->inst_dirty)
+    {
+        vm->inst_dirty = vm->ninsts;
+    }
+
+    if (wide_version(vm->inst, vm->ninsts) != 0)
+    {
+        return load_wide(vm, fp);
+    }
+
+    if (vm->ninsts == MAX_INSTS && getc(fp) != EOF)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Does: Executes instructions of the stored program, starting at
+ * 'vm->ip' with the stack as it is, until the program stops or the
+ * budget runs out.
+ * Arguments:
+ * -- vm: The VM.
+ * -- budget: The most instructions to execute.
+ * Returns: 1 if the program stopped, 0 if the budget ran out.
+ */
+static int run_bytecode(vm_type *vm, unsigned long budget)
+{
+    int val;
+
+    for (; budget > 0; budget--)
+    {
+        /* Off the end of the address space: back to the start. */
+        if (vm->ip >= (unsigned int)vm->nspace)
+        {
+            vm->ip = 0;
+        }
+
+        /*
+         * Read each instruction and select what to do based on the
+         * instruction.  For each instruction you may also have to
+         * read in some number of bytes as the arguments to the
+         * instruction.
+         */
+
+        switch (vm->inst[vm->ip])
+        {
+        case NOP:
+            /* Skip to the next instruction. */
+            vm->ip++;
+            break;
+
+        case PUSH:
+            vm->ip++;
+
+            /* Read in the next 4 bytes. */
+            val = read_n_byte_integer(vm, 4);
+            do_push(vm, val);
+            break;
+
+        case POP:
+            vm->ip++;
+
+            do_pop(vm);
+            break;
+
+        case LOAD:
+            vm->ip++;
+
+            /* Read in the next byte. */
+            val = read_n_byte_integer(vm, 1);
+            do_load(vm, val);
+            break;
+
+        case STORE:
+            vm->ip++;
+
+            /* Read in the next byte. */
+            val = read_n_byte_integer(vm, 1);
+            do_store(vm, val);
+            break;
+
+        case JMP:
+            vm->ip++;
+
+            /* Read in the next two (wide: four) bytes. */
+            val = read_jump_target(vm);
+            do_jmp(vm, val);
+            break;
+
+        case JZ:
+            vm->ip++;
+
+            /* Read in the next two (wide: four) bytes. */
+            val = read_jump_target(vm);
+            do_jz(vm, val);
+            break;
+
+        case JNZ:
+            vm->ip++;
+
+            /* Read in the next two (wide: four) bytes. */
+            val = read_jump_target(vm);
+            do_jnz(vm, val);
+            break;
+
+        case ADD:
+            vm->ip++;
+            do_add(vm);
+            break;
+
+        case SUB:
+            vm->ip++;
+            do_sub(vm);
+            break;
+
+        case MUL:
+            vm->ip++;
+            do_mul(vm);
+            break;
+
+        case DIV:
+            vm->ip++;
+            do_div(vm);
+            break;
+
+        case PRINT:
+            vm->ip++;
+            do_print(vm);
+            break;
+
+        case LDM:
+            vm->ip++;
+            do_ldm(vm);
+            break;
+
+        case STM:
+            vm->ip++;
+            do_stm(vm);
+            break;
+
+        case MSIZE:
+            vm->ip++;
+            do_msize(vm);
+            break;
+
+        case SPAWN:
+            vm->ip++;
+
+            /* Read in the next two (wide: four) bytes. */
+            val = read_jump_target(vm);
+            do_spawn(vm, val);
+            break;
+
+        case JOIN:
+            vm->ip++;
+            do_join(vm);
+            break;
+
+        case STOP:
+            return 1;
+
+        default:
+            fprintf(stderr, "execute_program: invalid instruction: %x\n",
+                    vm->inst[vm->ip]);
+            fprintf(stderr, "\taborting program!\n");
+            vm->status = VM_INVALID;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Does: Executes the stored program in the VM.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void execute_program(vm_type *vm)
+{
+    vm->ip = 0;
+    vm->sp = 0;
+
+    while (!run_bytecode(vm, ULONG_MAX))
+    {
+        /* Keep going. */
+    }
+}
+
+
+/*
+ * Does: Runs the program loaded in a VM for at most a given number of
+ * instructions, with the reference interpreter.  Everything needed to
+ * carry on (the stack, registers and 'ip') stays in the VM, so a long
+ * program can be run a slice at a time, interleaved with others.
+ *
+ * NOTES:
+ * 1) Loading a program (or 'reset_vm') sets the status to VM_RUNNING;
+ *    once the program finishes, further calls just return its status.
+ * 2) A stack error finishes the program with VM_ERROR, as in
+ *    'vm_execute'.
+ * Arguments:
+ * -- vm: The VM.
+ * -- max_instructions: The budget for this call.
+ * Returns: VM_RUNNING if the budget ran out first, otherwise how the
+ * program finished: VM_OK, VM_INVALID or VM_ERROR.
+ */
+int vm_step(vm_type *vm, unsigned long max_instructions)
+{
+    if (vm->status != VM_RUNNING)
+    {
+        return vm->status;
+    }
+
+    /* Stack errors 'longjmp' back here (see 'stack_overflow'). */
+    if (setjmp(vm->on_error) == 0)
+    {
+        if (run_bytecode(vm, max_instructions)
+            && vm->status == VM_RUNNING)
+        {
+            vm->status = VM_OK;
+        }
+    }
+    else
+    {
+        vm->status = VM_ERROR;
+    }
+
+    if (vm->status != VM_RUNNING)
+    {
+        vm_reap(vm);
+        vm_flush_output(vm);
+    }
+
+    return vm->status;
+}
+
+
+/*
+ * The VM life cycle.
+ */
+
+/*
+ * Does: Allocates a new VM.  Load a program into it with 'vm_load'
+ * before running it.  The VM is zeroed by 'calloc', which gets fresh
+ * pages from the system already zero, so its instruction buffer costs
+ * nothing until a program is loaded into it.
+ * Arguments: Void.
+ * Returns: The new VM.
+ */
+vm_type *vm_create(void)
+{
+    vm_type *vm = (vm_type *)checked_calloc(1, sizeof(vm_type));
+
+    vm->inst = vm->inst_buf;
+    vm->mapping = NULL;
+    vm->wide_buf = NULL;
+    vm->ninsts = 0;
+    vm->wide = 0;
+    vm->nspace = MAX_INSTS;
+    vm->inst_dirty = 0;
+    vm->status = VM_OK;
+    vm->data_in = NULL;
+    vm->data_out = NULL;
+    vm->ndata_in = 0;
+    vm->ndata_out = 0;
+    vm->children = NULL;
+    vm->nchildren = 0;
+    vm->sink = SINK_FILE;
+    vm->out_fp = NULL;
+    vm->out_binary = 0;
+    vm->out = NULL;
+    vm->out_len = 0;
+    vm->out_size = 0;
+    return vm;
+}
+
+
+/*
+ * Does: Resets a VM and loads a program into it.
+ * Arguments:
+ * -- vm: The VM.
+ * -- fp: The file to read the program from.
+ * Returns: 1 on success, 0 if the program is too long.
+ */
+int vm_load(vm_type *vm, FILE *fp)
+{
+    init_vm(vm);
+    return load_program(vm, fp);
+}
+
+
+/*
+ * Does: Prints the hot-spot report for a profiled run on stderr and
+ * writes the profile to 'opts->profile_json'.
+ * Arguments:
+ * -- prog: The profiled program.
+ * -- opts: The run options.
+ * Returns: Void.
+ */
+static void report_profile(decoded_program *prog, run_options *opts)
+{
+    FILE *fp;
+
+    print_profile(prog, stderr);
+    fp = fopen(opts->profile_json, "w");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "profile: can't write %s\n", opts->profile_json);
+        return;
+    }
+
+    write_profile_json(prog, fp);
+    fclose(fp);
+    fprintf(stderr, "profile: written to %s\n", opts->profile_json);
+}
+
+
+/*
+ * Does: Runs a decoded program with the register engine if it can be
+ * translated, and with the decoded-stream interpreter if not.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: The run options.
+ * -- prog: The decoded program.
+ * Returns: Void.
+ */
+static void run_registers(vm_type *vm, run_options *opts,
+                          decoded_program *prog)
+{
+    reg_program ir;
+
+    if (!translate_to_registers(prog, &ir))
+    {
+        /* The stack depth isn't fixed: keep the stack. */
+        if (opts->stats)
+        {
+            fprintf(stderr, "reg: the program doesn't verify; "
+                    "interpreting it\n");
+        }
+
+        execute_decoded(vm, prog);
+        return;
+    }
+
+    if (opts->stats)
+    {
+        fprintf(stderr, "reg: %d stack instructions became %d register "
+                "instructions\n", prog->ncode, ir.ncode);
+    }
+
+    execute_registers(vm, &ir);
+    free_registers(&ir);
+}
+
+
+/*
+ * Does: Runs the loaded program with one of the execution engines.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: The engine to use.
+ * -- prog: The decoded program, or NULL if it couldn't be decoded (in
+ *    which case the bytecode is interpreted).
+ * Returns: Void.
+ */
+static void run_engine(vm_type *vm, run_options *opts,
+                       decoded_program *prog)
+{
+    if (prog != NULL && (prog->profile != NULL || prog->trace))
+    {
+        /* Whatever the engine, only the decoded loop keeps count. */
+        select_decoded(!prog->verified || opts->checks,
+                       prog->profile != NULL, prog->trace)(vm, prog);
+    }
+    else if (opts->engine == ENGINE_THREADED)
+    {
+        execute_threaded(vm);
+    }
+    else if (prog == NULL)
+    {
+        execute_program(vm);
+    }
+    else if (opts->engine == ENGINE_TOS)
+    {
+        execute_tos(vm, prog);
+    }
+    else if (opts->engine == ENGINE_JIT)
+    {
+        if (!execute_jit(vm, prog, opts->stats))
+        {
+            /* E.g. an invalid opcode: let the interpreter report it. */
+            if (opts->stats)
+            {
+                fprintf(stderr, "jit: can't compile the program; "
+                        "interpreting it\n");
+            }
+
+            execute_decoded(vm, prog);
+        }
+    }
+    else if (opts->engine == ENGINE_REGISTER)
+    {
+        run_registers(vm, opts, prog);
+    }
+    else if (opts->engine == ENGINE_TRACE)
+    {
+        execute_traced(vm, prog, opts->stats);
+    }
+    else
+    {
+        select_decoded(!prog->verified || opts->checks, 0, 0)(vm, prog);
+    }
+}
+
+
+/*
+ * Does: Does the load-time work for running the program in a VM:
+ * decodes it (unless the engine runs the bytecode itself), verifies it,
+ * fuses it and sets up profiling, as the options ask.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: How it will be run.
+ * -- prog: Where to store the decoded program.
+ * Returns: 1 if 'prog' holds a decoded program (free it with
+ * 'free_decoded'), 0 if not.
+ */
+int vm_prepare(vm_type *vm, run_options *opts, decoded_program *prog)
+{
+    fuse_stats stats;
+    int decoded = 0, stage;
+
+    /*
+     * Everything but the bytecode interpreters runs a decoded program,
+     * and so does the profiler.
+     */
+    if ((opts->engine != ENGINE_SWITCH && opts->engine != ENGINE_THREADED)
+        || opts->profile || opts->exec_trace)
+    {
+        /* The other engines always check the stack themselves. */
+        stage = opts->engine == ENGINE_FUSED ? PREP_FUSED
+                : opts->engine == ENGINE_DECODED
+                  || opts->engine == ENGINE_REGISTER ? PREP_VERIFIED
+                : PREP_DECODED;
+
+        if (opts->cache && cache_load(vm, stage, prog))
+        {
+            decoded = 1;
+
+            if (opts->stats)
+            {
+                fprintf(stderr, "cache: hit, %s program loaded\n",
+                        prog->verified ? "verified" : "unverified");
+            }
+        }
+        else
+        {
+            decoded = decode_program(vm, prog);
+
+            if (decoded && stage >= PREP_VERIFIED)
+            {
+                if (verify_program(vm, prog, opts->stats ? stderr : NULL)
+                    && opts->stats)
+                {
+                    fprintf(stderr, "verify: ok, running without runtime "
+                            "checks\n");
+                }
+            }
+
+            if (decoded && stage == PREP_FUSED)
+            {
+                fuse_program(prog, &stats);
+
+                if (opts->stats)
+                {
+                    print_fuse_stats(&stats);
+                }
+            }
+
+            if (decoded && opts->cache)
+            {
+                cache_store(vm, stage, prog);
+            }
+        }
+
+        if (decoded && opts->profile)
+        {
+            new_profile(prog, opts->profile == PROFILE_CYCLES);
+        }
+        else if (opts->profile)
+        {
+            fprintf(stderr, "profile: the program can't be decoded; "
+                    "not profiling it\n");
+        }
+
+        if (decoded)
+        {
+            prog->trace = opts->exec_trace;
+        }
+        else if (opts->exec_trace)
+        {
+            fprintf(stderr, "exec: the program can't be decoded; "
+                    "not tracing it\n");
+        }
+    }
+
+    return decoded;
+}
+
+
+/*
+ * Does: Runs the program in a VM once 'vm_prepare' has been called,
+ * starting with the registers as they are.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: The options given to 'vm_prepare'.
+ * -- prog: The decoded program, or NULL if 'vm_prepare' returned 0.
+ * Returns: How the program finished: VM_OK, VM_INVALID or VM_ERROR.
+ */
+int vm_run_prepared(vm_type *vm, run_options *opts, decoded_program *prog)
+{
+    vm->status = VM_OK;
+
+    /* Stack errors 'longjmp' back here (see 'stack_overflow'). */
+    if (setjmp(vm->on_error) == 0)
+    {
+        run_engine(vm, opts, prog);
+    }
+    else
+    {
+        vm->status = VM_ERROR;
+    }
+
+    vm_reap(vm);
+    vm_flush_output(vm);
+
+    if (prog != NULL && prog->profile != NULL)
+    {
+        report_profile(prog, opts);
+    }
+
+    return vm->status;
+}
+
+
+/*
+ * Does: Runs the program loaded in a VM.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: How to run it (see 'run_options' in bci.h), or NULL for
+ *    the reference interpreter.
+ * Returns: How the program finished: VM_OK, VM_INVALID or VM_ERROR.
+ */
+int vm_execute(vm_type *vm, run_options *opts)
+{
+    run_options defaults;
+    decoded_program prog;
+    int decoded, status;
+
+    if (opts == NULL)
+    {
+        init_run_options(&defaults);
+        opts = &defaults;
+    }
+
+    decoded = vm_prepare(vm, opts, &prog);
+    status = vm_run_prepared(vm, opts, decoded ? &prog : NULL);
+
+    if (decoded)
+    {
+        free_decoded(&prog);
+    }
+
+    return status;
+}
+
+
+/*
+ * Does: Checks whether the loaded program can be run without runtime
+ * stack and register checks (see 'verify_program').
+ * Arguments:
+ * -- vm: The VM.
+ * -- report: Where to describe the first problem found, or NULL.
+ * Returns: 1 if the program passes, 0 if not.
+ */
+int vm_verify(vm_type *vm, FILE *report)
+{
+    decoded_program prog;
+    int decoded, ok;
+
+    decoded = decode_program(vm, &prog);
+    ok = verify_program(vm, decoded ? &prog : NULL, report);
+
+    if (decoded)
+    {
+        free_decoded(&prog);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Does: Frees a VM, first waiting for any children a paused program
+ * left running.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_destroy(vm_type *vm)
+{
+    vm_reap(vm);
+    vm_flush_output(vm);
+    vm_unmap(vm);
+    vm_unmap_data(vm);
+    free(vm->out);
+    free(vm);
+}
+
+
+/*
+ * Does: Changes where a VM's PRINT output goes.  Output still waiting
+ * for a file is written first; output captured so far is dropped.
+ * Arguments:
+ * -- vm: The VM.
+ * -- sink: SINK_FILE, SINK_MEMORY or SINK_DISCARD.
+ * -- fp: The file, for SINK_FILE (NULL for stdout).
+ * Returns: Void.
+ */
+static void set_sink(vm_type *vm, int sink, FILE *fp)
+{
+    if (vm->sink == sink && vm->out_fp == fp)
+    {
+        return;
+    }
+
+    vm_flush_output(vm);
+    free(vm->out);
+    vm->out = NULL;
+    vm->out_len = 0;
+    vm->out_size = 0;
+    vm->sink = sink;
+    vm->out_fp = fp;
+}
+
+
+/*
+ * Does: Makes the VM write PRINT output to a file (the default is
+ * stdout).
+ * Arguments:
+ * -- vm: The VM.
+ * -- fp: The file, or NULL for stdout.  The caller closes it, after
+ *    the VM has been destroyed or sent elsewhere.
+ * Returns: Void.
+ */
+void vm_output_file(vm_type *vm, FILE *fp)
+{
+    set_sink(vm, SINK_FILE, fp);
+}
+
+
+/*
+ * Does: Makes the VM collect PRINT output in a buffer instead of
+ * writing it to stdout.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_capture_output(vm_type *vm)
+{
+    set_sink(vm, SINK_MEMORY, NULL);
+}
+
+
+/*
+ * Does: Makes the VM throw its PRINT output away (after formatting
+ * it, so that a benchmark still pays for that).
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_discard_output(vm_type *vm)
+{
+    set_sink(vm, SINK_DISCARD, NULL);
+}
+
+
+/*
+ * Does: Chooses between text and binary PRINT output.
+ * Arguments:
+ * -- vm: The VM.
+ * -- binary: 1 for each value as a little-endian 32-bit integer, 0 for
+ *    decimal text, one value per line.
+ * Returns: Void.
+ */
+void vm_binary_output(vm_type *vm, int binary)
+{
+    vm->out_binary = binary;
+}
+
+
+/*
+ * Does: Hands over the output a capturing VM has collected, and starts
+ * a new buffer for it.
+ * Arguments:
+ * -- vm: The VM (which must be capturing output).
+ * -- len: Where to store the length of the output.
+ * Returns: The NUL-terminated output; the caller must free it.
+ */
+char *vm_take_output(vm_type *vm, int *len)
+{
+    char *out;
+
+    if (vm->out == NULL)
+    {
+        make_room(vm);
+    }
+
+    /* Writers always leave a byte free past 'out_len' (see MAX_PRINT). */
+    out = vm->out;
+    out[vm->out_len] = '\0';
+    *len = vm->out_len;
+    vm->out = NULL;
+    vm->out_len = 0;
+    vm->out_size = 0;
+
+    return out;
+}
+
+
+/*
+ * Does: Runs the program given the file name in which it's stored,
+ * using the reference interpreter.
+ * Arguments: The file name where the program is stored.
+ * Returns: Void.
+ */
+void run_program(char *filename)
+{
+    run_options opts;
+
+    init_run_options(&opts);
+    run_program_opts(filename, &opts);
+}
+
+
+/*
+ * Does: Sets run options to their defaults: the reference interpreter,
+ * with no reports.
+ * Arguments:
+ * -- opts: The options to initialize.
+ * Returns: Void.
+ */
+void init_run_options(run_options *opts)
+{
+    opts->engine = ENGINE_SWITCH;
+    opts->stats = 0;
+    opts->profile = 0;
+    opts->profile_json = "bci_profile.json";
+    opts->quantum = 0;
+    opts->cache = 1;
+    opts->checks = 0;
+    opts->exec_trace = 0;
+    opts->output_file = NULL;
+    opts->discard_output = 0;
+    opts->binary_output = 0;
+    opts->data_in = NULL;
+    opts->data_out = NULL;
+    opts->data_words = -1;
+}
+
+
+/*
+ * Does: Runs the program given the file name in which it's stored.
+ * A stack overflow or underflow exits with status 1.
+ * Arguments:
+ * -- filename: The file name where the program is stored.
+ * -- opts: How to run it (see 'run_options' in bci.h).
+ * Returns: Void.
+ */
+void run_program_opts(char *filename, run_options *opts)
+{
+    vm_type *vm;
+    FILE *out = NULL;
+    int status;
+
+    /* Create the virtual machine and load the bytecode into it. */
+    vm = vm_create();
+
+    if (opts->discard_output)
+    {
+        vm_discard_output(vm);
+    }
+    else if (opts->output_file != NULL)
+    {
+        out = fopen(opts->output_file, "wb");
+
+        if (out == NULL)
+        {
+            fprintf(stderr, "bci: can't write %s\n", opts->output_file);
+            exit(1);
+        }
+
+        vm_output_file(vm, out);
+    }
+
+    vm_binary_output(vm, opts->binary_output);
+
+    if (!vm_load_file(vm, filename)
+        || !vm_map_data(vm, opts->data_in, opts->data_out,
+                        opts->data_words))
+    {
+        exit(1);
+    }
+
+    /* Execute the program. */
+    status = vm_execute(vm, opts);
+
+    /* Clean up. */
+    vm_destroy(vm);
+
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    if (status == VM_ERROR)
+    {
+        exit(1);
+    }
+}
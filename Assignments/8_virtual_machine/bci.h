@@ -10,6 +10,7 @@
 #define BCI_H
 
 #include <stdio.h>
+#include <setjmp.h>
 
 /*
  * The instruction set.  Each instruction fits into a single byte.
@@ -31,16 +32,23 @@
  *    and PRINT also pop the TOS after they do their work.
  *
  * 2) Many operations take additional arguments from the instruction
- *    stream: PUSH, LOAD, STORE, JMP, JZ, JNZ.  These arguments
+ *    stream: PUSH, LOAD, STORE, JMP, JZ, JNZ, SPAWN.  These arguments
  *    are NOT found on the stack but are read in from the bytecode.
  *    They have the following lengths:
  *
  *    a) integers:     4 bytes (signed)
- *    b) instructions: 2 bytes (unsigned)
+ *    b) instructions: 2 bytes (unsigned), or 4 bytes (signed) in
+ *                     the wide format (see below)
  *    c) registers:    1 byte (unsigned)
  *
  * 3) LOAD operations DO NOT erase the contents of a register.
  *
+ * 4) LDM, STM and MSIZE work on the data memory (see below).  LDM and
+ *    STM take the address from the stack, so they have no operands.
+ *
+ * 5) SPAWN and JOIN run part of the program in a child VM, in
+ *    parallel with the rest (see below).
+ *
  */
 
 /* --------------------- usage: ----------------------------------- */
@@ -63,6 +71,15 @@
 #define DIV     0x0b  /* DIV: S2 / S1 -> TOS                        */
 #define PRINT   0x0c  /* PRINT: print TOS to stdout and pop TOS.    */
 #define STOP    0x0d  /* STOP: halt the program.                    */
+#define LDM     0x0e  /* LDM: replace TOS with the data word at
+                         address TOS.                               */
+#define STM     0x0f  /* STM: store S2 to the data word at
+                         address S1 and pop both.                   */
+#define MSIZE   0x10  /* MSIZE: push the number of input words.     */
+#define SPAWN   0x11  /* SPAWN <i>: start a child at instruction <i>
+                         and push its handle.                       */
+#define JOIN    0x12  /* JOIN: wait for the child whose handle is
+                         TOS, and replace TOS with its result.      */
 
 
 /*
@@ -78,54 +95,437 @@
 #define MAX_INSTS  65536    /* Maximum number of instructions. */
 #define STACK_SIZE 256      /* Size of the stack. */
 
+/*
+ * The wide format, for programs too big for 2-byte jumps.  A wide
+ * program file starts with a WIDE_HEADER-byte header,
+ *
+ *     0xbc 'B' 'C' 'X' <version> 0 0 0
+ *
+ * (0xbc isn't an opcode, so no useful program starts that way), and
+ * its jump operands are 4 bytes.  The header isn't part of the program:
+ * addresses start at 0 just after it.  The address space is exactly
+ * the program, up to MAX_WIDE_INSTS bytes; where a plain program runs
+ * on through the zeroes that fill the rest of its 64 KiB, a wide one
+ * wraps straight back to 0.  A jump to an address outside the program
+ * does nothing, just as 'do_jmp' ignores an out-of-range target.
+ */
+
+#define WIDE_HEADER    8
+#define WIDE_VERSION   1
+#define MAX_WIDE_INSTS 0x40000000
+
+/*
+ * The data memory, for programs that work on more data than fits in
+ * the registers and the stack: a linear array of 32-bit words, apart
+ * from the program, that LDM and STM address.  The first 'ndata_in'
+ * words are the input, which is read-only; the 'ndata_out' words after
+ * them are the output, which the program can read back as well as
+ * write.  MSIZE pushes 'ndata_in', i.e. where the output starts.  The
+ * memory is empty unless files are mapped into it (see bci_data.c).
+ */
+
+#define MAX_DATA_WORDS 0x7fffffff    /* Input and output together. */
+
+/*
+ * Children (see bci_spawn.c).  SPAWN starts a child VM at the given
+ * instruction, with a copy of the registers, an empty stack and the
+ * same data memory, and pushes a handle for it: the lowest of 0 ..
+ * MAX_CHILDREN - 1 not held by a child still to be joined (with all of
+ * them held, SPAWN is an error).  An address outside the address space
+ * starts the child at 0, where the instruction pointer would wrap to.
+ * Children run on a pool of threads, with the reference interpreter.
+ * JOIN waits for a child and pushes its result, the top of its stack
+ * when it stopped (0 if the stack was empty); what the child printed
+ * is printed then, as if by the parent.  Joining a handle that isn't
+ * held, or a child that failed, is an error.  A program that stops
+ * with children still running waits for them, and prints what they
+ * printed, in handle order.
+ */
+
+#define MAX_CHILDREN 4096
+
+typedef struct vm_child vm_child;
+
+/*
+ * How a program finished (vm_type.status).  A stack overflow or
+ * underflow stops only the VM it happens in: the error is reported on
+ * stderr and the VM's 'vm_execute' returns VM_ERROR.  So does a LDM or
+ * STM outside the data memory, or a STM to its input, or a JOIN that
+ * fails.
+ */
+
+#define VM_OK       0   /* Ran to STOP.                        */
+#define VM_INVALID  1   /* Stopped at an invalid instruction.  */
+#define VM_ERROR    2   /* Stack overflow or underflow.        */
+#define VM_RUNNING  3   /* Not finished yet (see 'vm_step').   */
+
+/* Where PRINT output goes. */
+#define SINK_FILE     0   /* A file (stdout unless set).         */
+#define SINK_MEMORY   1   /* A buffer, for 'vm_take_output'.     */
+#define SINK_DISCARD  2   /* Nowhere.                            */
+
+#define OUT_BUFFER  65536 /* Output kept before writing a file.  */
+#define MAX_PRINT   13    /* The most one PRINT writes, "-2147483648\n",
+                             and a NUL.                           */
+
 typedef struct
 {
     int stack[STACK_SIZE];           /* The stack.           */
     unsigned char sp;                /* The stack pointer.   */
     int reg[NREGS];                  /* Registers.           */
-    unsigned char inst[MAX_INSTS];   /* Instructions.        */
-    unsigned short ip;               /* Instruction pointer. */
+    unsigned char *inst;             /* Instructions: 'inst_buf',
+                                        in 'mapping' or 'wide_buf'. */
+    unsigned char inst_buf[MAX_INSTS];
+    void *mapping;                   /* A mapped program file, or
+                                        NULL (see bci_load.c).  */
+    size_t mapping_len;
+    unsigned char *wide_buf;         /* A wide program read into
+                                        memory, or NULL.        */
+    unsigned int ip;                 /* Instruction pointer. */
+    int ninsts;                      /* Bytes of program loaded. */
+    int wide;                        /* In the wide format.  */
+    int nspace;                      /* Size of the address space:
+                                        MAX_INSTS, or 'ninsts' for
+                                        a wide program.         */
+    int inst_dirty;                  /* Bytes of 'inst_buf' that
+                                        may not be zero.        */
+    int status;                      /* One of the VM_* codes. */
+    const int *data_in;              /* The data memory's input */
+    int *data_out;                   /* and output words, and  */
+    int ndata_in;                    /* how many of each there */
+    int ndata_out;                   /* are.                   */
+    vm_child **children;             /* Children by handle, or NULL
+                                        before the first SPAWN. */
+    int nchildren;                   /* Handles below this may
+                                        be held.                */
+    jmp_buf on_error;                /* Where stack errors go. */
+    int sink;                        /* One of the SINK_* codes.   */
+    FILE *out_fp;                    /* Its file (NULL: stdout).   */
+    int out_binary;                  /* PRINT packed int32s.       */
+    char *out;                       /* PRINT output not yet sent  */
+    int out_len;                     /* to the sink, or NULL.      */
+    int out_size;
 } vm_type;
 
-/* Declare the VM 'extern' so all files can access the same VM. */
-extern vm_type vm;
+/*
+ * Every function takes the VM it works on, so any number of VMs can
+ * exist at once, e.g. one per thread.
+ */
 
 /* Function to initialize the VM. */
-void init_vm(void);
+void init_vm(vm_type *vm);
+
+/* Resets the stack, registers and 'ip', but not the program. */
+void reset_vm(vm_type *vm);
 
 /*
  * Utility function to convert byte streams of varying widths
  * to integers.
  */
-int read_n_byte_integer(int n);
+int read_n_byte_integer(vm_type *vm, int n);
+
+/*
+ * Memory allocation for the whole interpreter.  These never return
+ * NULL: out of memory, they report it and exit.
+ */
+void *checked_malloc(size_t size);
+void *checked_calloc(size_t n, size_t size);
+void *checked_realloc(void *ptr, size_t size);
 
 /*
  * Functions that implement the machine operations.
  */
 
-void do_push(int n);
-void do_pop(void);
-void do_load(int n);
-void do_store(int n);
-void do_jmp(int n);
-void do_jz(int n);
-void do_jnz(int n);
-void do_add(void);
-void do_sub(void);
-void do_mul(void);
-void do_div(void);
-void do_print(void);
+void stack_overflow(vm_type *vm);
+void stack_underflow(vm_type *vm);
+
+void do_push(vm_type *vm, int n);
+void do_pop(vm_type *vm);
+void do_load(vm_type *vm, int n);
+void do_store(vm_type *vm, int n);
+void do_jmp(vm_type *vm, int n);
+void do_jz(vm_type *vm, int n);
+void do_jnz(vm_type *vm, int n);
+void do_add(vm_type *vm);
+void do_sub(vm_type *vm);
+void do_mul(vm_type *vm);
+void do_div(vm_type *vm);
+void do_print(vm_type *vm);
+void do_ldm(vm_type *vm);
+void do_stm(vm_type *vm);
+void do_msize(vm_type *vm);
+void do_spawn(vm_type *vm, int n);
+void do_join(vm_type *vm);
+
+/*
+ * Data memory accesses, with every check; an access that fails is
+ * reported and stops the program, like a stack error.
+ */
+int data_load(vm_type *vm, int n);
+void data_store(vm_type *vm, int n, int x);
+
+/*
+ * SPAWN and JOIN for every engine (bci_spawn.c).  'vm_spawn' gives the
+ * child a copy of 'reg' (the engine's registers, wherever it keeps
+ * them) and returns its handle; 'vm_join' returns its result.  Both
+ * report errors and stop the program, like a stack error; the engine
+ * checks there is room for the handle before spawning.  'vm_reap'
+ * waits for every child not joined yet, when the program stops or
+ * before a paused one is unloaded or its VM destroyed.
+ */
+int vm_spawn(vm_type *vm, int n, int *reg);
+int vm_join(vm_type *vm, int handle);
+void vm_reap(vm_type *vm);
+
+/* Where every engine sends the value of a PRINT. */
+void vm_print(vm_type *vm, int n);
+void vm_write_output(vm_type *vm, const char *bytes, int len);
+void vm_flush_output(vm_type *vm);
+
+/*
+ * 1 / n, which is what 'do_div' divides S2 by.  This is 0 unless n is
+ * 1 or -1, and it is defined to be 0 for n == 0 as well (which is also
+ * what gcc's optimized code for a plain '1 / n' gives), so every
+ * engine agrees on division by zero.
+ */
+#define RECIPROCAL(n)  ((unsigned int)(n) + 1 <= 2 ? (n) : 0)
+
+/*
+ * Inline versions of 'do_push' and 'do_pop' for the execution engines,
+ * which all call their VM 'vm'.  The error cases are handed to
+ * 'do_push' and 'do_pop' so that the diagnostics match the reference
+ * interpreter.
+ */
+
+#define PUSH_TOS(x)                     \
+    if (vm->sp < STACK_SIZE - 1)        \
+    {                                   \
+        vm->stack[vm->sp++] = (x);      \
+    }                                   \
+    else                                \
+    {                                   \
+        do_push(vm, x);                 \
+    }
+
+#define POP_TOS()                       \
+    if (vm->sp > 0)                     \
+    {                                   \
+        vm->sp--;                       \
+    }                                   \
+    else                                \
+    {                                   \
+        do_pop(vm);                     \
+    }
+
+/*
+ * Inline data memory accesses, for the same engines.  The common case
+ * (a load from the input, a store to the output) is one unsigned
+ * comparison; everything else goes to 'data_load' and 'data_store'.
+ */
+
+#define DATA_LOAD(n)                                        \
+    ((unsigned int)(n) < (unsigned int)vm->ndata_in        \
+     ? vm->data_in[n] : data_load(vm, n))
+
+#define DATA_STORE(n, x)                                    \
+    if ((unsigned int)(n) - vm->ndata_in                    \
+        < (unsigned int)vm->ndata_out)                      \
+    {                                                       \
+        vm->data_out[(n) - vm->ndata_in] = (x);             \
+    }                                                       \
+    else                                                    \
+    {                                                       \
+        data_store(vm, n, x);                               \
+    }
 
 
 /*
  * Stored program execution.
  */
 
-void load_program(FILE *fp);
-void execute_program(void);
+int load_program(vm_type *vm, FILE *fp);
+void execute_program(vm_type *vm);
 void run_program(char *filename);
 
 
+/*
+ * Execution engines.  ENGINE_SWITCH is the reference interpreter
+ * ('execute_program'); every other engine must produce identical
+ * output.
+ */
+
+#define ENGINE_SWITCH    0  /* One 'switch' per instruction.      */
+#define ENGINE_THREADED  1  /* Direct-threaded (computed goto).   */
+#define ENGINE_DECODED   2  /* Runs the pre-decoded stream.       */
+#define ENGINE_FUSED     3  /* Decoded, with superinstructions.   */
+#define ENGINE_TOS       4  /* Decoded, TOS kept in a local.      */
+#define ENGINE_JIT       5  /* Template JIT to x86-64.            */
+#define ENGINE_REGISTER  6  /* Translated to a register IR.      */
+#define ENGINE_TRACE     7  /* Hot loops recorded as traces.      */
+
+void execute_threaded(vm_type *vm);
+
+
+/*
+ * How to run a program.
+ */
+
+#define PROFILE_COUNTS   1  /* Count instructions and branches.   */
+#define PROFILE_CYCLES   2  /* ... and cycles, with 'rdtsc'.      */
+
+typedef struct
+{
+    int engine;          /* One of the ENGINE_* constants.            */
+    int stats;           /* Report what the load-time passes did.     */
+    int profile;         /* 0 or one of the PROFILE_* constants.      */
+    char *profile_json;  /* Where to write the profile as JSON.       */
+    unsigned long quantum;  /* Batch mode: 0 to run each program to
+                               the end, or the time slice (in
+                               instructions) for the scheduler.       */
+    int cache;           /* Keep prepared programs on disk.           */
+    int checks;          /* Check the stack even if the program
+                            verifies (decoded engines).               */
+    int exec_trace;      /* Write each instruction run to stderr.     */
+    char *output_file;   /* Where PRINT writes, or NULL for stdout.   */
+    int discard_output;  /* Throw PRINT output away.                  */
+    int binary_output;   /* PRINT little-endian int32s, not text.     */
+    char *data_in;       /* File mapped as the data memory's input.   */
+    char *data_out;      /* File mapped as its output.                */
+    long data_words;     /* Words of output, or -1 for as many as
+                            there are of input.                       */
+} run_options;
+
+void init_run_options(run_options *opts);
+void run_program_opts(char *filename, run_options *opts);
+
+
+/*
+ * The VM life cycle: create a VM, load a program into it, run it (as
+ * often as needed), then destroy it.
+ */
+
+vm_type *vm_create(void);
+int vm_load(vm_type *vm, FILE *fp);
+int vm_execute(vm_type *vm, run_options *opts);
+int vm_step(vm_type *vm, unsigned long max_instructions);
+int vm_verify(vm_type *vm, FILE *report);
+void vm_destroy(vm_type *vm);
+
+/*
+ * Loading straight from a file (bci_load.c): regular files are mapped
+ * into memory and run in place, anything else is read in one go.
+ * Programs longer than MAX_INSTS (MAX_WIDE_INSTS for a wide one) are
+ * rejected before anything is run.
+ */
+
+int vm_load_file(vm_type *vm, char *filename);
+void vm_unmap(vm_type *vm);
+
+/* The version in a wide program's header, or 0 if there isn't one. */
+int wide_version(unsigned char *bytes, long len);
+
+/*
+ * The data memory (bci_data.c).  'vm_map_data' maps the input file
+ * read-only and the output file (created or resized to 'words' words)
+ * shared, so stores go straight back to it; either may be NULL.  Both
+ * hold little-endian int32s.  The mappings last until 'vm_unmap_data'
+ * or 'vm_destroy', however many times the program is run.
+ */
+
+int vm_map_data(vm_type *vm, char *input, char *output, long words);
+void vm_unmap_data(vm_type *vm);
+
+/*
+ * PRINT output goes through a buffer in the VM, which is written out
+ * when it fills up and when the program finishes.  By default it goes
+ * to stdout; 'vm_output_file' sends it to another file and
+ * 'vm_discard_output' nowhere.  After 'vm_capture_output' it stays in
+ * the buffer instead; 'vm_take_output' hands that buffer over (the
+ * caller frees it) and starts a new one.  Either way it can be text or
+ * binary ('vm_binary_output').
+ */
+
+void vm_output_file(vm_type *vm, FILE *fp);
+void vm_capture_output(vm_type *vm);
+void vm_discard_output(vm_type *vm);
+void vm_binary_output(vm_type *vm, int binary);
+char *vm_take_output(vm_type *vm, int *len);
+
+
+/*
+ * A pool of VMs (bci_pool.c) to get one from instead of 'vm_create',
+ * and give it back to instead of 'vm_destroy', so that the allocations
+ * are reused.  VMs are only created when there is no idle one to hand
+ * out, and at most 'size' idle ones are kept.  A VM from the pool is
+ * like a new one: load a program before running it.  Any thread may
+ * use the pool.
+ */
+
+typedef struct vm_pool vm_pool;
+
+vm_pool *vm_pool_create(int size);
+vm_type *vm_pool_get(vm_pool *pool);
+void vm_pool_put(vm_pool *pool, vm_type *vm);
+void vm_pool_destroy(vm_pool *pool);
+
+
+/*
+ * Ahead-of-time translation (bci_emit.c): writes the loaded program out
+ * as a C program that does the same thing.
+ */
+
+int vm_emit_c(vm_type *vm, char *source, FILE *fp);
+
+
+/*
+ * Fork-server mode (bci_server.c): prepares the loaded program once,
+ * then runs it in a forked child for each request on a UNIX-domain
+ * socket, starting from the registers the request gives.
+ */
+
+int vm_serve(vm_type *vm, run_options *opts, char *path);
+
+
+/*
+ * SIMT mode (bci_simt.c): runs the loaded program once for each row of
+ * starting registers in a CSV file, all the runs in lockstep, and
+ * writes a line of results per run.
+ */
+
+int run_simt(vm_type *vm, run_options *opts, char *inputs, char *outputs);
+
+
+/*
+ * Batch mode (bci_batch.c): runs every program in a directory or list
+ * file on a pool of threads, each with its own VM.  With a quantum in
+ * the options, the programs share the threads through a scheduler
+ * instead of each running to the end.
+ */
+
+int run_batch(char *source, int nworkers, run_options *opts);
+
+
+/*
+ * A scheduler (bci_sched.c) interleaves any number of VMs on a few
+ * threads, running each for a time slice at a time with 'vm_step'.
+ * Programs start at the given priority (0 is the most urgent, up to
+ * SCHED_LEVELS - 1); one that uses up its slice drops a level, where
+ * slices are twice as long.  So short programs finish quickly however
+ * many long ones are queued ahead of them.  'done' is called (on a
+ * scheduler thread) as each program finishes.
+ */
+
+#define SCHED_LEVELS 4
+
+typedef struct scheduler scheduler;
+
+scheduler *sched_create(int nthreads, unsigned long quantum,
+                        void (*done)(vm_type *vm, void *arg));
+void sched_submit(scheduler *s, vm_type *vm, int priority, void *arg);
+void sched_wait(scheduler *s);
+void sched_destroy(scheduler *s);
+
+
 #endif  /* BCI_H */
 
 
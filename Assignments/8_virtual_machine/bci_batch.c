@@ -0,0 +1,578 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_batch.c
+ *       Batch mode: runs many bytecode programs on a pool of worker
+ *       threads.
+ *
+ * Each worker owns one VM and reuses it for every program it runs, so
+ * a batch costs one process instead of one fork/exec per program.  The
+ * programs are dealt out to the workers in contiguous blocks; a worker
+ * takes its own programs from the back of its block, and a worker that
+ * runs out steals from the front of another worker's block.  PRINT
+ * output is captured per program and written out in list order once
+ * everything has run, so the output doesn't depend on the scheduling.
+ *
+ * With a quantum in the run options, each program gets a VM of its own
+ * instead and they all go to a scheduler (bci_sched.c), which runs
+ * them a slice at a time with 'vm_step' (that is, with the reference
+ * interpreter, whatever the engine).  A short program then finishes
+ * early even if it is listed after long ones.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bci.h"
+
+
+/* The longest line accepted in a list file. */
+#define MAX_LINE 4096
+
+
+/* One program in the batch. */
+typedef struct
+{
+    char *path;        /* The bytecode file.                        */
+    char *out;         /* Its PRINT output (NUL-terminated).        */
+    int out_len;
+    int status;        /* VM_OK, VM_INVALID, VM_ERROR, or -1 if the
+                          file couldn't be loaded.                  */
+    double seconds;    /* How long loading and running it took.     */
+    double queued;     /* When the batch started.                   */
+    double finished;   /* How long after that it finished.          */
+} batch_job;
+
+
+/*
+ * A worker's share of the batch: the jobs with indices head .. tail-1
+ * that nobody has started yet.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} job_deque;
+
+
+typedef struct
+{
+    batch_job *jobs;
+    job_deque *deques;     /* One per worker. */
+    int nworkers;
+    run_options *opts;
+} batch_pool;
+
+
+typedef struct
+{
+    batch_pool *pool;
+    int id;
+} worker_arg;
+
+
+/*
+ * Does: Copies a string into newly allocated memory.
+ * Arguments:
+ * -- s: The string.
+ * Returns: The copy.
+ */
+static char *copy_string(const char *s)
+{
+    char *copy = (char *)checked_malloc(strlen(s) + 1);
+
+    strcpy(copy, s);
+    return copy;
+}
+
+
+/*
+ * Does: Adds a program to the end of the job list, growing it as
+ * needed.
+ * Arguments:
+ * -- jobs: The job list.
+ * -- n: The number of jobs in it.
+ * -- size: The number of jobs it has room for.
+ * -- path: The program to add (copied).
+ * Returns: Void.
+ */
+static void add_job(batch_job **jobs, int *n, int *size, const char *path)
+{
+    if (*n == *size)
+    {
+        *size = *size == 0 ? 64 : 2 * *size;
+        *jobs = (batch_job *)checked_realloc(*jobs,
+                                             *size * sizeof(batch_job));
+    }
+
+    (*jobs)[*n].path = copy_string(path);
+    (*jobs)[*n].out = NULL;
+    (*jobs)[*n].out_len = 0;
+    (*jobs)[*n].status = VM_OK;
+    (*jobs)[*n].seconds = 0.0;
+    (*jobs)[*n].queued = 0.0;
+    (*jobs)[*n].finished = 0.0;
+    (*n)++;
+}
+
+
+/* 'qsort' comparison for jobs, by path. */
+static int compare_jobs(const void *a, const void *b)
+{
+    return strcmp(((const batch_job *)a)->path,
+                  ((const batch_job *)b)->path);
+}
+
+
+/* 'qsort' comparison for doubles. */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Does: Builds the list of programs to run.  'source' is either a
+ * directory, in which case every *.bcm file in it is run in name
+ * order, or a file listing one program per line (blank lines and lines
+ * starting with '#' are skipped).
+ * Arguments:
+ * -- source: The directory or list file.
+ * -- jobs: Where to store the job list.
+ * Returns: The number of jobs, or -1 if 'source' can't be read.
+ */
+static int read_jobs(char *source, batch_job **jobs)
+{
+    DIR *dir;
+    struct dirent *entry;
+    FILE *fp;
+    char line[MAX_LINE];
+    char *path;
+    int n = 0, size = 0;
+    size_t len;
+
+    *jobs = NULL;
+    dir = opendir(source);
+
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            len = strlen(entry->d_name);
+
+            if (len < 4 || strcmp(entry->d_name + len - 4, ".bcm") != 0)
+            {
+                continue;
+            }
+
+            path = (char *)checked_malloc(strlen(source) + len + 2);
+            sprintf(path, "%s/%s", source, entry->d_name);
+            add_job(jobs, &n, &size, path);
+            free(path);
+        }
+
+        closedir(dir);
+        qsort(*jobs, n, sizeof(batch_job), compare_jobs);
+        return n;
+    }
+
+    fp = fopen(source, "r");
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, MAX_LINE, fp) != NULL)
+    {
+        len = strlen(line);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        {
+            line[--len] = '\0';
+        }
+
+        if (len == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        add_job(jobs, &n, &size, line);
+    }
+
+    fclose(fp);
+    return n;
+}
+
+
+/*
+ * Does: Gets the current time.
+ * Arguments: Void.
+ * Returns: The time in seconds from some fixed point.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Does: Picks the next job for a worker: the last one left in its own
+ * block, or failing that the first one left in another worker's.
+ * Arguments:
+ * -- pool: The pool.
+ * -- id: The worker.
+ * Returns: The index of the job, or -1 if none are left.
+ */
+static int next_job(batch_pool *pool, int id)
+{
+    job_deque *d;
+    int i, job = -1;
+
+    d = &pool->deques[id];
+    pthread_mutex_lock(&d->lock);
+
+    if (d->head < d->tail)
+    {
+        job = --d->tail;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    for (i = 1; job < 0 && i < pool->nworkers; i++)
+    {
+        d = &pool->deques[(id + i) % pool->nworkers];
+        pthread_mutex_lock(&d->lock);
+
+        if (d->head < d->tail)
+        {
+            job = d->head++;
+        }
+
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return job;
+}
+
+
+/*
+ * Does: Loads and runs one program, saving its output and timing.
+ * Arguments:
+ * -- vm: The worker's VM, which must be capturing output.
+ * -- job: The program.
+ * -- opts: How to run it.
+ * Returns: Void.
+ */
+static void run_job(vm_type *vm, batch_job *job, run_options *opts)
+{
+    double start = now();
+
+    if (!vm_load_file(vm, job->path))
+    {
+        job->status = -1;
+        job->out = copy_string("");
+    }
+    else
+    {
+        job->status = vm_execute(vm, opts);
+        job->out = vm_take_output(vm, &job->out_len);
+    }
+
+    job->seconds = now() - start;
+    job->finished = now() - job->queued;
+}
+
+
+/*
+ * Does: The body of a worker thread: runs jobs on its own VM until
+ * there are none left.
+ * Arguments:
+ * -- arg: The worker's 'worker_arg'.
+ * Returns: NULL.
+ */
+static void *worker(void *arg)
+{
+    batch_pool *pool = ((worker_arg *)arg)->pool;
+    int id = ((worker_arg *)arg)->id;
+    vm_type *vm;
+    int job;
+
+    vm = vm_create();
+    vm_capture_output(vm);
+
+    while ((job = next_job(pool, id)) >= 0)
+    {
+        run_job(vm, &pool->jobs[job], pool->opts);
+    }
+
+    vm_destroy(vm);
+    return NULL;
+}
+
+
+/*
+ * Does: Records a program's results when the scheduler has finished
+ * running it, and frees its VM.
+ * Arguments:
+ * -- vm: The program's VM.
+ * -- arg: Its 'batch_job'.
+ * Returns: Void.
+ */
+static void job_done(vm_type *vm, void *arg)
+{
+    batch_job *job = (batch_job *)arg;
+
+    job->status = vm->status;
+    job->out = vm_take_output(vm, &job->out_len);
+    job->finished = now() - job->queued;
+
+    /* Its slices are spread over the whole run: count all of it. */
+    job->seconds = job->finished;
+    vm_destroy(vm);
+}
+
+
+/*
+ * Does: Runs every job through a scheduler, one VM per job.
+ * Arguments:
+ * -- pool: The jobs, and how to run them.
+ * -- n: The number of jobs.
+ * Returns: Void.
+ */
+static void run_scheduled(batch_pool *pool, int n)
+{
+    scheduler *s;
+    vm_type **vms;
+    int i;
+
+    /*
+     * Load everything first, so that loading doesn't compete for the
+     * CPUs with the programs already running.
+     */
+    vms = (vm_type **)checked_malloc(n * sizeof(vm_type *));
+
+    for (i = 0; i < n; i++)
+    {
+        vms[i] = vm_create();
+        vm_capture_output(vms[i]);
+
+        if (!vm_load_file(vms[i], pool->jobs[i].path))
+        {
+            pool->jobs[i].status = -1;
+            pool->jobs[i].out = copy_string("");
+            pool->jobs[i].finished = now() - pool->jobs[i].queued;
+            vm_destroy(vms[i]);
+            vms[i] = NULL;
+        }
+    }
+
+    s = sched_create(pool->nworkers, pool->opts->quantum, job_done);
+
+    for (i = 0; i < n; i++)
+    {
+        if (vms[i] != NULL)
+        {
+            sched_submit(s, vms[i], 0, &pool->jobs[i]);
+        }
+    }
+
+    sched_wait(s);
+    sched_destroy(s);
+    free(vms);
+}
+
+
+/*
+ * Does: Reports the throughput and the latency per program on stderr.
+ * Arguments:
+ * -- jobs: The finished jobs.
+ * -- n: The number of jobs.
+ * -- nworkers: The number of worker threads used.
+ * -- elapsed: The wall-clock time for the whole batch, in seconds.
+ * -- nerrors: The number of programs that failed.
+ * Returns: Void.
+ */
+static void print_batch_stats(batch_job *jobs, int n, int nworkers,
+                              double elapsed, int nerrors)
+{
+    double *latency, *finished;
+    int i;
+
+    latency = (double *)checked_malloc(n * sizeof(double));
+    finished = (double *)checked_malloc(n * sizeof(double));
+
+    for (i = 0; i < n; i++)
+    {
+        latency[i] = jobs[i].seconds;
+        finished[i] = jobs[i].finished;
+    }
+
+    qsort(latency, n, sizeof(double), compare_doubles);
+    qsort(finished, n, sizeof(double), compare_doubles);
+
+    fprintf(stderr, "batch: %d programs in %.3f s on %d threads "
+            "(%.0f programs/s)\n", n, elapsed, nworkers,
+            elapsed > 0.0 ? n / elapsed : 0.0);
+    fprintf(stderr, "batch: latency per program: p50 %.3f ms, "
+            "p99 %.3f ms, max %.3f ms\n",
+            latency[(n - 1) * 50 / 100] * 1e3,
+            latency[(n - 1) * 99 / 100] * 1e3,
+            latency[n - 1] * 1e3);
+    fprintf(stderr, "batch: finished after: p50 %.3f ms, "
+            "p99 %.3f ms, max %.3f ms\n",
+            finished[(n - 1) * 50 / 100] * 1e3,
+            finished[(n - 1) * 99 / 100] * 1e3,
+            finished[n - 1] * 1e3);
+
+    if (nerrors > 0)
+    {
+        fprintf(stderr, "batch: %d programs failed\n", nerrors);
+    }
+
+    free(latency);
+    free(finished);
+}
+
+
+/*
+ * Does: Runs every program in a directory or list file on a pool of
+ * worker threads, then prints each program's output, in list order,
+ * under a '==> path <==' header.
+ * Arguments:
+ * -- source: The directory or list file (see 'read_jobs').
+ * -- nworkers: The number of worker threads, or 0 for one per CPU.
+ * -- opts: How to run each program.
+ * Returns: The number of programs that couldn't be loaded or stopped
+ * with a stack error; -1 if 'source' couldn't be read.
+ */
+int run_batch(char *source, int nworkers, run_options *opts)
+{
+    batch_job *jobs;
+    batch_pool pool;
+    pthread_t *threads;
+    worker_arg *args;
+    double start, elapsed;
+    int n, i, nerrors = 0;
+
+    n = read_jobs(source, &jobs);
+
+    if (n < 0)
+    {
+        fprintf(stderr, "bci: batch: can't read %s\n", source);
+        return -1;
+    }
+
+    if (n == 0)
+    {
+        fprintf(stderr, "batch: no programs in %s\n", source);
+        return 0;
+    }
+
+    if (nworkers <= 0)
+    {
+        nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (nworkers > n && opts->quantum == 0)
+    {
+        nworkers = n;
+    }
+
+    if (nworkers < 1)
+    {
+        nworkers = 1;
+    }
+
+    pool.jobs = jobs;
+    pool.nworkers = nworkers;
+    pool.opts = opts;
+    pool.deques = (job_deque *)checked_malloc(nworkers * sizeof(job_deque));
+    threads = (pthread_t *)checked_malloc(nworkers * sizeof(pthread_t));
+    args = (worker_arg *)checked_malloc(nworkers * sizeof(worker_arg));
+
+    /* Deal the jobs out in contiguous blocks. */
+    for (i = 0; i < nworkers; i++)
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].head = (int)((long)n * i / nworkers);
+        pool.deques[i].tail = (int)((long)n * (i + 1) / nworkers);
+        args[i].pool = &pool;
+        args[i].id = i;
+    }
+
+    start = now();
+
+    for (i = 0; i < n; i++)
+    {
+        jobs[i].queued = start;
+    }
+
+    if (opts->quantum > 0)
+    {
+        run_scheduled(&pool, n);
+    }
+    else
+    {
+        for (i = 0; i < nworkers; i++)
+        {
+            if (pthread_create(&threads[i], NULL, worker, &args[i]) != 0)
+            {
+                fprintf(stderr, "Fatal error: can't create thread. "
+                        "Terminating program.\n");
+                exit(1);
+            }
+        }
+
+        for (i = 0; i < nworkers; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    elapsed = now() - start;
+
+    for (i = 0; i < n; i++)
+    {
+        printf("==> %s <==\n", jobs[i].path);
+        fwrite(jobs[i].out, 1, jobs[i].out_len, stdout);
+
+        if (jobs[i].status == VM_ERROR || jobs[i].status < 0)
+        {
+            nerrors++;
+        }
+    }
+
+    fflush(stdout);
+    print_batch_stats(jobs, n, nworkers, elapsed, nerrors);
+
+    for (i = 0; i < nworkers; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        free(jobs[i].path);
+        free(jobs[i].out);
+    }
+
+    free(jobs);
+    free(pool.deques);
+    free(threads);
+    free(args);
+
+    return nerrors;
+}
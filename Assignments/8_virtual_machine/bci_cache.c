@@ -0,0 +1,639 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_cache.c
+ *       An on-disk cache of prepared (decoded, verified, fused)
+ *       programs.
+ *
+ * 'vm_prepare' looks here before decoding a program, and stores what
+ * it made afterwards, so the second run of the same program goes
+ * straight to executing it.  Entries are named by a hash of the
+ * bytecode, the entry format (CACHE_FORMAT), the interpreter's
+ * CACHE_KEY and how far the program was prepared; they live in
+ * $BCI_CACHE_DIR, or else in $XDG_CACHE_HOME/bci or ~/.cache/bci.
+ *
+ * An entry is mapped, checked, and its arrays copied out: a header,
+ * the bytecode it was made from (compared on every hit, so a hash
+ * collision is only a miss), then the decoded instructions and, if the
+ * program verified, the stack depths.  Each array starts on an 8-byte
+ * boundary.  The header holds a checksum of everything after
+ * it, and before a loaded program is used, every jump target, register
+ * and stack depth in it is checked to be in range: the engines that
+ * run verified programs trust them.
+ *
+ * Every hit touches the entry's modification time.  When a store takes
+ * the cache past CACHE_LIMIT bytes ($BCI_CACHE_LIMIT, if set), the
+ * entries used longest ago are removed until it fits.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* The default size cap. */
+#define CACHE_LIMIT (64L << 20)
+
+/*
+ * Entries of any other format are never used.  Bump it when the layout
+ * of an entry changes.
+ */
+#define CACHE_FORMAT 5
+
+/*
+ * Entries made by any other decoder, verifier or fuser are never used
+ * either.  The Makefile passes a checksum of their sources (see
+ * CACHE_SRCS there), so this changes with them by itself.
+ */
+#ifndef CACHE_KEY
+#error "CACHE_KEY must be defined; build bci_cache.o with the Makefile"
+#endif
+
+#define ALIGN8(n) (((n) + 7) & ~7L)
+
+typedef struct
+{
+    char magic[4];           /* "BCIC".                          */
+    int format;              /* CACHE_FORMAT.                    */
+    int stage;               /* The 'stage' it was stored with.  */
+    int ninsts;              /* Bytes of bytecode.               */
+    int wide;                /* In the wide format.              */
+    int ncode;               /* Decoded instructions.            */
+    int verified;            /* 'prog->verified'.                */
+    int has_depth;           /* Whether the depths follow.       */
+    unsigned long key;       /* CACHE_KEY.                       */
+    unsigned long sum;       /* 'entry_sum' of the rest.         */
+} cache_header;
+
+/* One entry, when trimming the cache. */
+typedef struct
+{
+    char *name;
+    long size;
+    time_t used;
+} cache_entry;
+
+
+/* The cache directory, found once by 'find_cache_dir'. */
+static char cache_path[4096];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Does: Finds and creates the cache directory, storing its path in
+ * 'cache_path' (left empty if there is nowhere to put the cache).
+ * Batch workers can get here at the same time, so it is only ever run
+ * through 'pthread_once'.
+ * Arguments: Void.
+ * Returns: Void.
+ */
+static void find_cache_dir(void)
+{
+    char *path = cache_path;
+    size_t size = sizeof(cache_path);
+    char *base;
+    int n;
+
+    if ((base = getenv("BCI_CACHE_DIR")) != NULL && base[0] != '\0')
+    {
+        n = snprintf(path, size, "%s", base);
+    }
+    else if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+    {
+        n = snprintf(path, size, "%s/bci", base);
+    }
+    else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+    {
+        n = snprintf(path, size, "%s/.cache", base);
+
+        if (n > 0 && n < (int)size)
+        {
+            mkdir(path, 0700);
+        }
+
+        n = snprintf(path, size, "%s/.cache/bci", base);
+    }
+    else
+    {
+        return;
+    }
+
+    if (n <= 0 || n >= (int)size
+        || (mkdir(path, 0700) != 0 && access(path, W_OK) != 0))
+    {
+        path[0] = '\0';
+    }
+}
+
+
+/*
+ * Does: Finds (and, the first time, creates) the cache directory.
+ * Arguments: Void.
+ * Returns: Its path, or NULL if there is nowhere to put the cache.
+ */
+static char *cache_dir(void)
+{
+    pthread_once(&cache_once, find_cache_dir);
+    return cache_path[0] != '\0' ? cache_path : NULL;
+}
+
+
+/*
+ * Does: Adds bytes to a 64-bit FNV-1a hash.
+ * Arguments:
+ * -- h: The hash so far.
+ * -- bytes: The bytes.
+ * -- n: How many.
+ * Returns: The new hash.
+ */
+static unsigned long hash_bytes(unsigned long h, const void *bytes, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)bytes;
+
+    while (n-- > 0)
+    {
+        h = (h ^ *p++) * 1099511628211UL;
+    }
+
+    return h;
+}
+
+
+/*
+ * Does: Works out where the cache entry for a program belongs.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- stage: How far the program is prepared (PREP_*).
+ * -- path: Where to store the path.
+ * -- size: The size of 'path'.
+ * Returns: 1 on success, 0 if there is no cache directory.
+ */
+static int entry_path(vm_type *vm, int stage, char *path, size_t size)
+{
+    char *dir = cache_dir();
+    unsigned long h = 14695981039346656037UL;
+    int format = CACHE_FORMAT;
+    unsigned long key = CACHE_KEY;
+    int n;
+
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    h = hash_bytes(h, &format, sizeof(format));
+    h = hash_bytes(h, &key, sizeof(key));
+    h = hash_bytes(h, &vm->wide, sizeof(vm->wide));
+    h = hash_bytes(h, vm->inst, vm->ninsts);
+    n = snprintf(path, size, "%s/%016lx-%d.bcc", dir, h, stage);
+    return n > 0 && n < (int)size;
+}
+
+
+/*
+ * Does: Computes the checksum of the parts of an entry after its
+ * header (the padding between them left out).
+ * Arguments:
+ * -- inst: The bytecode.
+ * -- ninsts: Its length.
+ * -- code: The decoded instructions.
+ * -- depth: Their stack depths, or NULL.
+ * -- ncode: The number of instructions.
+ * Returns: The checksum.
+ */
+static unsigned long entry_sum(const void *inst, int ninsts,
+                               const decoded_inst *code, const int *depth,
+                               int ncode)
+{
+    unsigned long h = 14695981039346656037UL;
+
+    h = hash_bytes(h, inst, ninsts);
+    h = hash_bytes(h, code, ncode * sizeof(decoded_inst));
+
+    if (depth != NULL)
+    {
+        h = hash_bytes(h, depth, ncode * sizeof(int));
+    }
+
+    return h;
+}
+
+
+/*
+ * Does: Checks that a program loaded from the cache can't make an
+ * engine read or write out of bounds: that every jump (and SPAWN)
+ * lands inside it, and, if it is marked verified, that it names only
+ * real registers and that its depths are ones the verifier could have
+ * found.
+ * Arguments:
+ * -- prog: The loaded program.
+ * Returns: 1 if it is usable, 0 if not.
+ */
+static int check_entry(decoded_program *prog)
+{
+    decoded_inst *inst;
+    int i;
+
+    /* The sentinel: JMP 0 from the end. */
+    inst = &prog->code[prog->ncode - 1];
+
+    if (inst->op != JMP || inst->arg != 0)
+    {
+        return 0;
+    }
+
+    if (prog->verified && (prog->depth == NULL || prog->depth[0] != 0))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        inst = &prog->code[i];
+
+        switch (inst->op)
+        {
+        case JMP:
+        case JZ:
+        case JNZ:
+        case SPAWN:
+        case JEQI:
+        case JNEI:
+        case JZR:
+        case JNZR:
+            if (inst->arg < 0 || inst->arg >= prog->ncode)
+            {
+                return 0;
+            }
+            break;
+
+        case LOAD:
+        case STORE:
+            /* Only the unchecked engines rely on this. */
+            if (prog->verified && (inst->arg < 0 || inst->arg >= NREGS))
+            {
+                return 0;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        /* Superinstructions name registers in 'arg2' (and 'arg3'). */
+        if (inst->op >= ADDI && inst->op <= JNZR && inst->op != MOVI
+            && (inst->arg2 < 0 || inst->arg2 >= NREGS))
+        {
+            return 0;
+        }
+
+        if (inst->op >= ADDI && inst->op <= MOVI
+            && (inst->arg < 0 || inst->arg >= NREGS))
+        {
+            return 0;
+        }
+
+        if (inst->op >= ADDR && inst->op <= MULR
+            && (inst->arg3 < 0 || inst->arg3 >= NREGS))
+        {
+            return 0;
+        }
+
+        /* 'do_push' refuses at STACK_SIZE - 1. */
+        if (prog->verified
+            && (prog->depth[i] < -1 || prog->depth[i] > STACK_SIZE - 1))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * Does: Works out where each part of an entry starts.
+ * Arguments:
+ * -- hdr: The entry's header.
+ * -- code: Where to store the offset of the instructions.
+ * -- depth: Where to store the offset of the depths.
+ * Returns: The size of the whole entry.
+ */
+static long entry_layout(cache_header *hdr, long *code, long *depth)
+{
+    *code = ALIGN8(ALIGN8((long)sizeof(cache_header)) + hdr->ninsts);
+    *depth = ALIGN8(*code + (long)hdr->ncode * sizeof(decoded_inst));
+    return *depth + (hdr->has_depth ? (long)hdr->ncode * sizeof(int) : 0);
+}
+
+
+/*
+ * Does: Looks for a program in the cache.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- stage: How far it must have been prepared (PREP_*).
+ * -- prog: Where to store the prepared program.
+ * Returns: 1 on a hit, 0 on a miss.  An entry that is damaged (its
+ * checksum is wrong) or fails 'check_entry' is a miss.
+ */
+int cache_load(vm_type *vm, int stage, decoded_program *prog)
+{
+    char path[4200];
+    struct stat st;
+    cache_header *hdr;
+    char *map;
+    long code, depth;
+    int fd, ok;
+
+    if (!entry_path(vm, stage, path, sizeof(path))
+        || (fd = open(path, O_RDONLY)) < 0)
+    {
+        return 0;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cache_header))
+    {
+        close(fd);
+        return 0;
+    }
+
+    map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    hdr = (cache_header *)map;
+    ok = memcmp(hdr->magic, "BCIC", 4) == 0
+         && hdr->format == CACHE_FORMAT
+         && hdr->key == CACHE_KEY
+         && hdr->stage == stage
+         && hdr->ninsts == vm->ninsts
+         && hdr->wide == vm->wide
+         && hdr->ncode > 0
+         && entry_layout(hdr, &code, &depth) == (long)st.st_size
+         && memcmp(map + ALIGN8((long)sizeof(cache_header)), vm->inst,
+                   vm->ninsts) == 0
+         && (hdr->has_depth || !hdr->verified)
+         && hdr->sum == entry_sum(vm->inst, vm->ninsts,
+                                  (decoded_inst *)(map + code),
+                                  hdr->has_depth ? (int *)(map + depth)
+                                  : NULL, hdr->ncode);
+
+    if (ok)
+    {
+        prog->ncode = hdr->ncode;
+        prog->verified = hdr->verified;
+        prog->profile = NULL;
+        prog->trace = 0;
+        prog->code = (decoded_inst *)checked_malloc(hdr->ncode
+                                                    * sizeof(decoded_inst));
+        prog->depth = NULL;
+
+        if (hdr->has_depth)
+        {
+            prog->depth = (int *)checked_malloc(hdr->ncode * sizeof(int));
+        }
+
+        memcpy(prog->code, map + code, hdr->ncode * sizeof(decoded_inst));
+
+        if (hdr->has_depth)
+        {
+            memcpy(prog->depth, map + depth, hdr->ncode * sizeof(int));
+        }
+    }
+
+    munmap(map, st.st_size);
+
+    if (ok && !check_entry(prog))
+    {
+        free_decoded(prog);
+        ok = 0;
+    }
+
+    if (ok)
+    {
+        /* Recently used: it goes to the back of the eviction queue. */
+        utimes(path, NULL);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Does: Writes zero bytes to a file until its length is a multiple of
+ * 8.
+ * Arguments:
+ * -- fp: The file.
+ * -- len: Its length so far.
+ * Returns: The new length.
+ */
+static long pad8(FILE *fp, long len)
+{
+    while (len % 8 != 0)
+    {
+        putc(0, fp);
+        len++;
+    }
+
+    return len;
+}
+
+
+/*
+ * Does: Orders cache entries by when they were last used, oldest first.
+ * Arguments:
+ * -- a, b: The entries.
+ * Returns: Negative, zero or positive, as for 'qsort'.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    time_t x = ((const cache_entry *)a)->used;
+    time_t y = ((const cache_entry *)b)->used;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Does: Removes the least recently used entries until the cache is no
+ * bigger than its limit.
+ * Arguments:
+ * -- dir: The cache directory.
+ * Returns: Void.
+ */
+static void trim_cache(char *dir)
+{
+    char path[4200];
+    struct dirent *d;
+    struct stat st;
+    cache_entry *entries = NULL, *more;
+    long total = 0, limit = CACHE_LIMIT;
+    int n = 0, size = 0, i;
+    size_t len;
+    char *env;
+    DIR *dp;
+
+    if ((env = getenv("BCI_CACHE_LIMIT")) != NULL && env[0] != '\0')
+    {
+        limit = strtol(env, NULL, 10);
+    }
+
+    if ((dp = opendir(dir)) == NULL)
+    {
+        return;
+    }
+
+    while ((d = readdir(dp)) != NULL)
+    {
+        len = strlen(d->d_name);
+
+        if (len < 4 || strcmp(d->d_name + len - 4, ".bcc") != 0)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        if (n == size)
+        {
+            size = size ? 2 * size : 64;
+            more = (cache_entry *)realloc(entries,
+                                          size * sizeof(cache_entry));
+
+            if (more == NULL)
+            {
+                break;
+            }
+
+            entries = more;
+        }
+
+        entries[n].name = strdup(d->d_name);
+        entries[n].size = (long)st.st_size;
+        entries[n].used = st.st_mtime;
+
+        if (entries[n].name != NULL)
+        {
+            total += entries[n++].size;
+        }
+    }
+
+    closedir(dp);
+    qsort(entries, n, sizeof(cache_entry), compare_entries);
+
+    for (i = 0; i < n; i++)
+    {
+        if (total > limit)
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+
+            if (unlink(path) == 0)
+            {
+                total -= entries[i].size;
+            }
+        }
+
+        free(entries[i].name);
+    }
+
+    free(entries);
+}
+
+
+/*
+ * Does: Stores a prepared program in the cache.  Failing to is not an
+ * error: the next run just prepares it again.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- stage: How far it has been prepared (PREP_*).
+ * -- prog: The prepared program.
+ * Returns: Void.
+ */
+void cache_store(vm_type *vm, int stage, decoded_program *prog)
+{
+    char path[4200], tmp[4300];
+    cache_header hdr;
+    long len;
+    FILE *fp;
+    int fd, ok;
+
+    if (!entry_path(vm, stage, path, sizeof(path)))
+    {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "BCIC", 4);
+    hdr.format = CACHE_FORMAT;
+    hdr.key = CACHE_KEY;
+    hdr.stage = stage;
+    hdr.ninsts = vm->ninsts;
+    hdr.wide = vm->wide;
+    hdr.ncode = prog->ncode;
+    hdr.verified = prog->verified;
+    hdr.has_depth = prog->depth != NULL;
+    hdr.sum = entry_sum(vm->inst, vm->ninsts, prog->code, prog->depth,
+                        prog->ncode);
+
+    /*
+     * Written whole under another name, so no reader sees half of it.
+     * The name is unique ('mkstemp'): two batch threads can be storing
+     * the same program at once.
+     */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    if ((fd = mkstemp(tmp)) < 0)
+    {
+        return;
+    }
+
+    if ((fp = fdopen(fd, "wb")) == NULL)
+    {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    len = fwrite(&hdr, 1, sizeof(hdr), fp);
+    len = pad8(fp, len);
+    len += fwrite(vm->inst, 1, vm->ninsts, fp);
+    len = pad8(fp, len);
+    len += fwrite(prog->code, sizeof(decoded_inst), prog->ncode, fp)
+           * sizeof(decoded_inst);
+    len = pad8(fp, len);
+
+    if (prog->depth != NULL)
+    {
+        fwrite(prog->depth, sizeof(int), prog->ncode, fp);
+    }
+
+    ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return;
+    }
+
+    trim_cache(cache_dir());
+}
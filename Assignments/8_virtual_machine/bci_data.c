@@ -0,0 +1,194 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_data.c
+ *       Mapping files into a VM's data memory.
+ *
+ * The input file is mapped read-only and LDM reads it where it lies in
+ * the page cache: nothing is copied, and a file much bigger than
+ * memory is paged in as the program gets to it (the mapping is marked
+ * sequential, so the kernel reads ahead of a program that streams
+ * through it).  The output file is created, or resized, to the number
+ * of words asked for and mapped shared, so every STM lands in the file
+ * itself and nothing has to be written out afterwards.
+ *
+ * Both files hold little-endian int32s; a trailing partial word of the
+ * input is ignored.  Only regular files can be mapped.
+ *
+ * The mappings belong to the VM, not to a run: a program run again
+ * (as the fork server does) sees what earlier runs stored.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bci.h"
+
+
+/*
+ * Does: Unmaps the VM's data memory, leaving it empty.  Children a
+ * paused program left running are waited for first.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_unmap_data(vm_type *vm)
+{
+    vm_reap(vm);
+
+    if (vm->data_in != NULL)
+    {
+        munmap((void *)vm->data_in, (size_t)vm->ndata_in * sizeof(int));
+    }
+
+    if (vm->data_out != NULL)
+    {
+        munmap(vm->data_out, (size_t)vm->ndata_out * sizeof(int));
+    }
+
+    vm->data_in = NULL;
+    vm->data_out = NULL;
+    vm->ndata_in = 0;
+    vm->ndata_out = 0;
+}
+
+
+/*
+ * Does: Maps a file into memory.
+ * Arguments:
+ * -- fd: The open file.
+ * -- words: How many words of it to map (may be 0).
+ * -- prot: PROT_READ, or PROT_READ | PROT_WRITE for a shared mapping.
+ * Returns: The mapping, NULL if 'words' is 0, or MAP_FAILED.
+ */
+static void *map_words(int fd, long words, int prot)
+{
+    void *region;
+
+    if (words == 0)
+    {
+        return NULL;
+    }
+
+    region = mmap(NULL, (size_t)words * sizeof(int), prot,
+                  prot & PROT_WRITE ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+
+    if (region != MAP_FAILED)
+    {
+        madvise(region, (size_t)words * sizeof(int), MADV_SEQUENTIAL);
+    }
+
+    return region;
+}
+
+
+/*
+ * Does: Replaces the VM's data memory with files mapped into it.
+ * Errors are reported on stderr.
+ * Arguments:
+ * -- vm: The VM.
+ * -- input: The file of input words, or NULL for none.
+ * -- output: The file of output words, or NULL for none.
+ * -- words: How many output words there are; the file is created or
+ *    resized to fit.  -1 means as many as there are of input, or with
+ *    no input, as many as the file already holds.
+ * Returns: 1 on success, 0 if a file can't be opened or mapped or the
+ * memory would have more than MAX_DATA_WORDS words.
+ */
+int vm_map_data(vm_type *vm, char *input, char *output, long words)
+{
+    struct stat st;
+    void *region;
+    long nin = 0;
+    int fd;
+
+    vm_unmap_data(vm);
+
+    if (input != NULL)
+    {
+        fd = open(input, O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            fprintf(stderr, "bci_data.c: vm_map_data: can't map %s: %s\n",
+                    input, fd < 0 ? strerror(errno) : "not a regular file");
+
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            return 0;
+        }
+
+        nin = (long)(st.st_size / sizeof(int));
+        region = nin <= MAX_DATA_WORDS ? map_words(fd, nin, PROT_READ)
+                 : MAP_FAILED;
+        close(fd);
+
+        if (region == MAP_FAILED)
+        {
+            fprintf(stderr, "bci_data.c: vm_map_data: can't map %s\n",
+                    input);
+            return 0;
+        }
+
+        vm->data_in = (const int *)region;
+        vm->ndata_in = (int)nin;
+    }
+
+    if (output == NULL)
+    {
+        return 1;
+    }
+
+    fd = open(output, O_RDWR | O_CREAT, 0666);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "bci_data.c: vm_map_data: can't open %s: %s\n",
+                output, strerror(errno));
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        vm_unmap_data(vm);
+        return 0;
+    }
+
+    if (words < 0)
+    {
+        words = input != NULL ? nin : (long)(st.st_size / sizeof(int));
+    }
+
+    region = MAP_FAILED;
+
+    if (words <= MAX_DATA_WORDS - nin
+        && ftruncate(fd, (off_t)words * sizeof(int)) == 0)
+    {
+        region = map_words(fd, words, PROT_READ | PROT_WRITE);
+    }
+
+    close(fd);
+
+    if (region == MAP_FAILED)
+    {
+        fprintf(stderr, "bci_data.c: vm_map_data: can't map %ld words of "
+                "%s\n", words, output);
+        vm_unmap_data(vm);
+        return 0;
+    }
+
+    vm->data_out = (int *)region;
+    vm->ndata_out = (int)words;
+    return 1;
+}
@@ -0,0 +1,462 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_decode.c
+ *       Load-time decoding of the bytecode into fixed-width
+ *       instructions, and an interpreter loop that runs them.
+ *
+ * 'execute_program' re-parses the operands of PUSH, LOAD, STORE, JMP,
+ * JZ and JNZ with 'read_n_byte_integer' every time they execute.  Here
+ * the byte stream is walked once, every operand is widened up front
+ * and jump targets are turned into array indices, so the hot loop
+ * never touches 'vm->inst' again.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/*
+ * Does: Finds the width of an opcode's operand in the byte stream.
+ * Arguments:
+ * -- op: The opcode.
+ * -- wide: Whether the program is in the wide format.
+ * Returns: The operand width in bytes (0 for no operand).
+ */
+int operand_width(int op, int wide)
+{
+    switch (op)
+    {
+    case PUSH:
+        return 4;
+
+    case LOAD:
+    case STORE:
+        return 1;
+
+    case JMP:
+    case JZ:
+    case JNZ:
+    case SPAWN:
+        return wide ? 4 : 2;
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Does: Names an opcode, including the superinstructions, for
+ * diagnostics and reports.
+ * Arguments:
+ * -- op: The opcode.
+ * Returns: Its name.
+ */
+const char *op_name(int op)
+{
+    static const char *names[] =
+    {
+        "NOP", "PUSH", "POP", "LOAD", "STORE", "JMP", "JZ", "JNZ",
+        "ADD", "SUB", "MUL", "DIV", "PRINT", "STOP", "LDM", "STM",
+        "MSIZE", "SPAWN", "JOIN"
+    };
+    static const char *super_names[] =
+    {
+        "ADDI", "SUBI", "MULI", "ADDR", "SUBR", "MULR", "MOVI",
+        "JEQI", "JNEI", "JZR", "JNZR"
+    };
+
+    if (op >= NOP && op <= JOIN)
+    {
+        return names[op];
+    }
+    else if (op >= ADDI && op <= JNZR)
+    {
+        return super_names[op - ADDI];
+    }
+
+    return "INVALID";
+}
+
+
+/*
+ * Does: Decodes the program in 'vm->inst' into 'prog'.
+ *
+ * NOTES:
+ * 1) Only the 'vm->ninsts' loaded bytes are decoded.  Everything after
+ *    them is zero, i.e. a run of NOPs which ends with 'vm->ip' wrapping
+ *    back to 0; the final sentinel JMP stands in for all of it.  (A
+ *    wide program has no NOPs after it, but wraps all the same.)
+ * 2) Invalid opcodes decode to INVALID; executing one stops the
+ *    program, as in 'execute_program'.
+ * 3) Decoding fails if a jump lands inside another instruction, or if
+ *    an operand runs past the end of the address space.
+ * 4) A jump outside the address space (only possible in a wide
+ *    program) is ignored when it runs, so it decodes to a jump to the
+ *    next instruction.
+ * 5) SPAWN's operand becomes a decoded index too, so that the passes
+ *    that move code around keep it pointing at the child's first
+ *    instruction ('pc' gives its address back).  Outside the address
+ *    space, where the child's instruction pointer wraps to 0, it
+ *    decodes to instruction 0.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- prog: Where to store the decoded program.
+ * Returns: 1 on success, 0 if the program must be run undecoded.
+ */
+int decode_program(vm_type *vm, decoded_program *prog)
+{
+    int *index;   /* Decoded index of each byte address, or -1. */
+    int pc, end;
+    int i, j, n;
+    int op, width;
+    unsigned int val;
+
+    prog->code = NULL;
+    prog->ncode = 0;
+    prog->verified = 0;
+    prog->depth = NULL;
+    prog->profile = NULL;
+    prog->trace = 0;
+
+    index = (int *)checked_malloc(vm->nspace * sizeof(int));
+
+    for (pc = 0; pc < vm->nspace; pc++)
+    {
+        index[pc] = -1;
+    }
+
+    /* One entry per instruction (at most one per byte) + sentinel. */
+    prog->code = (decoded_inst *)checked_malloc(
+        (vm->ninsts + 1) * sizeof(decoded_inst));
+
+    /* Pass 1: walk the byte stream, widening every operand. */
+    n = 0;
+    pc = 0;
+
+    while (pc < vm->ninsts)
+    {
+        op = vm->inst[pc];
+        width = operand_width(op, vm->wide);
+
+        if (pc + 1 + width > vm->nspace)
+        {
+            /* The operand would wrap around the address space. */
+            free(index);
+            free_decoded(prog);
+            return 0;
+        }
+
+        /* Little-endian, like 'read_n_byte_integer'. */
+        val = 0;
+
+        for (j = width - 1; j >= 0; j--)
+        {
+            val = (val << 8) | vm->inst[pc + 1 + j];
+        }
+
+        index[pc] = n;
+
+        if (op > JOIN)
+        {
+            prog->code[n].op = INVALID;
+            prog->code[n].arg = op;
+        }
+        else
+        {
+            prog->code[n].op = op;
+            prog->code[n].arg = (int)val;
+        }
+
+        prog->code[n].arg2 = 0;
+        prog->code[n].arg3 = 0;
+        prog->code[n].pc = pc;
+        n++;
+
+        pc += 1 + width;
+    }
+
+    /* The sentinel: the zero-filled tail of the buffer. */
+    end = pc;
+    prog->code[n].op = JMP;
+    prog->code[n].arg = 0;
+    prog->code[n].arg2 = 0;
+    prog->code[n].arg3 = 0;
+    prog->code[n].pc = end;
+    prog->ncode = n + 1;
+
+    /* Pass 2: turn byte addresses into decoded indices. */
+    for (i = 0; i < n; i++)
+    {
+        op = prog->code[i].op;
+
+        if (op != JMP && op != JZ && op != JNZ && op != SPAWN)
+        {
+            continue;
+        }
+
+        pc = prog->code[i].arg;
+
+        if (pc < 0 || pc >= vm->nspace)
+        {
+            /* Nowhere: the jump does nothing (but JZ and JNZ pop). */
+            prog->code[i].arg = op == SPAWN ? 0 : i + 1;
+        }
+        else if (pc >= end)
+        {
+            /* Somewhere in the NOP tail: same as the sentinel. */
+            prog->code[i].arg = n;
+        }
+        else if (index[pc] >= 0)
+        {
+            prog->code[i].arg = index[pc];
+        }
+        else
+        {
+            /* A jump into the middle of an instruction. */
+            free(index);
+            free_decoded(prog);
+            return 0;
+        }
+    }
+
+    free(index);
+    return 1;
+}
+
+
+/*
+ * Does: Frees a decoded program.
+ * Arguments:
+ * -- prog: The decoded program.
+ * Returns: Void.
+ */
+void free_decoded(decoded_program *prog)
+{
+    free_profile(prog);
+    free(prog->depth);
+    prog->depth = NULL;
+    free(prog->code);
+    prog->code = NULL;
+    prog->ncode = 0;
+}
+
+
+/*
+ * Does: Reads the CPU's time-stamp counter, for the profiler.
+ * Arguments: Void.
+ * Returns: The cycle count, or 0 where there is no 'rdtsc'.
+ */
+static unsigned long read_cycles(void)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Does: Writes an instruction about to be run to stderr, for the
+ * tracing variants of the interpreter loop.
+ * Arguments:
+ * -- vm: The VM.
+ * -- code: The decoded program.
+ * -- inst: The instruction.
+ * Returns: Void.
+ */
+static void trace_inst(vm_type *vm, decoded_inst *code, decoded_inst *inst)
+{
+    switch (inst->op)
+    {
+    case PUSH:
+    case LOAD:
+    case STORE:
+        fprintf(stderr, "exec: %5d  %-5s %d", inst->pc, op_name(inst->op),
+                inst->arg);
+        break;
+
+    case JMP:
+    case JZ:
+    case JNZ:
+    case SPAWN:
+        fprintf(stderr, "exec: %5d  %-5s %d", inst->pc, op_name(inst->op),
+                code[inst->arg].pc);
+        break;
+
+    case JZR:
+    case JNZR:
+        fprintf(stderr, "exec: %5d  %-5s %d %d", inst->pc,
+                op_name(inst->op), inst->arg2, code[inst->arg].pc);
+        break;
+
+    case JEQI:
+    case JNEI:
+        fprintf(stderr, "exec: %5d  %-5s %d %d %d", inst->pc,
+                op_name(inst->op), inst->arg2, inst->arg3,
+                code[inst->arg].pc);
+        break;
+
+    case ADDI:
+    case SUBI:
+    case MULI:
+    case ADDR:
+    case SUBR:
+    case MULR:
+    case MOVI:
+        fprintf(stderr, "exec: %5d  %-5s %d %d %d", inst->pc,
+                op_name(inst->op), inst->arg, inst->arg2, inst->arg3);
+        break;
+
+    default:
+        fprintf(stderr, "exec: %5d  %-5s", inst->pc, op_name(inst->op));
+        break;
+    }
+
+    fprintf(stderr, "\t(sp %d)\n", vm->sp);
+}
+
+
+/*
+ * The interpreter loop lives in bci_decode_loop.h and is compiled once
+ * for every combination of its features: stack and register checks
+ * (needed unless 'verify_program' has proved they can never fail),
+ * profiling and tracing.  'select_decoded' picks the right one once,
+ * before the program starts, so a run only pays for the features it
+ * uses.  The variants used elsewhere are public: 'execute_decoded' is
+ * the plain checked loop, 'execute_decoded_unchecked' the plain
+ * unchecked one and 'execute_decoded_profiled' the checked one with
+ * profiling.
+ */
+
+#define EXECUTE_NAME  execute_decoded
+#define EXECUTE_SCOPE
+#define CHECKED       1
+#define PROFILE       0
+#define TRACE         0
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_unchecked
+#define EXECUTE_SCOPE
+#define CHECKED       0
+#define PROFILE       0
+#define TRACE         0
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_profiled
+#define EXECUTE_SCOPE
+#define CHECKED       1
+#define PROFILE       1
+#define TRACE         0
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_unchecked_profiled
+#define EXECUTE_SCOPE static
+#define CHECKED       0
+#define PROFILE       1
+#define TRACE         0
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_traced
+#define EXECUTE_SCOPE static
+#define CHECKED       1
+#define PROFILE       0
+#define TRACE         1
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_unchecked_traced
+#define EXECUTE_SCOPE static
+#define CHECKED       0
+#define PROFILE       0
+#define TRACE         1
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_profiled_traced
+#define EXECUTE_SCOPE static
+#define CHECKED       1
+#define PROFILE       1
+#define TRACE         1
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+#define EXECUTE_NAME  execute_decoded_unchecked_profiled_traced
+#define EXECUTE_SCOPE static
+#define CHECKED       0
+#define PROFILE       1
+#define TRACE         1
+#include "bci_decode_loop.h"
+#undef EXECUTE_NAME
+#undef EXECUTE_SCOPE
+#undef CHECKED
+#undef PROFILE
+#undef TRACE
+
+
+/*
+ * Does: Picks the variant of the interpreter loop to run a program
+ * with.
+ * Arguments:
+ * -- checked: Whether it needs the stack and register checks.
+ * -- profile: Whether to fill in 'prog->profile'.
+ * -- trace: Whether to write each instruction to stderr.
+ * Returns: The variant.
+ */
+decoded_engine select_decoded(int checked, int profile, int trace)
+{
+    static const decoded_engine variants[2][2][2] =
+    {
+        {
+            { execute_decoded_unchecked, execute_decoded_unchecked_traced },
+            { execute_decoded_unchecked_profiled,
+              execute_decoded_unchecked_profiled_traced }
+        },
+        {
+            { execute_decoded, execute_decoded_traced },
+            { execute_decoded_profiled, execute_decoded_profiled_traced }
+        }
+    };
+
+    return variants[checked != 0][profile != 0][trace != 0];
+}
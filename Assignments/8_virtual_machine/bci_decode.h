@@ -0,0 +1,220 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_decode.h
+ *       Header file for the pre-decoded instruction stream.
+ *
+ */
+
+#ifndef BCI_DECODE_H
+#define BCI_DECODE_H
+
+#include "bci.h"
+
+/*
+ * Superinstructions.  These are produced by 'fuse_program' and only
+ * ever appear in decoded programs, never in bytecode.  'd' is the
+ * destination register ('arg'), 'r' and 's' source registers ('arg2'
+ * and 'arg3'), 'n' an immediate ('arg3') and 't' a jump target ('arg').
+ */
+
+/* ------------------ replaces: ----------------------------------- */
+#define ADDI    0x20  /* LOAD r; PUSH n; ADD; STORE d               */
+#define SUBI    0x21  /* LOAD r; PUSH n; SUB; STORE d               */
+#define MULI    0x22  /* LOAD r; PUSH n; MUL; STORE d               */
+#define ADDR    0x23  /* LOAD r; LOAD s; ADD; STORE d               */
+#define SUBR    0x24  /* LOAD r; LOAD s; SUB; STORE d               */
+#define MULR    0x25  /* LOAD r; LOAD s; MUL; STORE d               */
+#define MOVI    0x26  /* PUSH n; STORE d                            */
+#define JEQI    0x27  /* LOAD r; PUSH n; SUB; JZ t                  */
+#define JNEI    0x28  /* LOAD r; PUSH n; SUB; JNZ t                 */
+#define JZR     0x29  /* LOAD r; JZ t                               */
+#define JNZR    0x2a  /* LOAD r; JNZ t                              */
+
+/*
+ * Any byte that isn't an opcode decodes to INVALID, with the byte
+ * itself in 'arg'.  It can't be confused with a superinstruction.
+ */
+#define INVALID 0x100
+
+
+/*
+ * A decoded instruction.  Operands are read out of 'vm->inst' once, at
+ * load time, and widened to an 'int'.  For jumps 'arg' is the index of
+ * the target in the decoded array, not a byte address.
+ */
+
+typedef struct
+{
+    int op;      /* Opcode (see bci.h and above).            */
+    int arg;     /* Operand, or jump target as an index.     */
+    int arg2;    /* Extra operands of superinstructions.     */
+    int arg3;
+    int pc;      /* Byte address of the instruction.         */
+} decoded_inst;
+
+
+/*
+ * A decoded program.  The last entry is always a sentinel standing in
+ * for the zero-filled (all NOP) rest of 'vm->inst': it jumps back to
+ * instruction 0, just as 'vm->ip' wraps around in 'execute_program'.
+ */
+
+typedef struct
+{
+    unsigned long *count;    /* Times each instruction ran.            */
+    unsigned long *taken;    /* Times each conditional jump was taken. */
+    unsigned long *cycles;   /* Cycles spent in each, or NULL if
+                                cycles aren't being counted.          */
+} profile_data;
+
+typedef struct
+{
+    decoded_inst *code;      /* The decoded instructions.     */
+    int ncode;               /* Number of entries in 'code'.   */
+    int verified;            /* Passed 'verify_program'.       */
+    int *depth;              /* Stack depth before each
+                                instruction, if verified.      */
+    profile_data *profile;   /* Per-instruction counts, or NULL
+                                (see bci_profile.c).           */
+    int trace;               /* Write each instruction run to
+                                stderr.                        */
+} decoded_program;
+
+
+/*
+ * Decode the program loaded in 'vm->inst'.  Returns 0 (and leaves
+ * 'prog' empty) if the program can't be represented, e.g. because a
+ * jump lands in the middle of an instruction; callers should then run
+ * the bytecode directly.
+ */
+int decode_program(vm_type *vm, decoded_program *prog);
+void free_decoded(decoded_program *prog);
+const char *op_name(int op);
+int operand_width(int op, int wide);
+
+void execute_decoded(vm_type *vm, decoded_program *prog);
+void execute_decoded_unchecked(vm_type *vm, decoded_program *prog);
+void execute_decoded_profiled(vm_type *vm, decoded_program *prog);
+
+/*
+ * The decoded-stream interpreter comes in a variant for every
+ * combination of checks, profiling and tracing; pick one with
+ * 'select_decoded'.
+ */
+typedef void (*decoded_engine)(vm_type *vm, decoded_program *prog);
+
+decoded_engine select_decoded(int checked, int profile, int trace);
+void execute_tos(vm_type *vm, decoded_program *prog);
+int execute_jit(vm_type *vm, decoded_program *prog, int stats);
+void execute_traced(vm_type *vm, decoded_program *prog, int stats);
+
+
+/*
+ * Check, before running a program, that it can never overflow or
+ * underflow the stack, jump into the middle of an instruction or name
+ * a register past NREGS (bci_verify.c).  On success, sets
+ * 'prog->verified' and returns 1; otherwise describes the first
+ * problem on 'report' (if not NULL) and returns 0.
+ */
+int verify_program(vm_type *vm, decoded_program *prog, FILE *report);
+
+
+/*
+ * The register IR (bci_reg.c).  Operands are indices into one array of
+ * values: the NREGS registers, then the STACK_SIZE stack slots, then
+ * the program's constants.
+ */
+
+#define R_MOV      0   /* dst = a                   */
+#define R_ADD      1   /* dst = a + b               */
+#define R_SUB      2   /* dst = a - b               */
+#define R_MUL      3   /* dst = a * b               */
+#define R_DIV      4   /* dst = a / b, as 'do_div'  */
+#define R_PRINT    5   /* print a                   */
+#define R_JMP      6   /* go to target              */
+#define R_JZ       7   /* if a == 0, go to target   */
+#define R_JNZ      8   /* if a != 0, go to target   */
+#define R_JEQ      9   /* if a == b, go to target   */
+#define R_JNE     10   /* if a != b, go to target   */
+#define R_STOP    11   /* stop; 'a' is the stack depth */
+#define R_INVALID 12   /* stop; 'b' is the bad byte */
+#define R_LDM     13   /* dst = data word a         */
+#define R_STM     14   /* data word a = b           */
+#define R_MSIZE   15   /* dst = input words         */
+#define R_SPAWN   16   /* dst = handle of a child started at address a */
+#define R_JOIN    17   /* dst = result of child a   */
+
+typedef struct
+{
+    int op;
+    int dst;
+    int a;
+    int b;
+    int target;  /* Index of the target in the IR. */
+} reg_inst;
+
+typedef struct
+{
+    reg_inst *code;   /* The IR instructions.                  */
+    int ncode;
+    int *init;        /* Initial values (zeroes, then constants). */
+    int nvals;        /* Size of the value array.              */
+} reg_program;
+
+int translate_to_registers(decoded_program *prog, reg_program *ir);
+void free_registers(reg_program *ir);
+void execute_registers(vm_type *vm, reg_program *ir);
+
+
+/*
+ * The profiler (bci_profile.c).  'new_profile' attaches empty counters
+ * to a program for 'execute_decoded_profiled' to fill in.
+ */
+void new_profile(decoded_program *prog, int cycles);
+void free_profile(decoded_program *prog);
+void print_profile(decoded_program *prog, FILE *fp);
+void write_profile_json(decoded_program *prog, FILE *fp);
+
+
+/*
+ * What 'fuse_program' did.  Each superinstruction replaces 2 or 4
+ * instructions, saving 1 or 3 dispatches every time it runs.
+ */
+
+typedef struct
+{
+    int reg_imm;       /* ADDI, SUBI, MULI.              */
+    int reg_reg;       /* ADDR, SUBR, MULR.              */
+    int move_imm;      /* MOVI.                          */
+    int branch;        /* JEQI, JNEI, JZR, JNZR.         */
+    int fusions;       /* Total superinstructions made.  */
+    int saved;         /* Instructions (dispatches) removed. */
+} fuse_stats;
+
+void fuse_program(decoded_program *prog, fuse_stats *stats);
+void print_fuse_stats(fuse_stats *stats);
+
+
+/*
+ * The on-disk cache of prepared programs (bci_cache.c).  'stage' says
+ * how far a program has been prepared: an entry is only used for a
+ * program prepared the same way.
+ */
+#define PREP_DECODED   0   /* Just decoded.                 */
+#define PREP_VERIFIED  1   /* Decoded and verified.         */
+#define PREP_FUSED     2   /* Decoded, verified and fused.  */
+
+int cache_load(vm_type *vm, int stage, decoded_program *prog);
+void cache_store(vm_type *vm, int stage, decoded_program *prog);
+
+
+/*
+ * 'vm_execute' in two halves, for running a program many times with
+ * the load-time work done once (see bci_server.c).
+ */
+int vm_prepare(vm_type *vm, run_options *opts, decoded_program *prog);
+int vm_run_prepared(vm_type *vm, run_options *opts, decoded_program *prog);
+
+
+#endif  /* BCI_DECODE_H */
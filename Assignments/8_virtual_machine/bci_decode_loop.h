@@ -0,0 +1,353 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_decode_loop.h
+ *       The decoded-stream interpreter loop, as a template.
+ *
+ * Before including this file, define EXECUTE_NAME as the name of the
+ * function to generate, EXECUTE_SCOPE as 'static' or nothing, and
+ * CHECKED, PROFILE and TRACE as 1 or 0.
+ *
+ * With CHECKED 0, every stack overflow / underflow test and register
+ * range test is compiled out; that is only safe for programs
+ * 'verify_program' accepts.  (Data memory accesses are always
+ * checked.)  With PROFILE 1, the loop counts every
+ * instruction and every taken branch in 'prog->profile', and charges
+ * it with the cycles up to the next one if the profile asks for that.
+ * With TRACE 1, it writes each instruction to stderr before running
+ * it.  A feature turned off is preprocessed away, so it costs nothing.
+ *
+ */
+
+#if CHECKED
+
+#define D_PUSH(x)    PUSH_TOS(x)
+#define D_POP()      POP_TOS()
+#define REG_OK(r)    ((r) < NREGS)
+#define NO_ROOM(n)   (vm->sp >= STACK_SIZE - (n))
+
+#else
+
+#define D_PUSH(x)    vm->stack[vm->sp++] = (x)
+#define D_POP()      vm->sp--
+#define REG_OK(r)    1
+#define NO_ROOM(n)   0
+
+#endif
+
+#if PROFILE
+
+#define PROFILE_INST(n)                             \
+    prof->count[n]++;                               \
+    if (prof->cycles != NULL)                       \
+    {                                               \
+        now = read_cycles();                        \
+        prof->cycles[last] += now - then;           \
+        then = now;                                 \
+        last = (n);                                 \
+    }
+#define PROFILE_TAKEN()  prof->taken[inst - code]++
+
+#else
+
+#define PROFILE_INST(n)
+#define PROFILE_TAKEN()
+
+#endif
+
+#if TRACE
+#define TRACE_INST()     trace_inst(vm, code, inst)
+#else
+#define TRACE_INST()
+#endif
+
+
+/*
+ * Does: Executes a decoded program.  Produces the same output as
+ * running the original bytecode with 'execute_program'.  Without
+ * CHECKED, the program must have passed 'verify_program'; with
+ * PROFILE, it must have a profile (see 'new_profile').
+ * Arguments:
+ * -- vm: The VM.
+ * -- prog: The decoded program.
+ * Returns: Void.
+ */
+EXECUTE_SCOPE void EXECUTE_NAME(vm_type *vm, decoded_program *prog)
+{
+    decoded_inst *code = prog->code;
+    decoded_inst *inst;
+    int i = 0;   /* Index of the next instruction to run. */
+    int a, b;
+#if PROFILE
+    profile_data *prof = prog->profile;
+    unsigned long then = read_cycles(), now;
+    int last = 0;    /* The instruction being timed. */
+#endif
+
+    vm->sp = 0;
+
+    while (1)
+    {
+        PROFILE_INST(i);
+        inst = &code[i++];
+        TRACE_INST();
+
+        switch (inst->op)
+        {
+        case NOP:
+            break;
+
+        case PUSH:
+            D_PUSH(inst->arg);
+            break;
+
+        case POP:
+            D_POP();
+            break;
+
+        case LOAD:
+            /* An out-of-range register is ignored, as in 'do_load'. */
+            if (REG_OK(inst->arg))
+            {
+                D_PUSH(vm->reg[inst->arg]);
+            }
+            break;
+
+        case STORE:
+            D_POP();
+
+            if (REG_OK(inst->arg))
+            {
+                vm->reg[inst->arg] = vm->stack[vm->sp];
+            }
+            break;
+
+        case JMP:
+            i = inst->arg;
+            break;
+
+        case JZ:
+            D_POP();
+
+            if (vm->stack[vm->sp] == 0)
+            {
+                i = inst->arg;
+                PROFILE_TAKEN();
+            }
+            break;
+
+        case JNZ:
+            D_POP();
+
+            if (vm->stack[vm->sp] != 0)
+            {
+                i = inst->arg;
+                PROFILE_TAKEN();
+            }
+            break;
+
+        /*
+         * Binary operations: 'a' is the old TOS (S1), 'b' the element
+         * below it (S2).
+         */
+
+        case ADD:
+            D_POP();
+            a = vm->stack[vm->sp];
+            D_POP();
+            b = vm->stack[vm->sp];
+            D_PUSH(b + a);
+            break;
+
+        case SUB:
+            D_POP();
+            a = vm->stack[vm->sp];
+            D_POP();
+            b = vm->stack[vm->sp];
+            D_PUSH(b - a);
+            break;
+
+        case MUL:
+            D_POP();
+            a = vm->stack[vm->sp];
+            D_POP();
+            b = vm->stack[vm->sp];
+            D_PUSH(b * a);
+            break;
+
+        case DIV:
+            D_POP();
+            a = vm->stack[vm->sp];
+            D_POP();
+            b = vm->stack[vm->sp];
+
+            /* Same arithmetic as 'do_div'. */
+            D_PUSH(RECIPROCAL(a) * b);
+            break;
+
+        case PRINT:
+            D_POP();
+            vm_print(vm, vm->stack[vm->sp]);
+            break;
+
+        /*
+         * The data memory.  Its bounds are checked whatever CHECKED
+         * says: they depend on the data, which the verifier never sees.
+         */
+
+        case LDM:
+            D_POP();
+            a = DATA_LOAD(vm->stack[vm->sp]);
+            vm->stack[vm->sp++] = a;
+            break;
+
+        case STM:
+            D_POP();
+            a = vm->stack[vm->sp];
+            D_POP();
+            b = vm->stack[vm->sp];
+            DATA_STORE(a, b);
+            break;
+
+        case MSIZE:
+            D_PUSH(vm->ndata_in);
+            break;
+
+        /*
+         * Children.  SPAWN checks for room before it starts one, so an
+         * overflow starts nothing, as in 'do_spawn'.
+         */
+
+        case SPAWN:
+            if (NO_ROOM(1))
+            {
+                stack_overflow(vm);
+            }
+
+            a = vm_spawn(vm, code[inst->arg].pc, vm->reg);
+            vm->stack[vm->sp++] = a;
+            break;
+
+        case JOIN:
+            D_POP();
+            a = vm_join(vm, vm->stack[vm->sp]);
+            vm->stack[vm->sp++] = a;
+            break;
+
+        /*
+         * Superinstructions (see 'fuse_program').  Each one first
+         * checks that the instructions it replaces would have had room
+         * on the stack; if not, it pushes the way they would have, so
+         * the overflow is reported exactly as before.
+         */
+
+        case ADDI:
+        case SUBI:
+        case MULI:
+            if (NO_ROOM(2))
+            {
+                D_PUSH(vm->reg[inst->arg2]);
+                D_PUSH(inst->arg3);
+            }
+
+            a = vm->reg[inst->arg2];
+
+            if (inst->op == ADDI)
+            {
+                vm->reg[inst->arg] = a + inst->arg3;
+            }
+            else if (inst->op == SUBI)
+            {
+                vm->reg[inst->arg] = a - inst->arg3;
+            }
+            else
+            {
+                vm->reg[inst->arg] = a * inst->arg3;
+            }
+            break;
+
+        case ADDR:
+        case SUBR:
+        case MULR:
+            if (NO_ROOM(2))
+            {
+                D_PUSH(vm->reg[inst->arg2]);
+                D_PUSH(vm->reg[inst->arg3]);
+            }
+
+            a = vm->reg[inst->arg2];
+            b = vm->reg[inst->arg3];
+
+            if (inst->op == ADDR)
+            {
+                vm->reg[inst->arg] = a + b;
+            }
+            else if (inst->op == SUBR)
+            {
+                vm->reg[inst->arg] = a - b;
+            }
+            else
+            {
+                vm->reg[inst->arg] = a * b;
+            }
+            break;
+
+        case MOVI:
+            if (NO_ROOM(1))
+            {
+                D_PUSH(inst->arg3);
+            }
+
+            vm->reg[inst->arg] = inst->arg3;
+            break;
+
+        case JEQI:
+        case JNEI:
+            if (NO_ROOM(2))
+            {
+                D_PUSH(vm->reg[inst->arg2]);
+                D_PUSH(inst->arg3);
+            }
+
+            if ((vm->reg[inst->arg2] == inst->arg3) == (inst->op == JEQI))
+            {
+                i = inst->arg;
+                PROFILE_TAKEN();
+            }
+            break;
+
+        case JZR:
+        case JNZR:
+            if (NO_ROOM(1))
+            {
+                D_PUSH(vm->reg[inst->arg2]);
+            }
+
+            if ((vm->reg[inst->arg2] == 0) == (inst->op == JZR))
+            {
+                i = inst->arg;
+                PROFILE_TAKEN();
+            }
+            break;
+
+        case STOP:
+            return;
+
+        default:
+            fprintf(stderr, "execute_decoded: invalid instruction: %x\n",
+                    inst->arg);
+            fprintf(stderr, "\taborting program!\n");
+            vm->status = VM_INVALID;
+            return;
+        }
+    }
+}
+
+
+#undef D_PUSH
+#undef D_POP
+#undef REG_OK
+#undef NO_ROOM
+#undef PROFILE_INST
+#undef PROFILE_TAKEN
+#undef TRACE_INST
@@ -0,0 +1,404 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_emit.c
+ *       Ahead-of-time translation of bytecode programs to C.
+ *
+ * 'bci --emit-c prog.bcm > prog.c' writes a complete C program: one
+ * function holding the bytecode program, with a label at each jump
+ * target and a 'goto' for each JMP, JZ and JNZ, and a 'main' to call
+ * it.  Compiled with 'gcc -O2' it prints exactly what 'bci prog.bcm'
+ * prints, and exits the same way.
+ *
+ * The registers become locals.  So does the stack: if the verifier
+ * (bci_verify.c) knows its depth before every instruction, each stack
+ * slot is named by a constant index and needs no checks, so the C
+ * compiler can keep the whole stack in machine registers.  Otherwise
+ * the generated code keeps a stack pointer and checks it like
+ * 'do_push' and 'do_pop' do.
+ *
+ * The translation has no data memory, like 'bci' run without
+ * '--data-in' or '--data-out': MSIZE pushes 0, and LDM and STM stop
+ * the program with the error 'bci' reports.  Programs that SPAWN
+ * children aren't translated: the children run on the VM's threads.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* The code every translation starts with. */
+static const char *prologue =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "#define STACK_SIZE %d\n"
+    "\n"
+    "/* Arithmetic wraps, as it does in the interpreter. */\n"
+    "#define ADD(a, b) ((int)((unsigned int)(a) + (unsigned int)(b)))\n"
+    "#define SUB(a, b) ((int)((unsigned int)(a) - (unsigned int)(b)))\n"
+    "#define MUL(a, b) ((int)((unsigned int)(a) * (unsigned int)(b)))\n"
+    "#define RECIPROCAL(n) ((unsigned int)(n) + 1 <= 2 ? (n) : 0)\n"
+    "#define DIV(a, b) MUL(a, RECIPROCAL(b))\n"
+    "\n";
+
+/* Checked stack operations, for programs that don't verify. */
+static const char *checked_ops =
+    "#define PUSH(v) do { if (sp >= STACK_SIZE - 1) overflow(); "
+    "s[sp++] = (v); } while (0)\n"
+    "#define POP(x) do { if (sp == 0) underflow(); (x) = s[--sp]; } "
+    "while (0)\n"
+    "\n"
+    "static void overflow(void)\n"
+    "{\n"
+    "    fprintf(stderr, \"Stack overflow\");\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static void underflow(void)\n"
+    "{\n"
+    "    fprintf(stderr, \"Stack underflow\");\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n";
+
+
+/* For programs that use the (empty) data memory. */
+static const char *data_ops =
+    "static int bad_address(int n)\n"
+    "{\n"
+    "    fprintf(stderr, \"Bad data address %d\\n\", n);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n";
+
+
+/*
+ * Does: Writes the C for one instruction of a verified program, where
+ * the stack depth before it is known.
+ * Arguments:
+ * -- prog: The program.
+ * -- inst: The instruction.
+ * -- d: The stack depth before it.
+ * -- fp: Where to write the C.
+ * Returns: Void.
+ */
+static void emit_unchecked(decoded_program *prog, decoded_inst *inst,
+                           int d, FILE *fp)
+{
+    switch (inst->op)
+    {
+    case NOP:
+    case POP:
+        break;
+
+    case PUSH:
+        fprintf(fp, "    s[%d] = %d;\n", d, inst->arg);
+        break;
+
+    case LOAD:
+        fprintf(fp, "    s[%d] = r%d;\n", d, inst->arg);
+        break;
+
+    case STORE:
+        fprintf(fp, "    r%d = s[%d];\n", inst->arg, d - 1);
+        break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+        fprintf(fp, "    s[%d] = %s(s[%d], s[%d]);\n", d - 2,
+                op_name(inst->op), d - 2, d - 1);
+        break;
+
+    case PRINT:
+        fprintf(fp, "    printf(\"%%d\\n\", s[%d]);\n", d - 1);
+        break;
+
+    case LDM:
+        fprintf(fp, "    s[%d] = bad_address(s[%d]);\n", d - 1, d - 1);
+        break;
+
+    case STM:
+        fprintf(fp, "    bad_address(s[%d]);\n", d - 1);
+        break;
+
+    case MSIZE:
+        fprintf(fp, "    s[%d] = 0;\n", d);
+        break;
+
+    case JMP:
+        fprintf(fp, "    goto pc_%d;\n", prog->code[inst->arg].pc);
+        break;
+
+    case JZ:
+    case JNZ:
+        fprintf(fp, "    if (s[%d] %s 0) goto pc_%d;\n", d - 1,
+                inst->op == JZ ? "==" : "!=", prog->code[inst->arg].pc);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/*
+ * Does: Writes the C for one instruction, checking the stack pointer
+ * as the interpreter does.
+ * Arguments:
+ * -- prog: The program.
+ * -- inst: The instruction.
+ * -- fp: Where to write the C.
+ * Returns: Void.
+ */
+static void emit_checked(decoded_program *prog, decoded_inst *inst,
+                         FILE *fp)
+{
+    switch (inst->op)
+    {
+    case NOP:
+        break;
+
+    case PUSH:
+        fprintf(fp, "    PUSH(%d);\n", inst->arg);
+        break;
+
+    case POP:
+        fprintf(fp, "    POP(a);\n");
+        break;
+
+    case LOAD:
+        /* The interpreter ignores registers that don't exist. */
+        if (inst->arg < NREGS)
+        {
+            fprintf(fp, "    PUSH(r%d);\n", inst->arg);
+        }
+        break;
+
+    case STORE:
+        if (inst->arg < NREGS)
+        {
+            fprintf(fp, "    POP(r%d);\n", inst->arg);
+        }
+        else
+        {
+            fprintf(fp, "    POP(a);\n");
+        }
+        break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+        fprintf(fp, "    POP(a);\n    POP(b);\n    PUSH(%s(b, a));\n",
+                op_name(inst->op));
+        break;
+
+    case PRINT:
+        fprintf(fp, "    POP(a);\n    printf(\"%%d\\n\", a);\n");
+        break;
+
+    case LDM:
+        fprintf(fp, "    POP(a);\n    PUSH(bad_address(a));\n");
+        break;
+
+    case STM:
+        fprintf(fp, "    POP(a);\n    POP(b);\n    bad_address(a);\n");
+        break;
+
+    case MSIZE:
+        fprintf(fp, "    PUSH(0);\n");
+        break;
+
+    case JMP:
+        fprintf(fp, "    goto pc_%d;\n", prog->code[inst->arg].pc);
+        break;
+
+    case JZ:
+    case JNZ:
+        fprintf(fp, "    POP(a);\n    if (a %s 0) goto pc_%d;\n",
+                inst->op == JZ ? "==" : "!=", prog->code[inst->arg].pc);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/*
+ * Does: Translates the program loaded in a VM to a C program.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- source: The program's file name, for a comment.
+ * -- fp: Where to write the C.
+ * Returns: 1 on success, 0 if the program can't be translated (if it
+ * jumps into the middle of an instruction, or starts children).
+ */
+int vm_emit_c(vm_type *vm, char *source, FILE *fp)
+{
+    decoded_program prog;
+    decoded_inst *inst;
+    char *is_target;
+    int used[NREGS];
+    int i, r, checked, depth, arith = 0, data = 0;
+
+    if (!decode_program(vm, &prog))
+    {
+        fprintf(stderr, "bci_emit.c: vm_emit_c: can't translate %s: it "
+                "jumps into the middle of an instruction\n", source);
+        return 0;
+    }
+
+    for (i = 0; i < prog.ncode; i++)
+    {
+        if (prog.code[i].op == SPAWN || prog.code[i].op == JOIN)
+        {
+            fprintf(stderr, "bci_emit.c: vm_emit_c: can't translate %s: "
+                    "it uses %s\n", source, op_name(prog.code[i].op));
+            free_decoded(&prog);
+            return 0;
+        }
+    }
+
+    checked = !verify_program(vm, &prog, NULL);
+    is_target = (char *)checked_calloc(prog.ncode, 1);
+
+    for (r = 0; r < NREGS; r++)
+    {
+        used[r] = 0;
+    }
+
+    for (i = 0; i < prog.ncode; i++)
+    {
+        inst = &prog.code[i];
+
+        if (!checked && prog.depth[i] < 0)
+        {
+            continue;    /* Won't be written out. */
+        }
+
+        if (inst->op == JMP || inst->op == JZ || inst->op == JNZ)
+        {
+            is_target[inst->arg] = 1;
+        }
+        else if ((inst->op == LOAD || inst->op == STORE)
+                 && inst->arg < NREGS)
+        {
+            used[inst->arg] = 1;
+        }
+        else if (inst->op >= ADD && inst->op <= DIV)
+        {
+            arith = 1;
+        }
+        else if (inst->op >= LDM && inst->op <= MSIZE)
+        {
+            data = 1;
+            arith |= inst->op == STM;    /* It pops into 'b'. */
+        }
+    }
+
+    fprintf(fp, "/* Translated from %s by 'bci --emit-c'. */\n\n", source);
+    fprintf(fp, prologue, STACK_SIZE);
+
+    if (checked)
+    {
+        fprintf(fp, "%s", checked_ops);
+    }
+
+    if (data)
+    {
+        fprintf(fp, "%s", data_ops);
+    }
+
+    fprintf(fp, "static void run(void)\n{\n");
+    fprintf(fp, "    int s[STACK_SIZE];\n");
+
+    if (checked)
+    {
+        fprintf(fp, "    unsigned char sp = 0;\n    int a%s;\n",
+                arith ? ", b" : "");
+    }
+
+    for (r = 0; r < NREGS; r++)
+    {
+        if (used[r])
+        {
+            fprintf(fp, "    int r%d = 0;\n", r);
+        }
+    }
+
+    fprintf(fp, "\n");
+
+    /* The last instruction is the sentinel: JMP 0 from the end. */
+    for (i = 0; i < prog.ncode; i++)
+    {
+        inst = &prog.code[i];
+        depth = checked ? 0 : prog.depth[i];
+
+        if (depth < 0)
+        {
+            continue;    /* Can't be reached. */
+        }
+
+        if (is_target[i])
+        {
+            fprintf(fp, "pc_%d:\n", inst->pc);
+        }
+
+        if (i == prog.ncode - 1)
+        {
+            fprintf(fp, "    /* %d: end of program */\n", inst->pc);
+        }
+        else if (inst->op == INVALID)
+        {
+            fprintf(fp, "    /* %d: %x */\n", inst->pc, inst->arg);
+        }
+        else if (inst->op == PUSH || inst->op == LOAD
+                 || inst->op == STORE)
+        {
+            fprintf(fp, "    /* %d: %s %d */\n", inst->pc,
+                    op_name(inst->op), inst->arg);
+        }
+        else if (inst->op == JMP || inst->op == JZ || inst->op == JNZ)
+        {
+            fprintf(fp, "    /* %d: %s %d */\n", inst->pc,
+                    op_name(inst->op), prog.code[inst->arg].pc);
+        }
+        else
+        {
+            fprintf(fp, "    /* %d: %s */\n", inst->pc, op_name(inst->op));
+        }
+
+        if (inst->op == STOP)
+        {
+            fprintf(fp, "    return;\n");
+        }
+        else if (inst->op == INVALID)
+        {
+            fprintf(fp, "    fprintf(stderr, \"run: invalid instruction: "
+                    "%x\\n\\taborting program!\\n\");\n    return;\n",
+                    inst->arg);
+        }
+        else if (checked)
+        {
+            emit_checked(&prog, inst, fp);
+        }
+        else
+        {
+            emit_unchecked(&prog, inst, depth, fp);
+        }
+    }
+
+    fprintf(fp, "}\n\n");
+    fprintf(fp, "int main(void)\n{\n    run();\n    return 0;\n}\n");
+
+    free(is_target);
+    free_decoded(&prog);
+    return 1;
+}
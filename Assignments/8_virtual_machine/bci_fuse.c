@@ -0,0 +1,275 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_fuse.c
+ *       Peephole pass that replaces common instruction sequences in a
+ *       decoded program with superinstructions.
+ *
+ * Typical bytecode spends four dispatches on 'reg = reg - 1' (LOAD r;
+ * PUSH 1; SUB; STORE r) and two on a loop test (LOAD r; JZ t).  The
+ * superinstructions defined in bci_decode.h do the same work in one
+ * dispatch without touching the stack.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/*
+ * Does: Checks whether a decoded instruction is a jump of any kind (or
+ * a SPAWN), i.e. whether its 'arg' is a decoded index.
+ * Arguments:
+ * -- op: The opcode.
+ * Returns: 1 if it is a jump, 0 otherwise.
+ */
+static int is_jump(int op)
+{
+    switch (op)
+    {
+    case JMP:
+    case JZ:
+    case JNZ:
+    case JEQI:
+    case JNEI:
+    case JZR:
+    case JNZR:
+    case SPAWN:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Does: Checks for a LOAD of a real register.  LOADs of registers
+ * past NREGS don't push anything, so they can't be fused.
+ * Arguments:
+ * -- inst: The instruction.
+ * Returns: 1 if 'inst' is such a LOAD, 0 otherwise.
+ */
+static int is_load(decoded_inst *inst)
+{
+    return inst->op == LOAD && inst->arg < NREGS;
+}
+
+
+/*
+ * Does: Checks for a STORE to a real register.
+ * Arguments:
+ * -- inst: The instruction.
+ * Returns: 1 if 'inst' is such a STORE, 0 otherwise.
+ */
+static int is_store(decoded_inst *inst)
+{
+    return inst->op == STORE && inst->arg < NREGS;
+}
+
+
+/*
+ * Does: Tries to match a superinstruction at the start of 'seq'.
+ * Arguments:
+ * -- seq: The instructions to match (at least 'avail' of them).
+ * -- avail: How many instructions may be fused, i.e. how many follow
+ *    before the next jump target or the end of the program.
+ * -- fused: Where to store the superinstruction.  This may be the
+ *    same as 'seq'.
+ * -- stats: The statistics to update on a match.
+ * Returns: The number of instructions replaced, or 0 if none match.
+ */
+static int match(decoded_inst *seq, int avail, decoded_inst *fused,
+                 fuse_stats *stats)
+{
+    decoded_inst result = seq[0];
+    int k = 0;
+
+    if (avail >= 4 && is_load(&seq[0]))
+    {
+        if (seq[1].op == PUSH && is_store(&seq[3])
+            && (seq[2].op == ADD || seq[2].op == SUB
+                || seq[2].op == MUL))
+        {
+            /* LOAD r; PUSH n; ADD|SUB|MUL; STORE d */
+            result.op = seq[2].op == ADD ? ADDI
+                      : seq[2].op == SUB ? SUBI : MULI;
+            result.arg = seq[3].arg;
+            result.arg2 = seq[0].arg;
+            result.arg3 = seq[1].arg;
+            stats->reg_imm++;
+            k = 4;
+        }
+        else if (is_load(&seq[1]) && is_store(&seq[3])
+                 && (seq[2].op == ADD || seq[2].op == SUB
+                     || seq[2].op == MUL))
+        {
+            /* LOAD r; LOAD s; ADD|SUB|MUL; STORE d */
+            result.op = seq[2].op == ADD ? ADDR
+                      : seq[2].op == SUB ? SUBR : MULR;
+            result.arg = seq[3].arg;
+            result.arg2 = seq[0].arg;
+            result.arg3 = seq[1].arg;
+            stats->reg_reg++;
+            k = 4;
+        }
+        else if (seq[1].op == PUSH && seq[2].op == SUB
+                 && (seq[3].op == JZ || seq[3].op == JNZ))
+        {
+            /* LOAD r; PUSH n; SUB; JZ|JNZ t */
+            result.op = seq[3].op == JZ ? JEQI : JNEI;
+            result.arg = seq[3].arg;
+            result.arg2 = seq[0].arg;
+            result.arg3 = seq[1].arg;
+            stats->branch++;
+            k = 4;
+        }
+    }
+
+    if (k == 0 && avail >= 2)
+    {
+        if (is_load(&seq[0]) && (seq[1].op == JZ || seq[1].op == JNZ))
+        {
+            /* LOAD r; JZ|JNZ t */
+            result.op = seq[1].op == JZ ? JZR : JNZR;
+            result.arg = seq[1].arg;
+            result.arg2 = seq[0].arg;
+            stats->branch++;
+            k = 2;
+        }
+        else if (seq[0].op == PUSH && is_store(&seq[1]))
+        {
+            /* PUSH n; STORE d */
+            result.op = MOVI;
+            result.arg = seq[1].arg;
+            result.arg3 = seq[0].arg;
+            stats->move_imm++;
+            k = 2;
+        }
+    }
+
+    if (k > 0)
+    {
+        *fused = result;
+    }
+
+    return k;
+}
+
+
+/*
+ * Does: Replaces common instruction sequences in a decoded program
+ * with superinstructions, then compacts the program and fixes up all
+ * the jump targets.
+ *
+ * NOTES:
+ * 1) A sequence is only fused if no jump lands inside it, so every
+ *    jump target survives the rewrite.
+ * 2) Superinstructions keep the byte address ('pc') of the first
+ *    instruction they replace.
+ * Arguments:
+ * -- prog: The decoded program, rewritten in place.
+ * -- stats: Where to store what was done.
+ * Returns: Void.
+ */
+void fuse_program(decoded_program *prog, fuse_stats *stats)
+{
+    decoded_inst *code = prog->code;
+    int n = prog->ncode;
+    int *is_target;
+    int *new_index;
+    int i, j, k, avail;
+
+    stats->reg_imm = 0;
+    stats->reg_reg = 0;
+    stats->move_imm = 0;
+    stats->branch = 0;
+    stats->fusions = 0;
+    stats->saved = 0;
+
+    is_target = (int *)checked_calloc(n + 1, sizeof(int));
+    new_index = (int *)checked_malloc((n + 1) * sizeof(int));
+
+    for (i = 0; i < n; i++)
+    {
+        if (is_jump(code[i].op))
+        {
+            is_target[code[i].arg] = 1;
+        }
+    }
+
+    /*
+     * Rewrite in place: 'i' reads the old program and 'j' writes the
+     * new one.  Since j <= i, nothing is overwritten before it's read.
+     */
+    i = 0;
+    j = 0;
+
+    while (i < n)
+    {
+        /* Don't fuse across a jump target (or the sentinel). */
+        avail = 1;
+
+        while (avail < 4 && i + avail < n - 1 && !is_target[i + avail])
+        {
+            avail++;
+        }
+
+        new_index[i] = j;
+
+        if (prog->depth != NULL)
+        {
+            /* Same in-place order as 'code'. */
+            prog->depth[j] = prog->depth[i];
+        }
+
+        k = match(&code[i], avail, &code[j], stats);
+
+        if (k > 0)
+        {
+            stats->fusions++;
+            stats->saved += k - 1;
+        }
+        else
+        {
+            code[j] = code[i];
+            k = 1;
+        }
+
+        i += k;
+        j++;
+    }
+
+    /* Old indices that remain targets are all starts of sequences. */
+    for (i = 0; i < j; i++)
+    {
+        if (is_jump(code[i].op))
+        {
+            code[i].arg = new_index[code[i].arg];
+        }
+    }
+
+    prog->ncode = j;
+
+    free(is_target);
+    free(new_index);
+}
+
+
+/*
+ * Does: Reports what 'fuse_program' did on stderr.
+ * Arguments:
+ * -- stats: The statistics from 'fuse_program'.
+ * Returns: Void.
+ */
+void print_fuse_stats(fuse_stats *stats)
+{
+    fprintf(stderr, "fuse: %d superinstructions (%d reg-imm, "
+            "%d reg-reg, %d move-imm, %d branch)\n",
+            stats->fusions, stats->reg_imm, stats->reg_reg,
+            stats->move_imm, stats->branch);
+    fprintf(stderr, "fuse: %d instructions removed, saving that many "
+            "dispatches per pass over the program\n", stats->saved);
+}
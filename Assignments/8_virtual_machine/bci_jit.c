@@ -0,0 +1,673 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_jit.c
+ *       Template JIT compiler from decoded bytecode to x86-64.
+ *
+ * Every instruction of a decoded program is translated into a fixed
+ * sequence of machine code (its "template") in an mmap'd buffer.
+ * While the generated code runs, the VM state lives in callee-saved
+ * registers:
+ *
+ *   rbx:  &vm->stack[0]
+ *   r12:  &vm->reg[0]
+ *   r13d: the stack pointer (number of elements on the stack)
+ *
+ * so the element at the top of the stack is [rbx + r13*4 - 4].  PRINT
+ * and the stack overflow/underflow checks call back into C.  So do LDM
+ * and STM, but only for addresses outside the part of the data memory
+ * they usually hit (the input for LDM, the output for STM); that part
+ * is checked and accessed inline, its bounds built into the code.
+ * SPAWN and JOIN always call 'vm_spawn' and 'vm_join'.
+ * Jumps are emitted with a placeholder displacement and patched once
+ * every instruction's native offset is known.
+ *
+ * This file uses mmap and casts data pointers to function pointers,
+ * neither of which is ANSI C, so it is built with GNUFLAGS.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/* Fixup targets that aren't instructions. */
+#define TO_OVERFLOW   -1
+#define TO_UNDERFLOW  -2
+
+/* The most machine code any one template needs (LDM / STM). */
+#define MAX_TEMPLATE  80
+
+/* The most decoded instructions compiled (a wide program can have more). */
+#define MAX_JIT_INSTS  (0x7fff0000 / MAX_TEMPLATE)
+
+
+/*
+ * A rel32 displacement at 'pos' that must be pointed at 'target'
+ * (a decoded index, or one of the TO_* stubs).
+ */
+
+typedef struct
+{
+    int pos;
+    int target;
+} fixup;
+
+
+/* The code being generated. */
+
+typedef struct
+{
+    unsigned char *buf;   /* The mmap'd buffer.              */
+    int len;              /* Bytes emitted so far.           */
+    int size;             /* Size of the buffer.             */
+    fixup *fixups;        /* Displacements to patch.         */
+    int nfixups;
+} jit_code;
+
+
+/*
+ * Templates.  Operands are appended by the emit_* helpers below.
+ */
+
+/* push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi;
+   xor r13d, r13d */
+static const unsigned char prologue[] =
+    { 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xfb,
+      0x49, 0x89, 0xf4, 0x45, 0x31, 0xed };
+
+/* mov eax, r13d; pop r13; pop r12; pop rbx; ret */
+static const unsigned char epilogue[] =
+    { 0x44, 0x89, 0xe8, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3 };
+
+/* cmp r13d, STACK_SIZE - 1 (imm32 follows) */
+static const unsigned char cmp_sp_imm[] = { 0x41, 0x81, 0xfd };
+
+/* cmp r13d, 2 */
+static const unsigned char cmp_sp_2[] = { 0x41, 0x83, 0xfd, 0x02 };
+
+/* test r13d, r13d */
+static const unsigned char test_sp[] = { 0x45, 0x85, 0xed };
+
+/* inc r13d */
+static const unsigned char inc_sp[] = { 0x41, 0xff, 0xc5 };
+
+/* dec r13d */
+static const unsigned char dec_sp[] = { 0x41, 0xff, 0xcd };
+
+/* mov dword [rbx + r13*4], imm32 (imm32 follows) */
+static const unsigned char store_tos_imm[] = { 0x42, 0xc7, 0x04, 0xab };
+
+/* mov [rbx + r13*4], eax */
+static const unsigned char store_tos_eax[] = { 0x42, 0x89, 0x04, 0xab };
+
+/* mov eax, [rbx + r13*4] */
+static const unsigned char load_eax_tos[] = { 0x42, 0x8b, 0x04, 0xab };
+
+/* mov eax, [r12 + disp8] (disp8 follows) */
+static const unsigned char load_eax_reg[] = { 0x41, 0x8b, 0x44, 0x24 };
+
+/* mov [r12 + disp8], eax (disp8 follows) */
+static const unsigned char store_eax_reg[] = { 0x41, 0x89, 0x44, 0x24 };
+
+/* test eax, eax */
+static const unsigned char test_eax[] = { 0x85, 0xc0 };
+
+/* add [rbx + r13*4 - 4], eax */
+static const unsigned char add_s2[] = { 0x42, 0x01, 0x44, 0xab, 0xfc };
+
+/* sub [rbx + r13*4 - 4], eax */
+static const unsigned char sub_s2[] = { 0x42, 0x29, 0x44, 0xab, 0xfc };
+
+/* mov ecx, [rbx + r13*4 - 4]; imul ecx, eax;
+   mov [rbx + r13*4 - 4], ecx */
+static const unsigned char mul_s2[] =
+    { 0x42, 0x8b, 0x4c, 0xab, 0xfc, 0x0f, 0xaf, 0xc8,
+      0x42, 0x89, 0x4c, 0xab, 0xfc };
+
+/* RECIPROCAL(S1) * S2, as in 'do_div':
+   lea ecx, [rax + 1]; xor edx, edx; cmp ecx, 2; cmova eax, edx;
+   imul eax, [rbx + r13*4 - 4]; mov [rbx + r13*4 - 4], eax */
+static const unsigned char div_s2[] =
+    { 0x8d, 0x48, 0x01, 0x31, 0xd2, 0x83, 0xf9, 0x02,
+      0x0f, 0x47, 0xc2, 0x42, 0x0f, 0xaf, 0x44, 0xab,
+      0xfc, 0x42, 0x89, 0x44, 0xab, 0xfc };
+
+/* mov esi, [rbx + r13*4] */
+static const unsigned char load_esi_tos[] = { 0x42, 0x8b, 0x34, 0xab };
+
+/* mov rax, imm64 (imm64 follows) */
+static const unsigned char mov_rax_imm[] = { 0x48, 0xb8 };
+
+/* mov rdi, imm64 (imm64 follows) */
+static const unsigned char mov_rdi_imm[] = { 0x48, 0xbf };
+
+/* call rax */
+static const unsigned char call_rax[] = { 0xff, 0xd0 };
+
+/* mov esi, [rbx + r13*4 - 4] */
+static const unsigned char load_esi_s1[] = { 0x42, 0x8b, 0x74, 0xab, 0xfc };
+
+/* mov [rbx + r13*4 - 4], eax */
+static const unsigned char store_s1_eax[] = { 0x42, 0x89, 0x44, 0xab, 0xfc };
+
+/* cmp esi, imm32 (imm32 follows) */
+static const unsigned char cmp_esi_imm[] = { 0x81, 0xfe };
+
+/* mov eax, [rax + rsi*4] */
+static const unsigned char load_eax_data[] = { 0x8b, 0x04, 0xb0 };
+
+/* sub r13d, 2; mov esi, [rbx + r13*4 + 4]; mov edx, [rbx + r13*4]
+   (S1, the address, in esi and S2, the value, in edx) */
+static const unsigned char pop_esi_edx[] =
+    { 0x41, 0x83, 0xed, 0x02, 0x42, 0x8b, 0x74, 0xab, 0x04,
+      0x42, 0x8b, 0x14, 0xab };
+
+/* mov eax, esi; sub eax, imm32 (imm32 follows) */
+static const unsigned char eax_esi_minus[] = { 0x89, 0xf0, 0x2d };
+
+/* cmp eax, imm32 (imm32 follows) */
+static const unsigned char cmp_eax_imm[] = { 0x3d };
+
+/* mov rcx, imm64 (imm64 follows) */
+static const unsigned char mov_rcx_imm[] = { 0x48, 0xb9 };
+
+/* mov [rcx + rax*4], edx */
+static const unsigned char store_data_edx[] = { 0x89, 0x14, 0x81 };
+
+/* mov esi, imm32 (imm32 follows) */
+static const unsigned char mov_esi_imm[] = { 0xbe };
+
+/* mov rdx, r12 */
+static const unsigned char mov_rdx_reg[] = { 0x4c, 0x89, 0xe2 };
+
+/* The length of 'emit_vm_call''s code. */
+#define VM_CALL_LEN  22
+
+
+/*
+ * Does: Appends bytes to the generated code.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- bytes: The bytes to append.
+ * -- n: How many there are.
+ * Returns: Void.
+ */
+static void emit(jit_code *jc, const unsigned char *bytes, int n)
+{
+    memcpy(jc->buf + jc->len, bytes, n);
+    jc->len += n;
+}
+
+
+/*
+ * Does: Appends a 32-bit little-endian value to the generated code.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- val: The value.
+ * Returns: Void.
+ */
+static void emit_imm32(jit_code *jc, unsigned int val)
+{
+    jc->buf[jc->len++] = val & 0xff;
+    jc->buf[jc->len++] = (val >> 8) & 0xff;
+    jc->buf[jc->len++] = (val >> 16) & 0xff;
+    jc->buf[jc->len++] = (val >> 24) & 0xff;
+}
+
+
+/*
+ * Does: Appends a jump whose rel32 displacement is patched later.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- cond: The condition code byte (0x80 + cc) for a 'jcc rel32', or
+ *    0 for an unconditional 'jmp rel32'.
+ * -- target: A decoded index, or TO_OVERFLOW / TO_UNDERFLOW.
+ * Returns: Void.
+ */
+static void emit_jump(jit_code *jc, int cond, int target)
+{
+    if (cond)
+    {
+        jc->buf[jc->len++] = 0x0f;
+        jc->buf[jc->len++] = cond;
+    }
+    else
+    {
+        jc->buf[jc->len++] = 0xe9;
+    }
+
+    jc->fixups[jc->nfixups].pos = jc->len;
+    jc->fixups[jc->nfixups].target = target;
+    jc->nfixups++;
+
+    emit_imm32(jc, 0);
+}
+
+
+/*
+ * Does: Appends a 64-bit pointer to the generated code.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- ptr: The pointer.
+ * Returns: Void.
+ */
+static void emit_ptr(jit_code *jc, void *ptr)
+{
+    memcpy(jc->buf + jc->len, &ptr, 8);
+    jc->len += 8;
+}
+
+
+/*
+ * Does: Appends 'mov rax, fn; call rax'.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- fn: The address of the function to call.
+ * Returns: Void.
+ */
+static void emit_call(jit_code *jc, void *fn)
+{
+    emit(jc, mov_rax_imm, sizeof(mov_rax_imm));
+    emit_ptr(jc, fn);
+    emit(jc, call_rax, sizeof(call_rax));
+}
+
+
+/*
+ * Does: Appends a call to a runtime function that takes the VM as its
+ * first argument (in rdi), e.g. 'vm_print' or 'stack_overflow'.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- fn: The function to call.
+ * -- vm: The VM the code is being generated for.
+ * Returns: Void.
+ */
+static void emit_vm_call(jit_code *jc, void *fn, vm_type *vm)
+{
+    emit(jc, mov_rdi_imm, sizeof(mov_rdi_imm));
+    emit_ptr(jc, vm);
+    emit_call(jc, fn);
+}
+
+
+/*
+ * Does: Appends a short jump over the next 'n' bytes.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- op: 0x73 for 'jae rel8', 0xeb for 'jmp rel8'.
+ * -- n: How far to jump (under 128).
+ * Returns: Void.
+ */
+static void emit_skip(jit_code *jc, int op, int n)
+{
+    jc->buf[jc->len++] = op;
+    jc->buf[jc->len++] = n;
+}
+
+
+/* Condition codes for 'jcc rel32'. */
+#define JB   0x82
+#define JAE  0x83
+#define JE   0x84
+#define JNE  0x85
+
+
+/*
+ * Does: Emits the checks that the stack can take another push.
+ * Arguments:
+ * -- jc: The code being generated.
+ * Returns: Void.
+ */
+static void emit_push_check(jit_code *jc)
+{
+    emit(jc, cmp_sp_imm, sizeof(cmp_sp_imm));
+    emit_imm32(jc, STACK_SIZE - 1);
+    emit_jump(jc, JAE, TO_OVERFLOW);
+}
+
+
+/*
+ * Does: Emits a pop of the top of the stack into eax.
+ * Arguments:
+ * -- jc: The code being generated.
+ * Returns: Void.
+ */
+static void emit_pop_eax(jit_code *jc)
+{
+    emit(jc, test_sp, sizeof(test_sp));
+    emit_jump(jc, JE, TO_UNDERFLOW);
+    emit(jc, dec_sp, sizeof(dec_sp));
+    emit(jc, load_eax_tos, sizeof(load_eax_tos));
+}
+
+
+/*
+ * Does: Emits the template for one decoded instruction.
+ * Arguments:
+ * -- jc: The code being generated.
+ * -- vm: The VM the code is being generated for.
+ * -- code: The decoded program, for SPAWN's target address.
+ * -- inst: The instruction.
+ * Returns: 1 on success, 0 if the instruction can't be compiled.
+ */
+static int emit_inst(jit_code *jc, vm_type *vm, decoded_inst *code,
+                     decoded_inst *inst)
+{
+    const unsigned char *binary;
+    int nbinary;
+
+    switch (inst->op)
+    {
+    case NOP:
+        return 1;
+
+    case PUSH:
+        emit_push_check(jc);
+        emit(jc, store_tos_imm, sizeof(store_tos_imm));
+        emit_imm32(jc, (unsigned int)inst->arg);
+        emit(jc, inc_sp, sizeof(inc_sp));
+        return 1;
+
+    case POP:
+        emit(jc, test_sp, sizeof(test_sp));
+        emit_jump(jc, JE, TO_UNDERFLOW);
+        emit(jc, dec_sp, sizeof(dec_sp));
+        return 1;
+
+    case LOAD:
+        /* An out-of-range register is ignored, as in 'do_load'. */
+        if (inst->arg < NREGS)
+        {
+            emit_push_check(jc);
+            emit(jc, load_eax_reg, sizeof(load_eax_reg));
+            jc->buf[jc->len++] = inst->arg * 4;
+            emit(jc, store_tos_eax, sizeof(store_tos_eax));
+            emit(jc, inc_sp, sizeof(inc_sp));
+        }
+        return 1;
+
+    case STORE:
+        emit_pop_eax(jc);
+
+        if (inst->arg < NREGS)
+        {
+            emit(jc, store_eax_reg, sizeof(store_eax_reg));
+            jc->buf[jc->len++] = inst->arg * 4;
+        }
+        return 1;
+
+    case JMP:
+        emit_jump(jc, 0, inst->arg);
+        return 1;
+
+    case JZ:
+    case JNZ:
+        emit_pop_eax(jc);
+        emit(jc, test_eax, sizeof(test_eax));
+        emit_jump(jc, inst->op == JZ ? JE : JNE, inst->arg);
+        return 1;
+
+    case ADD:
+        binary = add_s2;
+        nbinary = sizeof(add_s2);
+        break;
+
+    case SUB:
+        binary = sub_s2;
+        nbinary = sizeof(sub_s2);
+        break;
+
+    case MUL:
+        binary = mul_s2;
+        nbinary = sizeof(mul_s2);
+        break;
+
+    case DIV:
+        binary = div_s2;
+        nbinary = sizeof(div_s2);
+        break;
+
+    case PRINT:
+        emit(jc, test_sp, sizeof(test_sp));
+        emit_jump(jc, JE, TO_UNDERFLOW);
+        emit(jc, dec_sp, sizeof(dec_sp));
+        emit(jc, load_esi_tos, sizeof(load_esi_tos));
+        emit_vm_call(jc, (void *)vm_print, vm);
+        return 1;
+
+    case LDM:
+        /*
+         * S1 = data_in[S1] if S1 < ndata_in (unsigned, so a negative
+         * address is out of range too), else data_load(vm, S1).
+         */
+        emit(jc, test_sp, sizeof(test_sp));
+        emit_jump(jc, JE, TO_UNDERFLOW);
+        emit(jc, load_esi_s1, sizeof(load_esi_s1));
+        emit(jc, cmp_esi_imm, sizeof(cmp_esi_imm));
+        emit_imm32(jc, (unsigned int)vm->ndata_in);
+        emit_skip(jc, 0x73, sizeof(mov_rax_imm) + 8 + sizeof(load_eax_data)
+                  + 2);
+        emit(jc, mov_rax_imm, sizeof(mov_rax_imm));
+        emit_ptr(jc, (void *)vm->data_in);
+        emit(jc, load_eax_data, sizeof(load_eax_data));
+        emit_skip(jc, 0xeb, VM_CALL_LEN);
+        emit_vm_call(jc, (void *)data_load, vm);
+        emit(jc, store_s1_eax, sizeof(store_s1_eax));
+        return 1;
+
+    case STM:
+        /*
+         * data_out[S1 - ndata_in] = S2 if that is in range (unsigned
+         * again), else data_store(vm, S1, S2).
+         */
+        emit(jc, cmp_sp_2, sizeof(cmp_sp_2));
+        emit_jump(jc, JB, TO_UNDERFLOW);
+        emit(jc, pop_esi_edx, sizeof(pop_esi_edx));
+        emit(jc, eax_esi_minus, sizeof(eax_esi_minus));
+        emit_imm32(jc, (unsigned int)vm->ndata_in);
+        emit(jc, cmp_eax_imm, sizeof(cmp_eax_imm));
+        emit_imm32(jc, (unsigned int)vm->ndata_out);
+        emit_skip(jc, 0x73, sizeof(mov_rcx_imm) + 8 + sizeof(store_data_edx)
+                  + 2);
+        emit(jc, mov_rcx_imm, sizeof(mov_rcx_imm));
+        emit_ptr(jc, vm->data_out);
+        emit(jc, store_data_edx, sizeof(store_data_edx));
+        emit_skip(jc, 0xeb, VM_CALL_LEN);
+        emit_vm_call(jc, (void *)data_store, vm);
+        return 1;
+
+    case MSIZE:
+        emit_push_check(jc);
+        emit(jc, store_tos_imm, sizeof(store_tos_imm));
+        emit_imm32(jc, (unsigned int)vm->ndata_in);
+        emit(jc, inc_sp, sizeof(inc_sp));
+        return 1;
+
+    case SPAWN:
+        /* Check for room first: an overflow starts no child. */
+        emit_push_check(jc);
+        emit(jc, mov_esi_imm, sizeof(mov_esi_imm));
+        emit_imm32(jc, (unsigned int)code[inst->arg].pc);
+        emit(jc, mov_rdx_reg, sizeof(mov_rdx_reg));
+        emit_vm_call(jc, (void *)vm_spawn, vm);
+        emit(jc, store_tos_eax, sizeof(store_tos_eax));
+        emit(jc, inc_sp, sizeof(inc_sp));
+        return 1;
+
+    case JOIN:
+        emit(jc, test_sp, sizeof(test_sp));
+        emit_jump(jc, JE, TO_UNDERFLOW);
+        emit(jc, load_esi_s1, sizeof(load_esi_s1));
+        emit_vm_call(jc, (void *)vm_join, vm);
+        emit(jc, store_s1_eax, sizeof(store_s1_eax));
+        return 1;
+
+    case STOP:
+        emit(jc, epilogue, sizeof(epilogue));
+        return 1;
+
+    default:
+        /* Invalid instructions (and superinstructions). */
+        return 0;
+    }
+
+    /*
+     * Binary operations: pop S1 into eax, then combine it into S2,
+     * which becomes the new top of the stack.
+     */
+    emit(jc, cmp_sp_2, sizeof(cmp_sp_2));
+    emit_jump(jc, JB, TO_UNDERFLOW);
+    emit(jc, dec_sp, sizeof(dec_sp));
+    emit(jc, load_eax_tos, sizeof(load_eax_tos));
+    emit(jc, binary, nbinary);
+    return 1;
+}
+
+
+/*
+ * Does: Compiles and runs a decoded program.  Produces the same output
+ * as 'execute_program'.
+ * Arguments:
+ * -- vm: The VM.
+ * -- prog: The decoded program (not fused).
+ * -- stats: If nonzero, report what was compiled on stderr.
+ * Returns: 1 if the program was run, 0 if it couldn't be compiled
+ * (the caller should interpret it instead).
+ */
+int execute_jit(vm_type *vm, decoded_program *prog, int stats)
+{
+    jit_code jc;
+    int *native;      /* Native offset of each decoded instruction. */
+    int overflow, underflow;
+    int i, target, ok = 1;
+    int failed = 0;
+    jmp_buf outer;
+    long page = sysconf(_SC_PAGESIZE);
+    int (*entry)(int *stack, int *reg);
+
+    /* The native code's size and offsets are 'int's. */
+    if (prog->ncode > MAX_JIT_INSTS)
+    {
+        return 0;
+    }
+
+    jc.size = (prog->ncode * MAX_TEMPLATE + sizeof(prologue) + 64
+               + page - 1) / page * page;
+    jc.buf = mmap(NULL, jc.size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jc.buf == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    jc.len = 0;
+    jc.nfixups = 0;
+    jc.fixups = (fixup *)checked_malloc(2 * prog->ncode * sizeof(fixup));
+    native = (int *)checked_malloc(prog->ncode * sizeof(int));
+
+    emit(&jc, prologue, sizeof(prologue));
+
+    for (i = 0; i < prog->ncode && ok; i++)
+    {
+        native[i] = jc.len;
+        ok = emit_inst(&jc, vm, prog->code, &prog->code[i]);
+    }
+
+    if (ok)
+    {
+        /* The error stubs; neither call returns. */
+        overflow = jc.len;
+        emit_vm_call(&jc, (void *)stack_overflow, vm);
+        underflow = jc.len;
+        emit_vm_call(&jc, (void *)stack_underflow, vm);
+
+        /* Point every jump at its target. */
+        for (i = 0; i < jc.nfixups; i++)
+        {
+            target = jc.fixups[i].target;
+
+            if (target == TO_OVERFLOW)
+            {
+                target = overflow;
+            }
+            else if (target == TO_UNDERFLOW)
+            {
+                target = underflow;
+            }
+            else
+            {
+                target = native[target];
+            }
+
+            target -= jc.fixups[i].pos + 4;
+            memcpy(jc.buf + jc.fixups[i].pos, &target, 4);
+        }
+
+        ok = mprotect(jc.buf, jc.size, PROT_READ | PROT_EXEC) == 0;
+    }
+
+    if (ok)
+    {
+        if (stats)
+        {
+            fprintf(stderr, "jit: %d instructions compiled into %d bytes "
+                    "of x86-64\n", prog->ncode, jc.len);
+        }
+
+        /*
+         * A stack error 'longjmp's out of the generated code.  Catch it
+         * here so the code can be unmapped, then pass it on.
+         */
+        memcpy(outer, vm->on_error, sizeof(jmp_buf));
+        entry = (int (*)(int *, int *))jc.buf;
+
+        if (setjmp(vm->on_error) == 0)
+        {
+            vm->sp = entry(vm->stack, vm->reg);
+        }
+        else
+        {
+            failed = 1;
+        }
+
+        memcpy(vm->on_error, outer, sizeof(jmp_buf));
+    }
+
+    munmap(jc.buf, jc.size);
+    free(jc.fixups);
+    free(native);
+
+    if (failed)
+    {
+        longjmp(vm->on_error, VM_ERROR);
+    }
+
+    return ok;
+}
+
+#else  /* not x86-64 */
+
+/*
+ * Does: There is no JIT for this machine.
+ * Arguments:
+ * -- vm: The VM.
+ * -- prog: The decoded program.
+ * -- stats: Unused.
+ * Returns: 0, i.e. the caller should interpret the program.
+ */
+int execute_jit(vm_type *vm, decoded_program *prog, int stats)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_load.c
+ *       Loading programs straight from their files.
+ *
+ * A regular file is mapped read-only into a MAX_INSTS-byte region of
+ * anonymous (zero) memory, and 'vm->inst' points at the mapping, so
+ * the program is never copied and the 64 KiB instruction buffer is
+ * never cleared: the bytes after the program read as zeroes (NOPs),
+ * exactly as in a freshly initialized buffer.  Pipes and other files
+ * that can't be mapped are read into 'vm->inst_buf' in one go.
+ *
+ * A wide program (see bci.h) has no zero tail to provide, so the file
+ * alone is mapped, at whatever size it is, and run from just past its
+ * header.  Read from a pipe, it goes into a buffer that grows to fit
+ * (see 'load_program').
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bci.h"
+
+
+/*
+ * Does: Releases the VM's mapped (or wide) program, if it has one, and
+ * points 'vm->inst' back at its own buffer.  The buffer's contents are
+ * whatever they were before the mapping.  Children a paused program
+ * left running are waited for first, since they run on the program.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_unmap(vm_type *vm)
+{
+    vm_reap(vm);
+
+    if (vm->mapping != NULL)
+    {
+        munmap(vm->mapping, vm->mapping_len);
+        vm->mapping = NULL;
+    }
+
+    free(vm->wide_buf);
+    vm->wide_buf = NULL;
+    vm->inst = vm->inst_buf;
+    vm->wide = 0;
+    vm->nspace = MAX_INSTS;
+}
+
+
+/*
+ * Does: Maps a program file into a fresh MAX_INSTS-byte region.
+ * Arguments:
+ * -- fd: The open file.
+ * -- size: Its length, at most MAX_INSTS.
+ * Returns: The region, or NULL if the file can't be mapped.
+ */
+static void *map_program(int fd, off_t size)
+{
+    void *region;
+
+    /* Zero-filled address space for the whole instruction buffer... */
+    region = mmap(NULL, MAX_INSTS, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1, 0);
+
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    /* ...with the file on top.  The rest of its last page is zero. */
+    if (size > 0
+        && mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)
+           == MAP_FAILED)
+    {
+        munmap(region, MAX_INSTS);
+        return NULL;
+    }
+
+    return region;
+}
+
+
+/*
+ * Does: Explains why a program file couldn't be loaded.
+ * Arguments:
+ * -- filename: The file.
+ * -- start: Its first bytes.
+ * -- len: How many of them there are.
+ * Returns: Void.
+ */
+static void report_unloadable(char *filename, unsigned char *start,
+                              long len)
+{
+    int version = wide_version(start, len);
+
+    if (version == 0)
+    {
+        fprintf(stderr, "bci_load.c: vm_load_file: %s is longer than "
+                "%d bytes\n", filename, MAX_INSTS);
+    }
+    else if (version != WIDE_VERSION)
+    {
+        fprintf(stderr, "bci_load.c: vm_load_file: %s is wide format "
+                "version %d; only version %d can be run\n",
+                filename, version, WIDE_VERSION);
+    }
+    else
+    {
+        fprintf(stderr, "bci_load.c: vm_load_file: %s is empty or longer "
+                "than %d bytes\n", filename, MAX_WIDE_INSTS);
+    }
+}
+
+
+/*
+ * Does: Maps a wide program file, header and all.
+ * Arguments:
+ * -- fd: The open file.
+ * -- header: Its first WIDE_HEADER bytes.
+ * -- size: Its length.
+ * Returns: The mapping, or NULL if the program can't be run (or the
+ * file can't be mapped).
+ */
+static void *map_wide(int fd, unsigned char *header, off_t size)
+{
+    void *region;
+
+    if (wide_version(header, WIDE_HEADER) != WIDE_VERSION
+        || size <= WIDE_HEADER || size - WIDE_HEADER > MAX_WIDE_INSTS)
+    {
+        return NULL;
+    }
+
+    region = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+
+/*
+ * Does: Resets a VM and loads the program in a file into it, mapping
+ * the file if it can.  Errors are reported on stderr.
+ * Arguments:
+ * -- vm: The VM.
+ * -- filename: The bytecode file.
+ * Returns: 1 on success, 0 if the file can't be opened or the program
+ * can't be run (see 'load_program').
+ */
+int vm_load_file(vm_type *vm, char *filename)
+{
+    unsigned char header[WIDE_HEADER];
+    struct stat st;
+    FILE *fp;
+    void *region;
+    ssize_t got;
+    int fd, ok;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "bci_load.c: vm_load_file: "
+                "error opening file %s\n", filename);
+        return 0;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        got = pread(fd, header, WIDE_HEADER, 0);
+
+        if (wide_version(header, got) != 0)
+        {
+            /* A bad header is reported after the bulk read fails. */
+            region = map_wide(fd, header, st.st_size);
+
+            if (region != NULL)
+            {
+                close(fd);
+                vm_unmap(vm);
+                reset_vm(vm);
+                vm->mapping = region;
+                vm->mapping_len = st.st_size;
+                vm->inst = (unsigned char *)region + WIDE_HEADER;
+                vm->ninsts = (int)(st.st_size - WIDE_HEADER);
+                vm->nspace = vm->ninsts;
+                vm->wide = 1;
+                return 1;
+            }
+
+            if (st.st_size - WIDE_HEADER > MAX_WIDE_INSTS)
+            {
+                report_unloadable(filename, header, got);
+                close(fd);
+                return 0;
+            }
+        }
+        else
+        {
+            /* Check the length before reading any of it. */
+            if (st.st_size > MAX_INSTS)
+            {
+                fprintf(stderr, "bci_load.c: vm_load_file: %s is %ld "
+                        "bytes long; programs are at most %d\n",
+                        filename, (long)st.st_size, MAX_INSTS);
+                close(fd);
+                return 0;
+            }
+
+            region = map_program(fd, st.st_size);
+
+            if (region != NULL)
+            {
+                close(fd);
+                vm_unmap(vm);
+                reset_vm(vm);
+                vm->mapping = region;
+                vm->mapping_len = MAX_INSTS;
+                vm->inst = (unsigned char *)region;
+                vm->ninsts = (int)st.st_size;
+                return 1;
+            }
+        }
+    }
+
+    /* A pipe, or a file that can't be mapped: one bulk read. */
+    fp = fdopen(fd, "r");
+
+    if (fp == NULL)
+    {
+        close(fd);
+        fprintf(stderr, "bci_load.c: vm_load_file: "
+                "error opening file %s\n", filename);
+        return 0;
+    }
+
+    ok = vm_load(vm, fp);
+    fclose(fp);
+
+    if (!ok)
+    {
+        report_unloadable(filename, vm->inst_buf, vm->ninsts);
+    }
+
+    return ok;
+}
@@ -0,0 +1,736 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_opt.c
+ *       bci-opt: offline bytecode optimizer.
+ *
+ * usage: bci-opt in.bcm out.bcm
+ *
+ * The program is decoded and verified (see bci_verify.c), and then
+ * these passes are repeated until none of them finds anything to do:
+ *
+ *   - jump threading: a jump to a JMP (or to NOPs before one) goes
+ *     straight to the final target;
+ *   - constant propagation: within a basic block, a LOAD of a register
+ *     just stored from a PUSH becomes a PUSH of the same constant;
+ *   - constant folding: PUSH a; PUSH b; ADD|SUB|MUL|DIV becomes one
+ *     PUSH, and a JZ or JNZ of a constant becomes a JMP or nothing;
+ *   - PUSH or LOAD followed by POP, jumps to the next instruction, and
+ *     conditional jumps whose target is the next instruction are
+ *     simplified;
+ *   - unreachable code is deleted.
+ *
+ * Deleted instructions are turned into NOPs, and all NOPs are dropped
+ * when the result is encoded again with its jump targets fixed up.
+ *
+ * Only programs that pass the verifier are optimized: since they can't
+ * overflow or underflow the stack, changing how deep the stack gets
+ * can't change what they do.  Anything else is copied unchanged.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* What the optimizer did. */
+typedef struct
+{
+    int threaded;     /* Jump targets shortened.           */
+    int propagated;   /* LOADs turned into PUSHes.          */
+    int folded;       /* Arithmetic and POPs folded away.   */
+    int branches;     /* Conditional jumps decided.         */
+    int unreachable;  /* Instructions deleted as unreachable. */
+} opt_stats;
+
+
+/*
+ * Does: Checks whether a decoded instruction is a jump.
+ * Arguments:
+ * -- op: The opcode.
+ * Returns: 1 if it is, 0 otherwise.
+ */
+static int is_jump(int op)
+{
+    return op == JMP || op == JZ || op == JNZ;
+}
+
+
+/*
+ * Does: Checks whether a decoded instruction's 'arg' is a decoded
+ * index: a jump's target, or where a SPAWN starts its child.
+ * Arguments:
+ * -- op: The opcode.
+ * Returns: 1 if it is, 0 otherwise.
+ */
+static int has_target(int op)
+{
+    return is_jump(op) || op == SPAWN;
+}
+
+
+/*
+ * Does: Marks every instruction that is the target of a jump, or where
+ * a SPAWN starts a child.
+ * Arguments:
+ * -- prog: The program.
+ * -- is_target: Where to store the marks.
+ * Returns: Void.
+ */
+static void find_targets(decoded_program *prog, int *is_target)
+{
+    int i;
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        is_target[i] = 0;
+    }
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        if (has_target(prog->code[i].op))
+        {
+            is_target[prog->code[i].arg] = 1;
+        }
+    }
+}
+
+
+/*
+ * Does: Finds the instruction that runs after instruction i falls
+ * through, skipping NOPs, as long as nothing can jump in between.
+ * Arguments:
+ * -- prog: The program.
+ * -- is_target: The jump targets.
+ * -- i: The instruction.
+ * Returns: Its index, or -1 if a jump target comes first.
+ */
+static int following(decoded_program *prog, int *is_target, int i)
+{
+    int j;
+
+    for (j = i + 1; j < prog->ncode; j++)
+    {
+        if (is_target[j])
+        {
+            return -1;
+        }
+
+        if (prog->code[j].op != NOP)
+        {
+            return j;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Does: Finds where control really goes when it reaches instruction
+ * t: past any NOPs and along any chain of JMPs.
+ * Arguments:
+ * -- prog: The program.
+ * -- t: The instruction.
+ * Returns: The final instruction.
+ */
+static int resolve(decoded_program *prog, int t)
+{
+    int steps;
+
+    /* Bounded, in case the JMPs form a loop. */
+    for (steps = 0; steps < prog->ncode; steps++)
+    {
+        if (prog->code[t].op == NOP)
+        {
+            t++;    /* The sentinel at the end is never a NOP. */
+        }
+        else if (prog->code[t].op == JMP)
+        {
+            t = prog->code[t].arg;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return t;
+}
+
+
+/*
+ * Does: Computes the result of an arithmetic instruction the way the
+ * interpreter does (wrapping on overflow).
+ * Arguments:
+ * -- op: ADD, SUB, MUL or DIV.
+ * -- a: S2.
+ * -- b: S1 (the old TOS).
+ * Returns: The result.
+ */
+static int fold(int op, int a, int b)
+{
+    unsigned int x = (unsigned int)a, y = (unsigned int)b;
+
+    switch (op)
+    {
+    case ADD:
+        return (int)(x + y);
+
+    case SUB:
+        return (int)(x - y);
+
+    case MUL:
+        return (int)(x * y);
+
+    default:
+        /* Same arithmetic as 'do_div'. */
+        return (int)((unsigned int)RECIPROCAL(b) * x);
+    }
+}
+
+
+/*
+ * Does: Deletes an instruction (turns it into a NOP).
+ * Arguments:
+ * -- inst: The instruction.
+ * Returns: Void.
+ */
+static void delete(decoded_inst *inst)
+{
+    inst->op = NOP;
+    inst->arg = 0;
+}
+
+
+/*
+ * Does: Points every jump (and SPAWN) straight at where control really
+ * goes.
+ * Arguments:
+ * -- prog: The program.
+ * -- stats: The statistics to update.
+ * Returns: The number of changes made.
+ */
+static int thread_jumps(decoded_program *prog, opt_stats *stats)
+{
+    int i, t, changes = 0;
+
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        if (!has_target(prog->code[i].op))
+        {
+            continue;
+        }
+
+        t = resolve(prog, prog->code[i].arg);
+
+        if (t != prog->code[i].arg)
+        {
+            prog->code[i].arg = t;
+            stats->threaded++;
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+
+/*
+ * Does: Replaces LOADs of registers known to hold a constant, within
+ * a basic block, by PUSHes.
+ * Arguments:
+ * -- prog: The program.
+ * -- is_target: The jump targets.
+ * -- stats: The statistics to update.
+ * Returns: The number of changes made.
+ */
+static int propagate(decoded_program *prog, int *is_target,
+                     opt_stats *stats)
+{
+    int known[NREGS];     /* Does the register hold value[r]? */
+    int value[NREGS];
+    decoded_inst *inst;
+    int i, j, r, changes = 0;
+
+    for (r = 0; r < NREGS; r++)
+    {
+        known[r] = 0;
+    }
+
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        inst = &prog->code[i];
+
+        if (is_target[i])
+        {
+            /* Another block: the registers could hold anything. */
+            for (r = 0; r < NREGS; r++)
+            {
+                known[r] = 0;
+            }
+        }
+
+        switch (inst->op)
+        {
+        case PUSH:
+            j = following(prog, is_target, i);
+
+            if (j >= 0 && prog->code[j].op == STORE)
+            {
+                known[prog->code[j].arg] = 1;
+                value[prog->code[j].arg] = inst->arg;
+                i = j;    /* Don't forget it again at the STORE. */
+            }
+            break;
+
+        case STORE:
+            known[inst->arg] = 0;
+            break;
+
+        case LOAD:
+            if (known[inst->arg])
+            {
+                inst->op = PUSH;
+                inst->arg = value[inst->arg];
+                stats->propagated++;
+                changes++;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return changes;
+}
+
+
+/*
+ * Does: Folds constant arithmetic and branches, and drops values that
+ * are pushed only to be popped.
+ * Arguments:
+ * -- prog: The program.
+ * -- is_target: The jump targets.
+ * -- stats: The statistics to update.
+ * Returns: The number of changes made.
+ */
+static int fold_constants(decoded_program *prog, int *is_target,
+                          opt_stats *stats)
+{
+    decoded_inst *code = prog->code;
+    int i, j, k, taken, changes = 0;
+
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        if (code[i].op != PUSH && code[i].op != LOAD)
+        {
+            continue;
+        }
+
+        j = following(prog, is_target, i);
+
+        if (j < 0)
+        {
+            continue;
+        }
+
+        if (code[j].op == POP)
+        {
+            /* PUSH n; POP  or  LOAD r; POP */
+            delete(&code[i]);
+            delete(&code[j]);
+            stats->folded++;
+            changes++;
+        }
+        else if (code[i].op == PUSH && (code[j].op == JZ
+                                        || code[j].op == JNZ))
+        {
+            /* PUSH n; JZ|JNZ t: the branch always goes the same way. */
+            taken = (code[i].arg == 0) == (code[j].op == JZ);
+            delete(&code[i]);
+
+            if (taken)
+            {
+                code[j].op = JMP;
+            }
+            else
+            {
+                delete(&code[j]);
+            }
+
+            stats->branches++;
+            changes++;
+        }
+        else if (code[i].op == PUSH && code[j].op == PUSH)
+        {
+            k = following(prog, is_target, j);
+
+            if (k >= 0 && (code[k].op == ADD || code[k].op == SUB
+                           || code[k].op == MUL || code[k].op == DIV))
+            {
+                /* PUSH a; PUSH b; ADD|SUB|MUL|DIV */
+                code[k].arg = fold(code[k].op, code[i].arg, code[j].arg);
+                code[k].op = PUSH;
+                delete(&code[i]);
+                delete(&code[j]);
+                stats->folded++;
+                changes++;
+            }
+        }
+    }
+
+    return changes;
+}
+
+
+/*
+ * Does: Simplifies jumps that land where control would go anyway.
+ * Arguments:
+ * -- prog: The program.
+ * -- is_target: The jump targets.
+ * -- stats: The statistics to update.
+ * Returns: The number of changes made.
+ */
+static int simplify_jumps(decoded_program *prog, int *is_target,
+                          opt_stats *stats)
+{
+    decoded_inst *code = prog->code;
+    int i, next, changes = 0;
+
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        if (!is_jump(code[i].op))
+        {
+            continue;
+        }
+
+        /* Where control goes if the jump isn't taken. */
+        next = resolve(prog, i + 1);
+
+        if (resolve(prog, code[i].arg) != next)
+        {
+            continue;
+        }
+
+        if (code[i].op == JMP)
+        {
+            delete(&code[i]);
+        }
+        else
+        {
+            /* Both ways lead to the same place: just pop. */
+            code[i].op = POP;
+            code[i].arg = 0;
+        }
+
+        stats->threaded++;
+        changes++;
+    }
+
+    (void)is_target;
+    return changes;
+}
+
+
+/*
+ * Does: Deletes the instructions that can't be reached from the
+ * start of the program.
+ * Arguments:
+ * -- prog: The program.
+ * -- stats: The statistics to update.
+ * Returns: The number of changes made.
+ */
+static int remove_unreachable(decoded_program *prog, opt_stats *stats)
+{
+    int *reached;
+    int *work;
+    int nwork = 0;
+    int i, op, changes = 0;
+
+    reached = (int *)checked_calloc(prog->ncode, sizeof(int));
+    work = (int *)checked_calloc(prog->ncode, sizeof(int));
+
+    reached[0] = 1;
+    work[nwork++] = 0;
+
+    while (nwork > 0)
+    {
+        i = work[--nwork];
+        op = prog->code[i].op;
+
+        if (has_target(op) && !reached[prog->code[i].arg])
+        {
+            reached[prog->code[i].arg] = 1;
+            work[nwork++] = prog->code[i].arg;
+        }
+
+        if (op != JMP && op != STOP && op != INVALID
+            && i + 1 < prog->ncode && !reached[i + 1])
+        {
+            reached[i + 1] = 1;
+            work[nwork++] = i + 1;
+        }
+    }
+
+    /* The sentinel stays: it stands for the end of the program. */
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        if (!reached[i] && prog->code[i].op != NOP)
+        {
+            delete(&prog->code[i]);
+            stats->unreachable++;
+            changes++;
+        }
+    }
+
+    free(reached);
+    free(work);
+    return changes;
+}
+
+
+/*
+ * Does: Encodes an optimized program as bytecode, leaving out all the
+ * NOPs and turning jump targets back into byte addresses.
+ * Arguments:
+ * -- prog: The program.
+ * -- out: Where to store the bytecode (at least 5 bytes for each
+ *    instruction, and MAX_INSTS).
+ * -- wide: Whether to encode it in the wide format.
+ * Returns: The length of the bytecode.
+ */
+static int encode(decoded_program *prog, unsigned char *out, int wide)
+{
+    int *addr;     /* New byte address of each instruction. */
+    int i, j, pc, op, val;
+
+    addr = (int *)checked_calloc(prog->ncode, sizeof(int));
+    pc = 0;
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        addr[i] = pc;    /* A NOP's address is that of what follows. */
+        op = prog->code[i].op;
+
+        if (op != NOP && i < prog->ncode - 1)
+        {
+            pc += 1 + (op == INVALID ? 0 : operand_width(op, wide));
+        }
+    }
+
+    pc = 0;
+
+    for (i = 0; i < prog->ncode - 1; i++)
+    {
+        op = prog->code[i].op;
+
+        if (op == NOP)
+        {
+            continue;
+        }
+
+        if (op == INVALID)
+        {
+            out[pc++] = (unsigned char)prog->code[i].arg;
+            continue;
+        }
+
+        out[pc++] = (unsigned char)op;
+        val = has_target(op) ? addr[prog->code[i].arg]
+                             : prog->code[i].arg;
+
+        /*
+         * The sentinel's address is just past the end.  In a plain
+         * program that is the NOP tail, which wraps around to 0; in a
+         * wide one it is outside the address space, so say 0 outright.
+         */
+        if (wide && has_target(op) && prog->code[i].arg == prog->ncode - 1)
+        {
+            val = 0;
+        }
+
+        /* Little-endian, like 'read_n_byte_integer'. */
+        for (j = 0; j < operand_width(op, wide); j++)
+        {
+            out[pc++] = (unsigned char)(((unsigned int)val >> (8 * j))
+                                        & 0xff);
+        }
+    }
+
+    free(addr);
+    return pc;
+}
+
+
+/*
+ * Does: Writes bytecode to a file.
+ * Arguments:
+ * -- filename: The file.
+ * -- code: The bytecode.
+ * -- len: Its length.
+ * -- wide: Whether it is in the wide format (and needs the header).
+ * Returns: 1 on success, 0 on failure.
+ */
+static int write_program(char *filename, unsigned char *code, int len,
+                         int wide)
+{
+    static unsigned char header[WIDE_HEADER] =
+    {
+        0xbc, 'B', 'C', 'X', WIDE_VERSION, 0, 0, 0
+    };
+    FILE *fp = fopen(filename, "wb");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "bci-opt: can't write %s\n", filename);
+        return 0;
+    }
+
+    if ((wide && fwrite(header, 1, WIDE_HEADER, fp) != WIDE_HEADER)
+        || (int)fwrite(code, 1, len, fp) != len)
+    {
+        fprintf(stderr, "bci-opt: error writing %s\n", filename);
+        fclose(fp);
+        return 0;
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+
+/*
+ * Does: Runs the optimization passes until none of them changes
+ * anything.
+ * Arguments:
+ * -- prog: The verified program, rewritten in place.
+ * -- stats: Where to store what was done.
+ * Returns: Void.
+ */
+static void optimize(decoded_program *prog, opt_stats *stats)
+{
+    int *is_target;
+    int changes;
+
+    is_target = (int *)checked_calloc(prog->ncode, sizeof(int));
+
+    do
+    {
+        changes = thread_jumps(prog, stats);
+        find_targets(prog, is_target);
+        changes += propagate(prog, is_target, stats);
+        changes += fold_constants(prog, is_target, stats);
+        find_targets(prog, is_target);
+        changes += simplify_jumps(prog, is_target, stats);
+        changes += remove_unreachable(prog, stats);
+    }
+    while (changes > 0);
+
+    free(is_target);
+}
+
+
+int main(int argc, char **argv)
+{
+    vm_type *vm;
+    decoded_program prog, check;
+    opt_stats stats = { 0, 0, 0, 0, 0 };
+    unsigned char *out;
+    int len, nbefore, nafter, size, i, ok, wide;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s in.bcm out.bcm\n", argv[0]);
+        exit(1);
+    }
+
+    vm = vm_create();
+
+    if (!vm_load_file(vm, argv[1]))
+    {
+        exit(1);
+    }
+
+    /* An instruction takes at most 5 bytes, however it is rewritten. */
+    wide = vm->wide;
+    out = (unsigned char *)checked_calloc(MAX_INSTS + 5 * (size_t)vm->ninsts,
+                                          1);
+
+    if (!decode_program(vm, &prog) || !verify_program(vm, &prog, stderr))
+    {
+        /* Too risky to touch; 'verify_program' has said why. */
+        fprintf(stderr, "bci-opt: %s copied unchanged\n", argv[1]);
+
+        for (i = 0; i < vm->ninsts; i++)
+        {
+            out[i] = vm->inst[i];
+        }
+
+        ok = write_program(argv[2], out, vm->ninsts, wide);
+        free_decoded(&prog);
+        free(out);
+        vm_destroy(vm);
+        return ok ? 0 : 1;
+    }
+
+    nbefore = prog.ncode - 1;
+    size = vm->ninsts;
+    optimize(&prog, &stats);
+    len = encode(&prog, out, wide);
+
+    /* A wide program can't be empty: keep one of the NOPs. */
+    if (wide && len == 0)
+    {
+        out[len++] = NOP;
+    }
+
+    for (nafter = 0, i = 0; i < prog.ncode - 1; i++)
+    {
+        nafter += prog.code[i].op != NOP;
+    }
+
+    free_decoded(&prog);
+
+    /* The result must verify too; if not, something is badly wrong. */
+    for (i = 0; i < MAX_INSTS; i++)
+    {
+        vm->inst_buf[i] = i < len ? out[i] : 0;
+    }
+
+    vm_unmap(vm);
+    vm->ninsts = len;
+    vm->inst_dirty = len < MAX_INSTS ? len : MAX_INSTS;
+
+    if (wide)
+    {
+        vm->inst = out;
+        vm->nspace = len;
+        vm->wide = 1;
+    }
+
+    if (!decode_program(vm, &check) || !verify_program(vm, &check, stderr))
+    {
+        fprintf(stderr, "bci-opt: internal error: the optimized program "
+                "doesn't verify\n");
+        exit(1);
+    }
+
+    free_decoded(&check);
+
+    fprintf(stderr, "bci-opt: %d -> %d instructions, %d -> %d bytes "
+            "(%d folded, %d loads propagated, %d branches decided, "
+            "%d jumps threaded, %d unreachable)\n", nbefore, nafter,
+            size, len, stats.folded, stats.propagated,
+            stats.branches, stats.threaded, stats.unreachable);
+
+    ok = write_program(argv[2], out, len, wide);
+    vm_unmap(vm);
+    free(out);
+    vm_destroy(vm);
+
+    return ok ? 0 : 1;
+}
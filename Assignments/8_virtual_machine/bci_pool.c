@@ -0,0 +1,131 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_pool.c
+ *       A pool of reusable VMs.
+ *
+ * A VM is mostly its 64K instruction buffer, so creating one for every
+ * program and destroying it afterwards means allocating (and, for a
+ * fresh allocation, faulting in) that much memory each time.  The pool
+ * keeps VMs that have finished with a program, and hands them out
+ * again; loading the next program only has to clear what the last one
+ * used (see 'init_vm').
+ *
+ * Nothing is allocated up front but the list of idle VMs: a pool that
+ * is never used, or only partly used, costs no more than that.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bci.h"
+
+
+struct vm_pool
+{
+    pthread_mutex_t lock;
+    vm_type **idle;             /* VMs ready to be handed out.  */
+    int nidle;
+    int size;                   /* The most idle VMs kept.      */
+};
+
+
+/*
+ * Does: Creates an empty pool.
+ * Arguments:
+ * -- size: The most idle VMs to keep (at least 1).
+ * Returns: The new pool.
+ */
+vm_pool *vm_pool_create(int size)
+{
+    vm_pool *pool = (vm_pool *)checked_malloc(sizeof(vm_pool));
+
+    if (size < 1)
+    {
+        size = 1;
+    }
+
+    pool->idle = (vm_type **)checked_malloc(size * sizeof(vm_type *));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->nidle = 0;
+    pool->size = size;
+    return pool;
+}
+
+
+/*
+ * Does: Gets a VM from the pool, creating one if none is idle.
+ * Arguments:
+ * -- pool: The pool.
+ * Returns: The VM.
+ */
+vm_type *vm_pool_get(vm_pool *pool)
+{
+    vm_type *vm = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->nidle > 0)
+    {
+        vm = pool->idle[--pool->nidle];
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return vm != NULL ? vm : vm_create();
+}
+
+
+/*
+ * Does: Gives a VM back to the pool, or destroys it if the pool is
+ * full.  Its program and data memory are unmapped and its captured
+ * output dropped, so the next user gets what looks like a new VM.
+ * Arguments:
+ * -- pool: The pool.
+ * -- vm: The VM, which the caller mustn't use again.
+ * Returns: Void.
+ */
+void vm_pool_put(vm_pool *pool, vm_type *vm)
+{
+    vm_unmap(vm);
+    vm_unmap_data(vm);
+    vm_output_file(vm, NULL);
+    vm_binary_output(vm, 0);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->nidle < pool->size)
+    {
+        pool->idle[pool->nidle++] = vm;
+        vm = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (vm != NULL)
+    {
+        vm_destroy(vm);
+    }
+}
+
+
+/*
+ * Does: Destroys a pool and the idle VMs in it.  VMs still out aren't
+ * touched; destroy them with 'vm_destroy'.
+ * Arguments:
+ * -- pool: The pool.
+ * Returns: Void.
+ */
+void vm_pool_destroy(vm_pool *pool)
+{
+    while (pool->nidle > 0)
+    {
+        vm_destroy(pool->idle[--pool->nidle]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool);
+}
@@ -0,0 +1,310 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_profile.c
+ *       Execution profiles: where a program spends its time.
+ *
+ * 'execute_decoded_profiled' (see bci_decode_loop.h) counts how often
+ * each decoded instruction runs, how often each conditional jump is
+ * taken and, optionally, the 'rdtsc' cycles from the start of each
+ * instruction to the start of the next.  The functions here set up
+ * those counters and turn them into a hot-spot report and a JSON dump.
+ * None of this costs the other execution loops anything.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* Opcodes are below INVALID, or INVALID itself. */
+#define NOPCODES (INVALID + 1)
+
+/* How many instructions the report lists. */
+#define HOT_SPOTS 20
+
+
+/* One row of a report: an opcode or an instruction, and its totals. */
+typedef struct
+{
+    int key;                 /* Opcode or decoded index. */
+    unsigned long count;
+    unsigned long cycles;
+} profile_row;
+
+
+/* 'qsort' comparison for rows: most executed first. */
+static int compare_rows(const void *a, const void *b)
+{
+    const profile_row *x = (const profile_row *)a;
+    const profile_row *y = (const profile_row *)b;
+
+    if (x->count != y->count)
+    {
+        return x->count < y->count ? 1 : -1;
+    }
+
+    return x->key - y->key;
+}
+
+
+/*
+ * Does: Checks whether an opcode is a conditional jump.
+ * Arguments:
+ * -- op: The opcode.
+ * Returns: 1 if it is, 0 otherwise.
+ */
+static int is_branch(int op)
+{
+    return op == JZ || op == JNZ || op == JEQI || op == JNEI
+        || op == JZR || op == JNZR;
+}
+
+
+/*
+ * Does: Attaches a set of zeroed counters to a decoded program.
+ * Arguments:
+ * -- prog: The decoded program (after any fusing).
+ * -- cycles: Nonzero to count cycles as well.
+ * Returns: Void.
+ */
+void new_profile(decoded_program *prog, int cycles)
+{
+    profile_data *p;
+
+    p = (profile_data *)checked_calloc(1, sizeof(profile_data));
+    p->count = (unsigned long *)checked_calloc(prog->ncode,
+                                               sizeof(unsigned long));
+    p->taken = (unsigned long *)checked_calloc(prog->ncode,
+                                               sizeof(unsigned long));
+    p->cycles = NULL;
+
+    if (cycles)
+    {
+        p->cycles = (unsigned long *)checked_calloc(prog->ncode,
+                                                    sizeof(unsigned long));
+    }
+
+    prog->profile = p;
+}
+
+
+/*
+ * Does: Frees a program's profile, if it has one.
+ * Arguments:
+ * -- prog: The decoded program.
+ * Returns: Void.
+ */
+void free_profile(decoded_program *prog)
+{
+    if (prog->profile == NULL)
+    {
+        return;
+    }
+
+    free(prog->profile->count);
+    free(prog->profile->taken);
+    free(prog->profile->cycles);
+    free(prog->profile);
+    prog->profile = NULL;
+}
+
+
+/*
+ * Does: Totals a profile by opcode and by instruction, most executed
+ * first.
+ * Arguments:
+ * -- prog: The profiled program.
+ * -- ops: Where to store the NOPCODES opcode rows.
+ * -- insts: Where to store the 'prog->ncode' instruction rows.
+ * Returns: The total number of instructions executed.
+ */
+static unsigned long sort_profile(decoded_program *prog, profile_row *ops,
+                                  profile_row *insts)
+{
+    profile_data *p = prog->profile;
+    unsigned long total = 0;
+    int i, op;
+
+    for (op = 0; op < NOPCODES; op++)
+    {
+        ops[op].key = op;
+        ops[op].count = 0;
+        ops[op].cycles = 0;
+    }
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        op = prog->code[i].op;
+        insts[i].key = i;
+        insts[i].count = p->count[i];
+        insts[i].cycles = p->cycles != NULL ? p->cycles[i] : 0;
+        ops[op].count += insts[i].count;
+        ops[op].cycles += insts[i].cycles;
+        total += p->count[i];
+    }
+
+    qsort(ops, NOPCODES, sizeof(profile_row), compare_rows);
+    qsort(insts, prog->ncode, sizeof(profile_row), compare_rows);
+
+    return total;
+}
+
+
+/*
+ * Does: Prints a hot-spot report: instruction counts by opcode, then
+ * the most executed instructions, with branch outcomes.
+ * Arguments:
+ * -- prog: The profiled program.
+ * -- fp: Where to print the report.
+ * Returns: Void.
+ */
+void print_profile(decoded_program *prog, FILE *fp)
+{
+    profile_data *p = prog->profile;
+    profile_row ops[NOPCODES];
+    profile_row *insts;
+    decoded_inst *inst;
+    unsigned long total;
+    int i;
+
+    insts = (profile_row *)checked_calloc(prog->ncode,
+                                          sizeof(profile_row));
+    total = sort_profile(prog, ops, insts);
+
+    fprintf(fp, "profile: %lu instructions executed\n\n", total);
+
+    if (total == 0)
+    {
+        total = 1;   /* Keep the percentages finite. */
+    }
+
+    fprintf(fp, "%-8s %14s %7s%s\n", "opcode", "count", "%",
+            p->cycles != NULL ? "  cycles/inst" : "");
+
+    for (i = 0; i < NOPCODES && ops[i].count > 0; i++)
+    {
+        fprintf(fp, "%-8s %14lu %6.2f%%", op_name(ops[i].key),
+                ops[i].count, 100.0 * ops[i].count / total);
+
+        if (p->cycles != NULL)
+        {
+            fprintf(fp, " %12.1f", (double)ops[i].cycles / ops[i].count);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "\n%6s %-8s %14s %7s %12s %12s%s\n", "pc", "opcode",
+            "count", "%", "taken", "not taken",
+            p->cycles != NULL ? "  cycles/inst" : "");
+
+    for (i = 0; i < HOT_SPOTS && i < prog->ncode
+                && insts[i].count > 0; i++)
+    {
+        inst = &prog->code[insts[i].key];
+        fprintf(fp, "%6d %-8s %14lu %6.2f%%", inst->pc, op_name(inst->op),
+                insts[i].count, 100.0 * insts[i].count / total);
+
+        if (is_branch(inst->op))
+        {
+            fprintf(fp, " %12lu %12lu", p->taken[insts[i].key],
+                    insts[i].count - p->taken[insts[i].key]);
+        }
+        else if (p->cycles != NULL)
+        {
+            fprintf(fp, " %12s %12s", "", "");
+        }
+
+        if (p->cycles != NULL)
+        {
+            fprintf(fp, " %12.1f",
+                    (double)insts[i].cycles / insts[i].count);
+        }
+
+        fprintf(fp, "\n");
+    }
+
+    free(insts);
+}
+
+
+/*
+ * Does: Writes a profile as JSON: totals, then per-opcode and
+ * per-instruction counts, most executed first.  Instructions are
+ * identified by their byte address ("pc"); instructions that never ran
+ * are left out.
+ * Arguments:
+ * -- prog: The profiled program.
+ * -- fp: Where to write the JSON.
+ * Returns: Void.
+ */
+void write_profile_json(decoded_program *prog, FILE *fp)
+{
+    profile_data *p = prog->profile;
+    profile_row ops[NOPCODES];
+    profile_row *insts;
+    decoded_inst *inst;
+    unsigned long total, cycles = 0;
+    int i;
+
+    insts = (profile_row *)checked_calloc(prog->ncode,
+                                          sizeof(profile_row));
+    total = sort_profile(prog, ops, insts);
+
+    for (i = 0; i < NOPCODES; i++)
+    {
+        cycles += ops[i].cycles;
+    }
+
+    fprintf(fp, "{\n  \"instructions\": %lu,\n", total);
+
+    if (p->cycles != NULL)
+    {
+        fprintf(fp, "  \"cycles\": %lu,\n", cycles);
+    }
+
+    fprintf(fp, "  \"opcodes\": [");
+
+    for (i = 0; i < NOPCODES && ops[i].count > 0; i++)
+    {
+        fprintf(fp, "%s\n    {\"op\": \"%s\", \"count\": %lu",
+                i > 0 ? "," : "", op_name(ops[i].key), ops[i].count);
+
+        if (p->cycles != NULL)
+        {
+            fprintf(fp, ", \"cycles\": %lu", ops[i].cycles);
+        }
+
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, "\n  ],\n  \"pcs\": [");
+
+    for (i = 0; i < prog->ncode && insts[i].count > 0; i++)
+    {
+        inst = &prog->code[insts[i].key];
+        fprintf(fp, "%s\n    {\"pc\": %d, \"op\": \"%s\", \"count\": %lu",
+                i > 0 ? "," : "", inst->pc, op_name(inst->op),
+                insts[i].count);
+
+        if (is_branch(inst->op))
+        {
+            fprintf(fp, ", \"taken\": %lu, \"not_taken\": %lu",
+                    p->taken[insts[i].key],
+                    insts[i].count - p->taken[insts[i].key]);
+        }
+
+        if (p->cycles != NULL)
+        {
+            fprintf(fp, ", \"cycles\": %lu", insts[i].cycles);
+        }
+
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+    free(insts);
+}
@@ -0,0 +1,721 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_reg.c
+ *       Translation of verified stack bytecode into a three-address
+ *       register IR, and an interpreter for the IR.
+ *
+ * Once 'verify_program' has proved that the stack depth before every
+ * instruction is the same on every path, stack slot k is just another
+ * variable, like the registers.  The IR works on one array of values,
+ * 'v': the VM's registers, then one variable per stack slot, then the
+ * program's constants.  Every operand is an index into 'v'.
+ *
+ * The translator doesn't write a stack slot until it has to.  It keeps
+ * a symbolic stack in which each entry is either already in its slot,
+ * a copy of a register or constant, or a pending 'a op b'.  So
+ *
+ *     LOAD r; PUSH 1; SUB; STORE r    becomes    SUB r <- r, #1
+ *     LOAD r; PUSH n; SUB; JZ t       becomes    JEQ r, #n -> t
+ *
+ * and the symbolic stack is only written out to the slots before jump
+ * targets, jumps and STOP, so that every path agrees on where values
+ * live.  Loads from the data memory are the exception: they happen at
+ * once, since they can fail and a STM can change what they would read.
+ * So do SPAWN and JOIN, which start and wait for children.
+ * Programs the verifier rejects are run by 'execute_decoded'.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* Where the stack slots start in 'v'. */
+#define SLOT(k)  (NREGS + (k))
+
+/* Symbolic stack entries. */
+#define IN_SLOT   0   /* The value is in its stack slot.           */
+#define COPY      1   /* The value is v[a] (a register or constant). */
+#define PENDING   2   /* The value is v[a] op v[b], not yet computed. */
+
+typedef struct
+{
+    int kind;
+    int op;      /* For PENDING: ADD, SUB, MUL, DIV or one of the ops
+                    computed at once (see 'translate'). */
+    int a;
+    int b;
+} sym_entry;
+
+
+/* The translator's state. */
+typedef struct
+{
+    reg_program *ir;
+    decoded_inst *code;              /* The decoded program.    */
+    int size;                        /* Room in 'ir->code'.     */
+    int init_size;                   /* Room in 'ir->init'.     */
+    sym_entry stack[STACK_SIZE];     /* The symbolic stack.     */
+    int depth;
+} translator;
+
+
+/*
+ * Does: Appends an IR instruction.
+ * Arguments:
+ * -- t: The translator.
+ * -- op: The IR opcode.
+ * -- dst, a, b: Its operands (indices into 'v').
+ * -- target: For jumps, the decoded index of the target (fixed up
+ *    later); otherwise unused.
+ * Returns: Void.
+ */
+static void emit(translator *t, int op, int dst, int a, int b, int target)
+{
+    reg_inst *inst;
+
+    if (t->ir->ncode == t->size)
+    {
+        t->size *= 2;
+        t->ir->code = (reg_inst *)checked_realloc(
+            t->ir->code, t->size * sizeof(reg_inst));
+    }
+
+    inst = &t->ir->code[t->ir->ncode++];
+    inst->op = op;
+    inst->dst = dst;
+    inst->a = a;
+    inst->b = b;
+    inst->target = target;
+}
+
+
+/*
+ * Does: Adds a constant to the value array.
+ * Arguments:
+ * -- t: The translator.
+ * -- n: The constant.
+ * Returns: Its index in 'v'.
+ */
+static int constant(translator *t, int n)
+{
+    reg_program *ir = t->ir;
+
+    if (ir->nvals == t->init_size)
+    {
+        t->init_size *= 2;
+        ir->init = (int *)checked_realloc(ir->init,
+                                          t->init_size * sizeof(int));
+    }
+
+    ir->init[ir->nvals] = n;
+    return ir->nvals++;
+}
+
+
+/*
+ * Does: Maps a stack opcode to the IR opcode computing the same value.
+ * Arguments:
+ * -- op: ADD, SUB, MUL, DIV, LDM, MSIZE, SPAWN or JOIN.
+ * Returns: The IR opcode.
+ */
+static int arith_op(int op)
+{
+    switch (op)
+    {
+    case SPAWN:
+        return R_SPAWN;
+
+    case JOIN:
+        return R_JOIN;
+
+    case LDM:
+        return R_LDM;
+
+    case MSIZE:
+        return R_MSIZE;
+
+    case ADD:
+        return R_ADD;
+
+    case SUB:
+        return R_SUB;
+
+    case MUL:
+        return R_MUL;
+
+    default:
+        return R_DIV;
+    }
+}
+
+
+/*
+ * Does: Writes a symbolic stack entry out to its slot.  Pending
+ * entries lower down that read the slot are written out first, since
+ * they need its old value.
+ * Arguments:
+ * -- t: The translator.
+ * -- k: The stack position.
+ * Returns: Void.
+ */
+static void materialize(translator *t, int k)
+{
+    sym_entry *e = &t->stack[k];
+    int j;
+
+    if (e->kind == IN_SLOT)
+    {
+        return;
+    }
+
+    for (j = 0; j < k; j++)
+    {
+        if (t->stack[j].kind == PENDING
+            && (t->stack[j].a == SLOT(k) || t->stack[j].b == SLOT(k)))
+        {
+            materialize(t, j);
+        }
+    }
+
+    if (e->kind == COPY)
+    {
+        emit(t, R_MOV, SLOT(k), e->a, 0, 0);
+    }
+    else
+    {
+        emit(t, arith_op(e->op), SLOT(k), e->a, e->b, 0);
+    }
+
+    e->kind = IN_SLOT;
+}
+
+
+/*
+ * Does: Writes the whole symbolic stack out to the slots.
+ * Arguments:
+ * -- t: The translator.
+ * Returns: Void.
+ */
+static void flush(translator *t)
+{
+    int k;
+
+    for (k = 0; k < t->depth; k++)
+    {
+        materialize(t, k);
+    }
+}
+
+
+/*
+ * Does: Gets an operand for the value at stack position k, writing it
+ * out to its slot first if it is pending.
+ * Arguments:
+ * -- t: The translator.
+ * -- k: The stack position.
+ * Returns: The value's index in 'v'.
+ */
+static int operand(translator *t, int k)
+{
+    if (t->stack[k].kind == PENDING)
+    {
+        materialize(t, k);
+    }
+
+    return t->stack[k].kind == COPY ? t->stack[k].a : SLOT(k);
+}
+
+
+/*
+ * Does: Writes out every entry that reads register r, before r is
+ * overwritten.
+ * Arguments:
+ * -- t: The translator.
+ * -- r: The register.
+ * Returns: Void.
+ */
+static void before_store(translator *t, int r)
+{
+    int k;
+
+    for (k = 0; k < t->depth; k++)
+    {
+        if (t->stack[k].kind != IN_SLOT
+            && (t->stack[k].a == r
+                || (t->stack[k].kind == PENDING && t->stack[k].b == r)))
+        {
+            materialize(t, k);
+        }
+    }
+}
+
+
+/*
+ * Does: Pushes a symbolic entry.
+ * Arguments:
+ * -- t: The translator.
+ * -- kind, op, a, b: The entry.
+ * Returns: Void.
+ */
+static void push(translator *t, int kind, int op, int a, int b)
+{
+    sym_entry *e = &t->stack[t->depth++];
+
+    e->kind = kind;
+    e->op = op;
+    e->a = a;
+    e->b = b;
+}
+
+
+/*
+ * Does: Translates one decoded instruction.
+ * Arguments:
+ * -- t: The translator.
+ * -- inst: The instruction.
+ * Returns: Void.
+ */
+static void translate(translator *t, decoded_inst *inst)
+{
+    sym_entry top;
+    int a, b;
+
+    switch (inst->op)
+    {
+    case NOP:
+        break;
+
+    case PUSH:
+        push(t, COPY, 0, constant(t, inst->arg), 0);
+        break;
+
+    case POP:
+        /* The value is never needed, so it is never computed. */
+        t->depth--;
+        break;
+
+    case LOAD:
+        push(t, COPY, 0, inst->arg, 0);
+        break;
+
+    case STORE:
+        top = t->stack[--t->depth];
+        before_store(t, inst->arg);
+
+        if (top.kind == PENDING)
+        {
+            emit(t, arith_op(top.op), inst->arg, top.a, top.b, 0);
+        }
+        else
+        {
+            a = top.kind == COPY ? top.a : SLOT(t->depth);
+
+            if (a != inst->arg)
+            {
+                emit(t, R_MOV, inst->arg, a, 0, 0);
+            }
+        }
+        break;
+
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+        a = operand(t, t->depth - 2);
+        b = operand(t, t->depth - 1);
+        t->depth -= 2;
+        push(t, PENDING, inst->op, a, b);
+        break;
+
+    case PRINT:
+        a = operand(t, t->depth - 1);
+        t->depth--;
+        emit(t, R_PRINT, 0, a, 0, 0);
+        break;
+
+    case LDM:
+    case MSIZE:
+    case SPAWN:
+    case JOIN:
+        /*
+         * Computed now, straight into the slot (see above).  SPAWN's
+         * 'a' is the child's address, not an index into 'v'.
+         */
+        a = inst->op == SPAWN ? t->code[inst->arg].pc : 0;
+
+        if (inst->op == LDM || inst->op == JOIN)
+        {
+            a = operand(t, t->depth - 1);
+            t->depth--;
+        }
+
+        push(t, PENDING, inst->op, a, 0);
+        materialize(t, t->depth - 1);
+        break;
+
+    case STM:
+        a = operand(t, t->depth - 1);
+        b = operand(t, t->depth - 2);
+        t->depth -= 2;
+        emit(t, R_STM, 0, a, b, 0);
+        break;
+
+    case JMP:
+        flush(t);
+        emit(t, R_JMP, 0, 0, 0, inst->arg);
+        break;
+
+    case JZ:
+    case JNZ:
+        top = t->stack[--t->depth];
+
+        /*
+         * The rest of the stack is written out first; that only writes
+         * slots below the condition's, which it never reads.
+         */
+        flush(t);
+
+        if (top.kind == PENDING && top.op == SUB)
+        {
+            /* a - b == 0 exactly when a == b. */
+            emit(t, inst->op == JZ ? R_JEQ : R_JNE, 0, top.a, top.b,
+                 inst->arg);
+        }
+        else
+        {
+            t->stack[t->depth] = top;
+            a = operand(t, t->depth);
+            emit(t, inst->op == JZ ? R_JZ : R_JNZ, 0, a, 0, inst->arg);
+        }
+        break;
+
+    case STOP:
+        flush(t);
+        emit(t, R_STOP, 0, t->depth, 0, 0);
+        break;
+
+    default:
+        flush(t);
+        emit(t, R_INVALID, 0, t->depth, inst->arg, 0);
+        break;
+    }
+}
+
+
+/*
+ * Does: Translates a verified decoded program into the register IR.
+ * Arguments:
+ * -- prog: The decoded program; it must have passed 'verify_program'
+ *    and must not have been fused.
+ * -- ir: Where to store the translation.
+ * Returns: 1 on success, 0 if the program isn't verified.
+ */
+int translate_to_registers(decoded_program *prog, reg_program *ir)
+{
+    translator t;
+    int *is_target;
+    int *new_index;
+    int i;
+
+    ir->code = NULL;
+    ir->ncode = 0;
+    ir->init = NULL;
+    ir->nvals = SLOT(STACK_SIZE);
+
+    if (!prog->verified || prog->depth == NULL)
+    {
+        return 0;
+    }
+
+    t.ir = ir;
+    t.code = prog->code;
+    t.size = prog->ncode + 1;
+    t.init_size = ir->nvals;
+    t.depth = 0;
+    ir->code = (reg_inst *)checked_malloc(t.size * sizeof(reg_inst));
+    ir->init = (int *)checked_malloc(ir->nvals * sizeof(int));
+
+    for (i = 0; i < ir->nvals; i++)
+    {
+        ir->init[i] = 0;
+    }
+
+    is_target = (int *)checked_calloc(prog->ncode, sizeof(int));
+    new_index = (int *)checked_malloc(prog->ncode * sizeof(int));
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        if (prog->code[i].op == JMP || prog->code[i].op == JZ
+            || prog->code[i].op == JNZ)
+        {
+            is_target[prog->code[i].arg] = 1;
+        }
+    }
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        if (prog->depth[i] < 0)
+        {
+            /* Unreachable: nothing to translate. */
+            new_index[i] = ir->ncode;
+            continue;
+        }
+
+        if (is_target[i])
+        {
+            flush(&t);
+        }
+
+        /*
+         * Straight after a JMP or STOP the depth may change; the stack
+         * has just been written out, so it is all in the slots.
+         */
+        if (t.depth != prog->depth[i])
+        {
+            for (t.depth = 0; t.depth < prog->depth[i]; t.depth++)
+            {
+                t.stack[t.depth].kind = IN_SLOT;
+            }
+        }
+
+        new_index[i] = ir->ncode;
+        translate(&t, &prog->code[i]);
+    }
+
+    for (i = 0; i < ir->ncode; i++)
+    {
+        switch (ir->code[i].op)
+        {
+        case R_JMP:
+        case R_JZ:
+        case R_JNZ:
+        case R_JEQ:
+        case R_JNE:
+            ir->code[i].target = new_index[ir->code[i].target];
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    free(is_target);
+    free(new_index);
+    return 1;
+}
+
+
+/*
+ * Does: Frees a register program.
+ * Arguments:
+ * -- ir: The register program.
+ * Returns: Void.
+ */
+void free_registers(reg_program *ir)
+{
+    free(ir->code);
+    free(ir->init);
+    ir->code = NULL;
+    ir->init = NULL;
+    ir->ncode = 0;
+}
+
+
+/*
+ * Does: Copies the VM's state back out of the value array when the
+ * program stops.
+ * Arguments:
+ * -- vm: The VM.
+ * -- v: The value array.
+ * -- depth: The stack depth.
+ * Returns: Void.
+ */
+static void write_back(vm_type *vm, int *v, int depth)
+{
+    int i;
+
+    for (i = 0; i < NREGS; i++)
+    {
+        vm->reg[i] = v[i];
+    }
+
+    for (i = 0; i < depth; i++)
+    {
+        vm->stack[i] = v[SLOT(i)];
+    }
+
+    vm->sp = depth;
+}
+
+
+/*
+ * Does: Runs a register program on a value array that has been set up
+ * for it.
+ * Arguments:
+ * -- vm: The VM.
+ * -- ir: The register program.
+ * -- v: The value array.
+ * Returns: Void.
+ */
+static void interpret(vm_type *vm, reg_program *ir, int *v)
+{
+    reg_inst *code = ir->code;
+    reg_inst *inst;
+    int i = 0;
+    int a;
+
+    while (1)
+    {
+        inst = &code[i++];
+
+        switch (inst->op)
+        {
+        case R_MOV:
+            v[inst->dst] = v[inst->a];
+            break;
+
+        case R_ADD:
+            v[inst->dst] = v[inst->a] + v[inst->b];
+            break;
+
+        case R_SUB:
+            v[inst->dst] = v[inst->a] - v[inst->b];
+            break;
+
+        case R_MUL:
+            v[inst->dst] = v[inst->a] * v[inst->b];
+            break;
+
+        case R_DIV:
+            /* Same arithmetic as 'do_div'. */
+            v[inst->dst] = RECIPROCAL(v[inst->b]) * v[inst->a];
+            break;
+
+        case R_PRINT:
+            vm_print(vm, v[inst->a]);
+            break;
+
+        case R_JMP:
+            i = inst->target;
+            break;
+
+        case R_JZ:
+            if (v[inst->a] == 0)
+            {
+                i = inst->target;
+            }
+            break;
+
+        case R_JNZ:
+            if (v[inst->a] != 0)
+            {
+                i = inst->target;
+            }
+            break;
+
+        case R_JEQ:
+            if (v[inst->a] == v[inst->b])
+            {
+                i = inst->target;
+            }
+            break;
+
+        case R_JNE:
+            if (v[inst->a] != v[inst->b])
+            {
+                i = inst->target;
+            }
+            break;
+
+        case R_LDM:
+            v[inst->dst] = DATA_LOAD(v[inst->a]);
+            break;
+
+        case R_STM:
+            a = v[inst->a];
+            DATA_STORE(a, v[inst->b]);
+            break;
+
+        case R_MSIZE:
+            v[inst->dst] = vm->ndata_in;
+            break;
+
+        case R_SPAWN:
+            /* The registers are the start of 'v'. */
+            v[inst->dst] = vm_spawn(vm, inst->a, v);
+            break;
+
+        case R_JOIN:
+            v[inst->dst] = vm_join(vm, v[inst->a]);
+            break;
+
+        case R_STOP:
+            write_back(vm, v, inst->a);
+            return;
+
+        default:
+            write_back(vm, v, inst->a);
+            fprintf(stderr, "execute_registers: invalid instruction: "
+                    "%x\n", inst->b);
+            fprintf(stderr, "\taborting program!\n");
+            vm->status = VM_INVALID;
+            return;
+        }
+    }
+}
+
+
+/*
+ * Does: Executes a register program.  Produces the same output as
+ * running the original bytecode with 'execute_program'.
+ * Arguments:
+ * -- vm: The VM.
+ * -- ir: The register program.
+ * Returns: Void.
+ */
+void execute_registers(vm_type *vm, reg_program *ir)
+{
+    jmp_buf outer;
+    int *v;
+    int i, failed = 0;
+
+    v = (int *)checked_malloc(ir->nvals * sizeof(int));
+
+    for (i = 0; i < ir->nvals; i++)
+    {
+        v[i] = ir->init[i];
+    }
+
+    for (i = 0; i < NREGS; i++)
+    {
+        v[i] = vm->reg[i];
+    }
+
+    /*
+     * Catch data memory and JOIN errors so 'v' can be freed, then pass
+     * them on.
+     */
+    memcpy(outer, vm->on_error, sizeof(jmp_buf));
+
+    if (setjmp(vm->on_error) == 0)
+    {
+        interpret(vm, ir, v);
+    }
+    else
+    {
+        failed = 1;
+    }
+
+    memcpy(vm->on_error, outer, sizeof(jmp_buf));
+    free(v);
+
+    if (failed)
+    {
+        longjmp(vm->on_error, VM_ERROR);
+    }
+}
@@ -0,0 +1,292 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_sched.c
+ *       A cooperative scheduler for many VMs on a few threads.
+ *
+ * Every VM submitted waits in one of SCHED_LEVELS run queues.  Each
+ * scheduler thread takes the first VM from the most urgent non-empty
+ * queue and runs it with 'vm_step' for that level's time slice (the
+ * quantum at level 0, doubling at each level below).  A VM that is
+ * still running afterwards has used its whole slice: it goes to the
+ * back of the next level down.  Within a level VMs take turns, round
+ * robin.
+ *
+ * This is a multi-level feedback queue: a short program finishes in
+ * its first slice or two, before the long ones it was queued behind,
+ * and the long ones sink to the bottom level and share what is left.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bci.h"
+
+
+/* A VM waiting for its next slice. */
+typedef struct sched_task
+{
+    vm_type *vm;
+    void *arg;
+    int level;
+    struct sched_task *next;
+} sched_task;
+
+struct scheduler
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when a task is queued.  */
+    pthread_cond_t idle;        /* Signalled when a task finishes.   */
+    sched_task *head[SCHED_LEVELS];
+    sched_task *tail[SCHED_LEVELS];
+    int unfinished;             /* Tasks submitted but not done.     */
+    int shutdown;
+    unsigned long quantum;
+    void (*done)(vm_type *vm, void *arg);
+    pthread_t *threads;
+    int nthreads;
+};
+
+
+/*
+ * Does: Puts a task at the back of its level's queue.  The caller
+ * holds the lock.
+ * Arguments:
+ * -- s: The scheduler.
+ * -- task: The task.
+ * Returns: Void.
+ */
+static void enqueue(scheduler *s, sched_task *task)
+{
+    task->next = NULL;
+
+    if (s->tail[task->level] == NULL)
+    {
+        s->head[task->level] = task;
+    }
+    else
+    {
+        s->tail[task->level]->next = task;
+    }
+
+    s->tail[task->level] = task;
+    pthread_cond_signal(&s->work);
+}
+
+
+/*
+ * Does: Takes the first task from the most urgent non-empty queue.
+ * The caller holds the lock.
+ * Arguments:
+ * -- s: The scheduler.
+ * Returns: The task, or NULL if every queue is empty.
+ */
+static sched_task *dequeue(scheduler *s)
+{
+    sched_task *task;
+    int level;
+
+    for (level = 0; level < SCHED_LEVELS; level++)
+    {
+        task = s->head[level];
+
+        if (task != NULL)
+        {
+            s->head[level] = task->next;
+
+            if (s->head[level] == NULL)
+            {
+                s->tail[level] = NULL;
+            }
+
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Does: The body of a scheduler thread: runs slices until the
+ * scheduler is destroyed.
+ * Arguments:
+ * -- arg: The scheduler.
+ * Returns: NULL.
+ */
+static void *sched_thread(void *arg)
+{
+    scheduler *s = (scheduler *)arg;
+    sched_task *task;
+    int status;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (1)
+    {
+        while (!s->shutdown && (task = dequeue(s)) == NULL)
+        {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+
+        if (s->shutdown)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&s->lock);
+        status = vm_step(task->vm, s->quantum << task->level);
+
+        if (status != VM_RUNNING)
+        {
+            s->done(task->vm, task->arg);
+            free(task);
+        }
+
+        pthread_mutex_lock(&s->lock);
+
+        if (status == VM_RUNNING)
+        {
+            /* It used its whole slice: a long-running program. */
+            if (task->level < SCHED_LEVELS - 1)
+            {
+                task->level++;
+            }
+
+            enqueue(s, task);
+        }
+        else if (--s->unfinished == 0)
+        {
+            pthread_cond_broadcast(&s->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+
+/*
+ * Does: Creates a scheduler and starts its threads.
+ * Arguments:
+ * -- nthreads: The number of threads to run VMs on (at least 1).
+ * -- quantum: The time slice at level 0, in instructions.
+ * -- done: Called with each VM (and its 'arg') as it finishes.
+ * Returns: The new scheduler.
+ */
+scheduler *sched_create(int nthreads, unsigned long quantum,
+                        void (*done)(vm_type *vm, void *arg))
+{
+    scheduler *s = (scheduler *)checked_malloc(sizeof(scheduler));
+    int i;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->idle, NULL);
+
+    for (i = 0; i < SCHED_LEVELS; i++)
+    {
+        s->head[i] = NULL;
+        s->tail[i] = NULL;
+    }
+
+    s->unfinished = 0;
+    s->shutdown = 0;
+    s->quantum = quantum > 0 ? quantum : 1;
+    s->done = done;
+    s->nthreads = nthreads > 0 ? nthreads : 1;
+    s->threads = (pthread_t *)checked_malloc(s->nthreads
+                                             * sizeof(pthread_t));
+
+    for (i = 0; i < s->nthreads; i++)
+    {
+        if (pthread_create(&s->threads[i], NULL, sched_thread, s) != 0)
+        {
+            fprintf(stderr, "Fatal error: can't create thread. "
+                    "Terminating program.\n");
+            exit(1);
+        }
+    }
+
+    return s;
+}
+
+
+/*
+ * Does: Queues a VM, with a program loaded, to be run.
+ * Arguments:
+ * -- s: The scheduler.
+ * -- vm: The VM; it mustn't be touched until 'done' is called.
+ * -- priority: Its starting level, 0 (most urgent) to SCHED_LEVELS - 1.
+ * -- arg: Passed on to 'done'.
+ * Returns: Void.
+ */
+void sched_submit(scheduler *s, vm_type *vm, int priority, void *arg)
+{
+    sched_task *task = (sched_task *)checked_malloc(sizeof(sched_task));
+
+    task->vm = vm;
+    task->arg = arg;
+    task->level = priority < 0 ? 0 : priority < SCHED_LEVELS
+                  ? priority : SCHED_LEVELS - 1;
+
+    pthread_mutex_lock(&s->lock);
+    s->unfinished++;
+    enqueue(s, task);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/*
+ * Does: Waits until every VM submitted so far has finished.
+ * Arguments:
+ * -- s: The scheduler.
+ * Returns: Void.
+ */
+void sched_wait(scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+
+    while (s->unfinished > 0)
+    {
+        pthread_cond_wait(&s->idle, &s->lock);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/*
+ * Does: Stops a scheduler's threads and frees it.  VMs still queued
+ * are dropped without 'done' being called; use 'sched_wait' first.
+ * Arguments:
+ * -- s: The scheduler.
+ * Returns: Void.
+ */
+void sched_destroy(scheduler *s)
+{
+    sched_task *task;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = 1;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->nthreads; i++)
+    {
+        pthread_join(s->threads[i], NULL);
+    }
+
+    while ((task = dequeue(s)) != NULL)
+    {
+        free(task);
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->idle);
+    free(s->threads);
+    free(s);
+}
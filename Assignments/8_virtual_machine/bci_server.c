@@ -0,0 +1,294 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_server.c
+ *       Fork-server mode: runs one program many times, each run in a
+ *       process of its own.
+ *
+ * 'bci --fork-server=SOCKET prog.bcm' loads the program and does all
+ * the load-time work for the chosen engine (decoding, verifying,
+ * fusing) once.  Then it listens on a UNIX-domain socket, and forks a
+ * child for each connection.  The child shares the loaded program with
+ * the server copy-on-write, so a run costs a fork rather than an exec
+ * and a load, and a run that crashes takes nothing else down with it.
+ *
+ * The protocol is one request and one reply per connection.  The
+ * request is a line holding up to NREGS integers, the initial values
+ * of registers 0, 1, ... (the rest start at zero).  The reply is a
+ * line
+ *
+ *     status S N
+ *
+ * where S is how the program finished (VM_OK, VM_INVALID or VM_ERROR)
+ * or -1 for a bad request, followed by the N bytes of PRINT output.
+ * Diagnostics go to the server's stderr.  SIGINT or SIGTERM stops the
+ * server and removes the socket.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* The longest request accepted. */
+#define MAX_REQUEST 1024
+
+/* Set by SIGINT and SIGTERM. */
+static volatile sig_atomic_t stopping = 0;
+
+
+/*
+ * Does: Notes that the server has been asked to stop.
+ * Arguments:
+ * -- sig: The signal.
+ * Returns: Void.
+ */
+static void stop_server(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+
+/*
+ * Does: Writes all of a buffer to a socket.
+ * Arguments:
+ * -- fd: The socket.
+ * -- buf: The bytes.
+ * -- len: How many.
+ * Returns: Void (a client that has gone away just misses the reply).
+ */
+static void write_all(int fd, const char *buf, int len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            return;
+        }
+
+        buf += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Does: Reads a request line from a client and sets the registers
+ * from it.
+ * Arguments:
+ * -- fd: The client's socket.
+ * -- vm: The VM.
+ * Returns: 1 on success, 0 if the request is malformed.
+ */
+static int read_request(int fd, vm_type *vm)
+{
+    char buf[MAX_REQUEST + 1];
+    char *p, *end;
+    ssize_t n;
+    int len = 0, r;
+    long value;
+
+    /* Up to the newline (or the end, if the client shuts down). */
+    while (len < MAX_REQUEST && memchr(buf, '\n', len) == NULL)
+    {
+        n = read(fd, buf + len, MAX_REQUEST - len);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            break;
+        }
+
+        len += n;
+    }
+
+    buf[len] = '\0';
+    p = buf;
+
+    for (r = 0; ; r++)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+        {
+            p++;
+        }
+
+        if (*p == '\n' || *p == '\0')
+        {
+            return 1;
+        }
+
+        value = strtol(p, &end, 10);
+
+        if (end == p || r == NREGS)
+        {
+            return 0;
+        }
+
+        vm->reg[r] = (int)value;
+        p = end;
+    }
+}
+
+
+/*
+ * Does: Handles one connection, in the child forked for it: runs the
+ * program and sends back the reply.
+ * Arguments:
+ * -- fd: The client's socket.
+ * -- vm: The VM, with the program loaded.
+ * -- opts: The run options.
+ * -- prog: The prepared program, or NULL.
+ * Returns: Void.
+ */
+static void serve_request(int fd, vm_type *vm, run_options *opts,
+                          decoded_program *prog)
+{
+    char header[64];
+    char *out = NULL;
+    int status = -1, len = 0;
+
+    if (read_request(fd, vm))
+    {
+        vm_capture_output(vm);
+        status = vm_run_prepared(vm, opts, prog);
+        out = vm_take_output(vm, &len);
+    }
+    else
+    {
+        fprintf(stderr, "bci_server.c: bad request\n");
+    }
+
+    sprintf(header, "status %d %d\n", status, len);
+    write_all(fd, header, strlen(header));
+    write_all(fd, out, len);
+}
+
+
+/*
+ * Does: Runs the fork server until SIGINT or SIGTERM.
+ * Arguments:
+ * -- vm: The VM, with the program loaded.
+ * -- opts: How to run the program.
+ * -- path: Where to create the socket; anything already there is
+ *    replaced.
+ * Returns: 1 after a clean shutdown, 0 if the socket can't be set up.
+ */
+int vm_serve(vm_type *vm, run_options *opts, char *path)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    decoded_program prog;
+    int listener, fd, decoded;
+    pid_t pid;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "bci_server.c: vm_serve: socket path %s is too "
+                "long\n", path);
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+
+    if (listener < 0
+        || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listener, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "bci_server.c: vm_serve: can't listen on %s: "
+                "%s\n", path, strerror(errno));
+
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+
+        return 0;
+    }
+
+    /* The work every run would otherwise repeat, done once. */
+    decoded = vm_prepare(vm, opts, &prog);
+
+    /*
+     * Children are never waited for, so let the kernel reap them.  The
+     * stop signals must interrupt 'accept', so no SA_RESTART.
+     */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr, "bci: serving on %s\n", path);
+
+    while (!stopping)
+    {
+        fd = accept(listener, NULL, NULL);
+
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("bci_server.c: vm_serve: accept");
+            }
+
+            continue;
+        }
+
+        fflush(stderr);
+        pid = fork();
+
+        if (pid == 0)
+        {
+            close(listener);
+            serve_request(fd, vm, opts, decoded ? &prog : NULL);
+            close(fd);
+            _exit(0);
+        }
+
+        if (pid < 0)
+        {
+            perror("bci_server.c: vm_serve: fork");
+        }
+
+        close(fd);
+    }
+
+    close(listener);
+    unlink(path);
+
+    if (decoded)
+    {
+        free_decoded(&prog);
+    }
+
+    return 1;
+}
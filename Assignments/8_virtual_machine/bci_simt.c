@@ -0,0 +1,575 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_simt.c
+ *       SIMT mode: runs one program over many sets of starting
+ *       registers at once, in lockstep.
+ *
+ * 'bci --simt=inputs.csv [--simt-out=results.csv] prog.bcm' runs the
+ * program once per row of the CSV file (the starting values of
+ * registers 0, 1, ...; the rest start at zero).  Each run is a lane.
+ * For each lane, in order, a line of the results holds how it finished
+ * (VM_OK, VM_INVALID or VM_ERROR) and then the values it printed, all
+ * separated by commas.
+ *
+ * If the program verifies, every lane has the same stack depth at the
+ * same instruction, so the lanes can share one stack pointer (the
+ * verifier's depth) and step through the program together.  Registers
+ * and stack slots are stored lane by lane ('reg[r * nlanes + lane]'),
+ * so an instruction is a loop over contiguous lanes that the compiler
+ * can vectorize.
+ *
+ * Lanes diverge at a JZ or JNZ that some take and some don't.  Each
+ * lane then has its own instruction, and the lanes at the lowest one
+ * run next, with the others masked off until the lowest catches up
+ * with them.  In structured code that is the branch's post-dominator:
+ * the end of an if, or the exit of a loop, where lanes that left early
+ * wait for the ones still going round.
+ *
+ * A program that doesn't verify runs lane by lane instead, with the
+ * checked decoded-stream interpreter.  So does one that uses the data
+ * memory: the lanes share it, and each must see what the lanes before
+ * it stored, in order.  And so does one that starts children, which
+ * need a VM of their own (see bci_spawn.c).
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* The longest line accepted in an input file. */
+#define MAX_LINE 4096
+
+/* The 'pc' of a lane that has finished. */
+#define DONE INT_MAX
+
+
+/* The starting registers of every lane. */
+typedef struct
+{
+    int *reg;        /* reg[lane * NREGS + r]. */
+    int nlanes;
+} simt_inputs;
+
+/* What each lane printed. */
+typedef struct
+{
+    int *values;
+    int len;
+    int size;
+} lane_output;
+
+typedef struct
+{
+    int nlanes;
+    int *reg;               /* reg[r * nlanes + lane].              */
+    int *stack;             /* stack[depth * nlanes + lane].        */
+    int *pc;                /* Instruction of each lane not running
+                               now, or DONE.                        */
+    int *status;            /* How each lane finished.              */
+    lane_output *out;
+    int *active;            /* The lanes at the current instruction. */
+    int nactive;
+    int nlive;              /* Lanes that haven't finished.         */
+    unsigned long steps;    /* Instructions issued.                 */
+    unsigned long lanes_run;   /* Summed over every issue.          */
+} simt_state;
+
+
+/*
+ * Does: Reads the lanes' starting registers from a CSV file.  Blank
+ * lines and lines starting with '#' are skipped.
+ * Arguments:
+ * -- filename: The file.
+ * -- in: Where to store the registers.
+ * Returns: 1 on success, 0 (after saying why) on failure.
+ */
+static int read_inputs(char *filename, simt_inputs *in)
+{
+    char line[MAX_LINE];
+    char *p, *end;
+    FILE *fp;
+    int size = 64, lineno = 0, r;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "bci: simt: can't open %s\n", filename);
+        return 0;
+    }
+
+    in->reg = (int *)checked_malloc(size * NREGS * sizeof(int));
+    in->nlanes = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        p = line + strspn(line, " \t\r");
+
+        if (*p == '\n' || *p == '\0' || *p == '#')
+        {
+            continue;
+        }
+
+        if (in->nlanes == size)
+        {
+            size *= 2;
+            in->reg = (int *)checked_realloc(in->reg,
+                                             size * NREGS * sizeof(int));
+        }
+
+        for (r = 0; r < NREGS; r++)
+        {
+            in->reg[in->nlanes * NREGS + r] = 0;
+        }
+
+        for (r = 0; ; r++)
+        {
+            p += strspn(p, " \t\r");
+
+            if (*p == '\n' || *p == '\0')
+            {
+                break;
+            }
+
+            in->reg[in->nlanes * NREGS + r] = (int)strtol(p, &end, 10);
+
+            if (end == p || r == NREGS)
+            {
+                fprintf(stderr, "bci: simt: %s line %d: expected up to "
+                        "%d integers, separated by commas\n", filename,
+                        lineno, NREGS);
+                fclose(fp);
+                free(in->reg);
+                return 0;
+            }
+
+            p = end + strspn(end, " \t\r");
+
+            if (*p == ',')
+            {
+                p++;
+            }
+        }
+
+        in->nlanes++;
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+
+/*
+ * Does: Records a value a lane printed.
+ * Arguments:
+ * -- out: The lane's output.
+ * -- value: The value.
+ * Returns: Void.
+ */
+static void lane_print(lane_output *out, int value)
+{
+    if (out->len == out->size)
+    {
+        out->size = out->size ? 2 * out->size : 8;
+        out->values = (int *)checked_realloc(out->values,
+                                             out->size * sizeof(int));
+    }
+
+    out->values[out->len++] = value;
+}
+
+
+/*
+ * Does: Works out which lanes run next: those at the lowest
+ * instruction.
+ * Arguments:
+ * -- st: The lanes.
+ * Returns: That instruction, or DONE if every lane has finished.
+ */
+static int schedule(simt_state *st)
+{
+    int l, next = DONE;
+
+    for (l = 0; l < st->nlanes; l++)
+    {
+        if (st->pc[l] < next)
+        {
+            next = st->pc[l];
+        }
+    }
+
+    st->nactive = 0;
+
+    if (next == DONE)
+    {
+        return DONE;
+    }
+
+    for (l = 0; l < st->nlanes; l++)
+    {
+        if (st->pc[l] == next)
+        {
+            st->active[st->nactive++] = l;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ * Apply a statement to every running lane 'l'.  When they all are, the
+ * loop runs over contiguous lanes and can be vectorized.
+ */
+#define FOR_ACTIVE(stmt)                                        \
+    if (st->nactive == n)                                       \
+    {                                                           \
+        for (l = 0; l < n; l++)                                 \
+        {                                                       \
+            stmt;                                               \
+        }                                                       \
+    }                                                           \
+    else                                                        \
+    {                                                           \
+        for (k = 0; k < st->nactive; k++)                       \
+        {                                                       \
+            l = st->active[k];                                  \
+            stmt;                                               \
+        }                                                       \
+    }
+
+/* Stack slot 'k' down from the top (1 is the top), in every lane. */
+#define SLOT(k) (st->stack + (d - (k)) * n)
+
+/* Arithmetic wraps, as it does in the interpreter. */
+#define WRAP(expr) ((int)(expr))
+#define U(x)       ((unsigned int)(x))
+
+
+/*
+ * Does: Checks whether a program uses the data memory or starts
+ * children.
+ * Arguments:
+ * -- prog: The decoded program.
+ * Returns: 1 if it does, 0 if not.
+ */
+static int uses_vm(decoded_program *prog)
+{
+    int i;
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        if (prog->code[i].op == LDM || prog->code[i].op == STM
+            || prog->code[i].op == MSIZE || prog->code[i].op == SPAWN
+            || prog->code[i].op == JOIN)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Does: Runs a verified program on every lane in lockstep.
+ * Arguments:
+ * -- prog: The program, which must have been verified.
+ * -- st: The lanes, with their registers set.
+ * Returns: Void.
+ */
+static void execute_simt(decoded_program *prog, simt_state *st)
+{
+    decoded_inst *inst;
+    int n = st->nlanes;
+    int cur, next, d, l, k;
+    int *a, *b, *r;
+
+    cur = schedule(st);
+
+    while (cur != DONE)
+    {
+        inst = &prog->code[cur];
+        d = prog->depth[cur];
+        next = cur + 1;
+        st->steps++;
+        st->lanes_run += st->nactive;
+
+        switch (inst->op)
+        {
+        case NOP:
+        case POP:
+            break;
+
+        case PUSH:
+            a = SLOT(0);
+            FOR_ACTIVE(a[l] = inst->arg);
+            break;
+
+        case LOAD:
+            a = SLOT(0);
+            r = st->reg + inst->arg * n;
+            FOR_ACTIVE(a[l] = r[l]);
+            break;
+
+        case STORE:
+            a = SLOT(1);
+            r = st->reg + inst->arg * n;
+            FOR_ACTIVE(r[l] = a[l]);
+            break;
+
+        case ADD:
+            a = SLOT(1);
+            b = SLOT(2);
+            FOR_ACTIVE(b[l] = WRAP(U(b[l]) + U(a[l])));
+            break;
+
+        case SUB:
+            a = SLOT(1);
+            b = SLOT(2);
+            FOR_ACTIVE(b[l] = WRAP(U(b[l]) - U(a[l])));
+            break;
+
+        case MUL:
+            a = SLOT(1);
+            b = SLOT(2);
+            FOR_ACTIVE(b[l] = WRAP(U(b[l]) * U(a[l])));
+            break;
+
+        case DIV:
+            /* Same arithmetic as 'do_div'. */
+            a = SLOT(1);
+            b = SLOT(2);
+            FOR_ACTIVE(b[l] = WRAP(U(RECIPROCAL(a[l])) * U(b[l])));
+            break;
+
+        case PRINT:
+            a = SLOT(1);
+            FOR_ACTIVE(lane_print(&st->out[l], a[l]));
+            break;
+
+        case JMP:
+            next = inst->arg;
+            break;
+
+        case JZ:
+        case JNZ:
+            /* Each lane goes its own way; then pick who runs next. */
+            a = SLOT(1);
+            FOR_ACTIVE(st->pc[l] = (a[l] == 0) == (inst->op == JZ)
+                                   ? inst->arg : cur + 1);
+            cur = schedule(st);
+            continue;
+
+        case STOP:
+        default:
+            FOR_ACTIVE(st->pc[l] = DONE;
+                       st->status[l] = inst->op == STOP ? VM_OK
+                                       : VM_INVALID);
+
+            if (inst->op != STOP)
+            {
+                FOR_ACTIVE(fprintf(stderr, "execute_simt: lane %d: invalid "
+                                   "instruction: %x\n\taborting program!\n",
+                                   l, inst->arg));
+            }
+
+            st->nlive -= st->nactive;
+            cur = schedule(st);
+            continue;
+        }
+
+        if (st->nactive == st->nlive)
+        {
+            /* Nobody is waiting: carry on together. */
+            cur = next;
+        }
+        else
+        {
+            FOR_ACTIVE(st->pc[l] = next);
+            cur = schedule(st);
+        }
+    }
+}
+
+
+/*
+ * Does: Runs a program that can't be run in lockstep one lane at a
+ * time.
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- opts: The options it was prepared with.
+ * -- prog: The prepared program, or NULL.
+ * -- in: The starting registers.
+ * -- st: Where to record each lane's status and output.
+ * Returns: Void.
+ */
+static void execute_lanes(vm_type *vm, run_options *opts,
+                          decoded_program *prog, simt_inputs *in,
+                          simt_state *st)
+{
+    char *out, *p;
+    int l, r, len;
+
+    vm_capture_output(vm);
+
+    for (l = 0; l < in->nlanes; l++)
+    {
+        reset_vm(vm);
+
+        for (r = 0; r < NREGS; r++)
+        {
+            vm->reg[r] = in->reg[l * NREGS + r];
+        }
+
+        st->status[l] = vm_run_prepared(vm, opts, prog);
+        out = vm_take_output(vm, &len);
+
+        for (p = out; p < out + len; p = strchr(p, '\n') + 1)
+        {
+            lane_print(&st->out[l], atoi(p));
+        }
+
+        free(out);
+    }
+}
+
+
+/*
+ * Does: Runs the program loaded in a VM once per row of an input file,
+ * in lockstep if it verifies, and writes out what each run printed.
+ * Arguments:
+ * -- vm: The VM.
+ * -- opts: The run options ('--stats' is all that matters).
+ * -- inputs: The CSV file of starting registers.
+ * -- outputs: Where to write the results, or NULL for stdout.
+ * Returns: The number of lanes that finished with a stack error, or -1
+ * if the files can't be read or written.
+ */
+int run_simt(vm_type *vm, run_options *opts, char *inputs, char *outputs)
+{
+    run_options prep;
+    decoded_program prog;
+    simt_inputs in;
+    simt_state st;
+    FILE *fp;
+    int decoded, lockstep, maxdepth = 0;
+    int i, l, r, nerrors = 0;
+
+    if (!read_inputs(inputs, &in))
+    {
+        return -1;
+    }
+
+    fp = outputs == NULL ? stdout : fopen(outputs, "w");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "bci: simt: can't write %s\n", outputs);
+        free(in.reg);
+        return -1;
+    }
+
+    /* Lockstep needs the verifier's stack depths. */
+    prep = *opts;
+    prep.engine = ENGINE_DECODED;
+    prep.profile = 0;
+    decoded = vm_prepare(vm, &prep, &prog);
+    lockstep = decoded && prog.verified && !uses_vm(&prog);
+
+    if (lockstep)
+    {
+        for (i = 0; i < prog.ncode; i++)
+        {
+            if (prog.depth[i] > maxdepth)
+            {
+                maxdepth = prog.depth[i];
+            }
+        }
+    }
+
+    st.nlanes = in.nlanes;
+    st.nlive = in.nlanes;
+    st.reg = (int *)checked_malloc(NREGS * in.nlanes * sizeof(int));
+    st.stack = (int *)checked_malloc((maxdepth + 1) * in.nlanes
+                                     * sizeof(int));
+    st.pc = (int *)checked_malloc(in.nlanes * sizeof(int));
+    st.status = (int *)checked_malloc(in.nlanes * sizeof(int));
+    st.active = (int *)checked_malloc(in.nlanes * sizeof(int));
+    st.out = (lane_output *)checked_malloc(in.nlanes * sizeof(lane_output));
+    st.steps = 0;
+    st.lanes_run = 0;
+
+    for (l = 0; l < in.nlanes; l++)
+    {
+        for (r = 0; r < NREGS; r++)
+        {
+            st.reg[r * in.nlanes + l] = in.reg[l * NREGS + r];
+        }
+
+        st.pc[l] = 0;
+        st.out[l].values = NULL;
+        st.out[l].len = 0;
+        st.out[l].size = 0;
+    }
+
+    if (lockstep)
+    {
+        execute_simt(&prog, &st);
+    }
+    else
+    {
+        execute_lanes(vm, &prep, decoded ? &prog : NULL, &in, &st);
+    }
+
+    for (l = 0; l < in.nlanes; l++)
+    {
+        fprintf(fp, "%d", st.status[l]);
+
+        for (i = 0; i < st.out[l].len; i++)
+        {
+            fprintf(fp, ",%d", st.out[l].values[i]);
+        }
+
+        fprintf(fp, "\n");
+        nerrors += st.status[l] == VM_ERROR;
+        free(st.out[l].values);
+    }
+
+    if (opts->stats && lockstep)
+    {
+        fprintf(stderr, "simt: %d lanes in lockstep, %lu instructions "
+                "issued, %.1f lanes each on average\n", in.nlanes,
+                st.steps, st.steps ? (double)st.lanes_run / st.steps : 0.0);
+    }
+    else if (opts->stats)
+    {
+        fprintf(stderr, "simt: the program doesn't verify, or uses the "
+                "data memory or children; ran %d lanes one at a time\n",
+                in.nlanes);
+    }
+
+    if (fp != stdout)
+    {
+        fclose(fp);
+    }
+
+    if (decoded)
+    {
+        free_decoded(&prog);
+    }
+
+    free(st.reg);
+    free(st.stack);
+    free(st.pc);
+    free(st.status);
+    free(st.active);
+    free(st.out);
+    free(in.reg);
+    return nerrors;
+}
@@ -0,0 +1,566 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_spawn.c
+ *       SPAWN and JOIN: child VMs run on a work-stealing thread pool.
+ *
+ * A child gets a VM from a pool of VMs (bci_pool.c) that shares its
+ * parent's program and data memory, with a copy of the parent's
+ * registers and an empty stack.  The first SPAWN in a process starts
+ * one worker thread per processor (or BCI_THREADS of them), which run
+ * children with the reference interpreter, 'vm_step', for as long as
+ * the process lasts.
+ *
+ * Each worker has its own deque of children waiting to run.  A child
+ * spawned on a worker goes on the back of that worker's deque, and
+ * the worker takes its next child from the back too, so nested fan-outs
+ * are worked through depth first, on data still in its cache.  A
+ * worker whose deque is empty steals from the front of another's,
+ * where the oldest children, usually the biggest pieces of work, are.
+ * Children spawned by any other thread are dealt out to the deques in
+ * turn.  (Batch mode shares its programs out the same way; see
+ * bci_batch.c.)
+ *
+ * JOIN of a child that no worker has taken yet takes it back and runs
+ * it on the joining thread.  So a thread only ever waits for a child
+ * that is running, and however deeply spawns nest, the pool can't
+ * deadlock with every worker waiting for a child still in a deque.
+ *
+ * What a child prints is captured, and added to its parent's output
+ * when it is joined, so that the output doesn't depend on how the
+ * children were scheduled.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bci.h"
+
+
+/* The most idle VMs kept for children. */
+#define IDLE_VMS 64
+
+
+/* A child VM, and where it is in its life. */
+struct vm_child
+{
+    vm_type *vm;
+    struct spawn_pool *pool;
+    int home;          /* The deque it was queued on.           */
+    int queued;        /* Still there (under the deque's lock). */
+    int done;          /* Finished (under the pool's lock).     */
+};
+
+
+/* A worker's children waiting to run: tasks[head .. tail-1]. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    vm_child **tasks;
+    int head;
+    int tail;
+    int size;
+} child_deque;
+
+
+typedef struct spawn_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when a child is queued.  */
+    pthread_cond_t done;        /* Broadcast when a child finishes.   */
+    int queued;                 /* Children in the deques.            */
+    int next;                   /* The deque for a child spawned by a
+                                   thread that isn't a worker.        */
+    child_deque *deques;        /* One per worker.                    */
+    int nworkers;
+    vm_pool *vms;               /* The children's VMs.                */
+    pid_t pid;                  /* The process the workers are in.    */
+} spawn_pool;
+
+
+typedef struct
+{
+    spawn_pool *pool;
+    int id;
+} worker_arg;
+
+
+static spawn_pool *the_pool = NULL;
+static pthread_mutex_t the_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The worker running on this thread, or -1. */
+static __thread int worker_id = -1;
+
+
+/*
+ * Does: Runs a child to the end, and marks it done.
+ * Arguments:
+ * -- pool: The pool.
+ * -- c: The child, which nobody else is running.
+ * Returns: Void.
+ */
+static void run_child(spawn_pool *pool, vm_child *c)
+{
+    while (vm_step(c->vm, ULONG_MAX) == VM_RUNNING)
+    {
+        /* Keep going. */
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    c->done = 1;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Does: Takes the next child for a worker: the newest in its own
+ * deque, or failing that the oldest in another worker's.
+ * Arguments:
+ * -- pool: The pool.
+ * -- id: The worker.
+ * Returns: The child, or NULL if none was found.
+ */
+static vm_child *take_child(spawn_pool *pool, int id)
+{
+    child_deque *d;
+    vm_child *c = NULL;
+    int i;
+
+    for (i = 0; i < pool->nworkers && c == NULL; i++)
+    {
+        d = &pool->deques[(id + i) % pool->nworkers];
+        pthread_mutex_lock(&d->lock);
+
+        if (d->head < d->tail)
+        {
+            c = i == 0 ? d->tasks[--d->tail] : d->tasks[d->head++];
+            c->queued = 0;
+        }
+
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    if (c != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return c;
+}
+
+
+/*
+ * Does: Takes a particular child out of its deque, if no worker has
+ * taken it yet.
+ * Arguments:
+ * -- pool: The pool.
+ * -- c: The child.
+ * Returns: 1 if it was taken (the caller must run it), 0 if not.
+ */
+static int take_back(spawn_pool *pool, vm_child *c)
+{
+    child_deque *d = &pool->deques[c->home];
+    int i, taken = 0;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (c->queued)
+    {
+        /* Usually near the back, where it was put. */
+        for (i = d->tail - 1; d->tasks[i] != c; i--)
+        {
+            /* Keep looking. */
+        }
+
+        memmove(&d->tasks[i], &d->tasks[i + 1],
+                (d->tail - i - 1) * sizeof(vm_child *));
+        d->tail--;
+        c->queued = 0;
+        taken = 1;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    if (taken)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return taken;
+}
+
+
+/*
+ * Does: Puts a child on the back of a deque.
+ * Arguments:
+ * -- pool: The pool.
+ * -- c: The child, with 'home' set.
+ * Returns: Void.
+ */
+static void queue_child(spawn_pool *pool, vm_child *c)
+{
+    child_deque *d = &pool->deques[c->home];
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->tail == d->size)
+    {
+        if (d->head > d->size / 2)
+        {
+            /* Mostly stolen from: move what is left to the front. */
+            memmove(d->tasks, &d->tasks[d->head],
+                    (d->tail - d->head) * sizeof(vm_child *));
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        else
+        {
+            d->size = d->size > 0 ? 2 * d->size : 64;
+            d->tasks = (vm_child **)checked_realloc(
+                d->tasks, d->size * sizeof(vm_child *));
+        }
+    }
+
+    c->queued = 1;
+    d->tasks[d->tail++] = c;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Does: The body of a worker thread: runs children for ever.
+ * Arguments:
+ * -- arg: The worker's 'worker_arg'.
+ * Returns: Never.
+ */
+static void *worker(void *arg)
+{
+    spawn_pool *pool = ((worker_arg *)arg)->pool;
+    vm_child *c;
+
+    worker_id = ((worker_arg *)arg)->id;
+    free(arg);
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->queued == 0)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if ((c = take_child(pool, worker_id)) != NULL)
+        {
+            run_child(pool, c);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Does: Gets the pool, starting it on first use.  A process forked
+ * since then (the fork server's children) has none of its threads, so
+ * it starts a pool of its own.
+ * Arguments: Void.
+ * Returns: The pool.
+ */
+static spawn_pool *get_pool(void)
+{
+    spawn_pool *pool;
+    pthread_t thread;
+    worker_arg *arg;
+    char *env;
+    long n;
+    int i;
+
+    pthread_mutex_lock(&the_pool_lock);
+
+    if (the_pool != NULL && the_pool->pid == getpid())
+    {
+        pool = the_pool;
+        pthread_mutex_unlock(&the_pool_lock);
+        return pool;
+    }
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((env = getenv("BCI_THREADS")) != NULL && env[0] != '\0')
+    {
+        n = strtol(env, NULL, 10);
+    }
+
+    if (n < 1)
+    {
+        n = 1;
+    }
+
+    pool = (spawn_pool *)checked_malloc(sizeof(spawn_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->queued = 0;
+    pool->next = 0;
+    pool->nworkers = (int)n;
+    pool->deques = (child_deque *)checked_malloc(pool->nworkers
+                                                 * sizeof(child_deque));
+    pool->vms = vm_pool_create(IDLE_VMS);
+    pool->pid = getpid();
+
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].tasks = NULL;
+        pool->deques[i].head = 0;
+        pool->deques[i].tail = 0;
+        pool->deques[i].size = 0;
+    }
+
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        arg = (worker_arg *)checked_malloc(sizeof(worker_arg));
+        arg->pool = pool;
+        arg->id = i;
+
+        if (pthread_create(&thread, NULL, worker, arg) != 0)
+        {
+            fprintf(stderr, "bci_spawn.c: get_pool: can't start a "
+                    "worker thread\n");
+            exit(1);
+        }
+
+        pthread_detach(thread);
+    }
+
+    /* A pool left over from before a fork is never used again. */
+    the_pool = pool;
+    pthread_mutex_unlock(&the_pool_lock);
+    return pool;
+}
+
+
+/*
+ * Does: Waits for a child to finish (running it here if no worker has
+ * started it), adds what it printed to its parent's output, and frees
+ * it.
+ * Arguments:
+ * -- vm: The parent.
+ * -- c: The child.
+ * -- result: Where to store the child's result.
+ * Returns: How the child finished: VM_OK, VM_INVALID or VM_ERROR.
+ */
+static int finish_child(vm_type *vm, vm_child *c, int *result)
+{
+    spawn_pool *pool = c->pool;
+    vm_type *child = c->vm;
+    char *out;
+    int len, status;
+
+    if (take_back(pool, c))
+    {
+        run_child(pool, c);
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        while (!c->done)
+        {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    out = vm_take_output(child, &len);
+    vm_write_output(vm, out, len);
+    free(out);
+
+    *result = child->sp > 0 ? child->stack[child->sp - 1] : 0;
+    status = child->status;
+
+    /* The program and the data memory are the parent's. */
+    child->inst = child->inst_buf;
+    child->ninsts = 0;
+    child->data_in = NULL;
+    child->data_out = NULL;
+    child->ndata_in = 0;
+    child->ndata_out = 0;
+    vm_pool_put(pool->vms, child);
+    free(c);
+
+    return status;
+}
+
+
+/*
+ * Does: Starts a child running part of a VM's program.
+ * Arguments:
+ * -- vm: The parent.
+ * -- n: The address where the child starts.
+ * -- reg: The parent's registers, for the child to start with.
+ * Returns: The child's handle.
+ */
+int vm_spawn(vm_type *vm, int n, int *reg)
+{
+    spawn_pool *pool;
+    vm_type *child;
+    vm_child *c;
+    int handle, r;
+
+    if (vm->children == NULL)
+    {
+        vm->children = (vm_child **)checked_malloc(MAX_CHILDREN
+                                                   * sizeof(vm_child *));
+    }
+
+    for (handle = 0; handle < vm->nchildren; handle++)
+    {
+        if (vm->children[handle] == NULL)
+        {
+            break;
+        }
+    }
+
+    if (handle == MAX_CHILDREN)
+    {
+        fprintf(stderr, "Too many children\n");
+        longjmp(vm->on_error, VM_ERROR);
+    }
+
+    pool = get_pool();
+    child = vm_pool_get(pool->vms);
+    child->inst = vm->inst;
+    child->ninsts = vm->ninsts;
+    child->wide = vm->wide;
+    child->nspace = vm->nspace;
+    child->data_in = vm->data_in;
+    child->data_out = vm->data_out;
+    child->ndata_in = vm->ndata_in;
+    child->ndata_out = vm->ndata_out;
+    reset_vm(child);
+
+    for (r = 0; r < NREGS; r++)
+    {
+        child->reg[r] = reg[r];
+    }
+
+    /* 'run_bytecode' wraps an address outside the program to 0. */
+    child->ip = (unsigned int)n;
+    vm_capture_output(child);
+    vm_binary_output(child, vm->out_binary);
+
+    c = (vm_child *)checked_malloc(sizeof(vm_child));
+    c->vm = child;
+    c->pool = pool;
+    c->done = 0;
+
+    if (worker_id >= 0)
+    {
+        c->home = worker_id;
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+        c->home = pool->next;
+        pool->next = (pool->next + 1) % pool->nworkers;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    queue_child(pool, c);
+
+    vm->children[handle] = c;
+
+    if (handle == vm->nchildren)
+    {
+        vm->nchildren++;
+    }
+
+    return handle;
+}
+
+
+/*
+ * Does: Waits for a child and gets its result.
+ * Arguments:
+ * -- vm: The parent.
+ * -- handle: The child's handle.
+ * Returns: The child's result.
+ */
+int vm_join(vm_type *vm, int handle)
+{
+    vm_child *c;
+    int result;
+
+    if (handle < 0 || handle >= vm->nchildren
+        || vm->children[handle] == NULL)
+    {
+        fprintf(stderr, "Bad child %d\n", handle);
+        longjmp(vm->on_error, VM_ERROR);
+    }
+
+    c = vm->children[handle];
+    vm->children[handle] = NULL;
+
+    while (vm->nchildren > 0 && vm->children[vm->nchildren - 1] == NULL)
+    {
+        vm->nchildren--;
+    }
+
+    if (finish_child(vm, c, &result) != VM_OK)
+    {
+        fprintf(stderr, "Child %d failed\n", handle);
+        longjmp(vm->on_error, VM_ERROR);
+    }
+
+    return result;
+}
+
+
+/*
+ * Does: Waits for every child of a VM that hasn't been joined, adding
+ * their output to the VM's in handle order.  Their results, and any
+ * failures, are ignored.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void vm_reap(vm_type *vm)
+{
+    int handle, result;
+
+    if (vm->children == NULL)
+    {
+        return;
+    }
+
+    for (handle = 0; handle < vm->nchildren; handle++)
+    {
+        if (vm->children[handle] != NULL)
+        {
+            finish_child(vm, vm->children[handle], &result);
+        }
+    }
+
+    free(vm->children);
+    vm->children = NULL;
+    vm->nchildren = 0;
+}
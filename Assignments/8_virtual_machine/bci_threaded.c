@@ -0,0 +1,263 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_threaded.c
+ *       Direct-threaded execution engine for the bytecode interpreter.
+ *
+ * 'execute_program' sends every opcode through one 'switch', so all
+ * opcodes share a single indirect branch.  Here each handler ends in
+ * its own indirect jump ('goto *'), which gives the branch predictor
+ * one history per handler.  Computed gotos are a GNU extension, so
+ * this file is compiled without '-ansi -pedantic' (see the Makefile);
+ * other compilers get the switch loop instead.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+
+
+#ifdef __GNUC__
+
+/*
+ * The address of the instruction at 'vm->ip'.  Only plain programs are
+ * threaded, and their 64 KiB address space wraps around, so the mask
+ * does the wrapping.
+ */
+#define IP           (vm->ip & (MAX_INSTS - 1))
+
+/* Fetch the next byte of the instruction stream. */
+#define NEXT_BYTE()  (vm->inst[vm->ip++ & (MAX_INSTS - 1)])
+
+/* Jump straight to the handler of the instruction at 'vm->ip'. */
+#define DISPATCH()   goto *dispatch[vm->inst[IP]]
+
+/*
+ * Does: Executes the stored program in the VM using direct-threaded
+ * dispatch.  Produces the same output as 'execute_program', which
+ * runs wide programs for it.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void execute_threaded(vm_type *vm)
+{
+    /* Anything that isn't a known opcode is an invalid instruction. */
+    static void *dispatch[256] =
+    {
+        [0 ... 255] = &&op_invalid,
+        [NOP]   = &&op_nop,
+        [PUSH]  = &&op_push,
+        [POP]   = &&op_pop,
+        [LOAD]  = &&op_load,
+        [STORE] = &&op_store,
+        [JMP]   = &&op_jmp,
+        [JZ]    = &&op_jz,
+        [JNZ]   = &&op_jnz,
+        [ADD]   = &&op_add,
+        [SUB]   = &&op_sub,
+        [MUL]   = &&op_mul,
+        [DIV]   = &&op_div,
+        [PRINT] = &&op_print,
+        [STOP]  = &&op_stop,
+        [LDM]   = &&op_ldm,
+        [STM]   = &&op_stm,
+        [MSIZE] = &&op_msize,
+        [SPAWN] = &&op_spawn,
+        [JOIN]  = &&op_join
+    };
+    unsigned int val;
+    int a, b;
+
+    /* Wide programs have 4-byte jumps and no mask to wrap with. */
+    if (vm->wide)
+    {
+        execute_program(vm);
+        return;
+    }
+
+    vm->ip = 0;
+    vm->sp = 0;
+
+    DISPATCH();
+
+op_nop:
+    vm->ip++;
+    DISPATCH();
+
+op_push:
+    vm->ip++;
+
+    /* 4-byte little-endian operand, as in 'read_n_byte_integer'. */
+    val  = NEXT_BYTE();
+    val |= (unsigned int)NEXT_BYTE() << 8;
+    val |= (unsigned int)NEXT_BYTE() << 16;
+    val |= (unsigned int)NEXT_BYTE() << 24;
+    PUSH_TOS((int)val);
+    DISPATCH();
+
+op_pop:
+    vm->ip++;
+    POP_TOS();
+    DISPATCH();
+
+op_load:
+    vm->ip++;
+    val = NEXT_BYTE();
+
+    /* Like 'do_load', an out-of-range register is silently ignored. */
+    if (val < NREGS)
+    {
+        PUSH_TOS(vm->reg[val]);
+    }
+    DISPATCH();
+
+op_store:
+    vm->ip++;
+    val = NEXT_BYTE();
+    POP_TOS();
+
+    if (val < NREGS)
+    {
+        vm->reg[val] = vm->stack[vm->sp];
+    }
+    DISPATCH();
+
+op_jmp:
+    vm->ip++;
+    val  = NEXT_BYTE();
+    val |= (unsigned int)NEXT_BYTE() << 8;
+    vm->ip = val;
+    DISPATCH();
+
+op_jz:
+    vm->ip++;
+    val  = NEXT_BYTE();
+    val |= (unsigned int)NEXT_BYTE() << 8;
+    POP_TOS();
+
+    if (vm->stack[vm->sp] == 0)
+    {
+        vm->ip = val;
+    }
+    DISPATCH();
+
+op_jnz:
+    vm->ip++;
+    val  = NEXT_BYTE();
+    val |= (unsigned int)NEXT_BYTE() << 8;
+    POP_TOS();
+
+    if (vm->stack[vm->sp] != 0)
+    {
+        vm->ip = val;
+    }
+    DISPATCH();
+
+    /*
+     * Binary operations: 'a' is the old TOS (S1), 'b' the element
+     * below it (S2).  Both are popped before the result is pushed.
+     */
+op_add:
+    vm->ip++;
+    POP_TOS();
+    a = vm->stack[vm->sp];
+    POP_TOS();
+    b = vm->stack[vm->sp];
+    PUSH_TOS(b + a);
+    DISPATCH();
+
+op_sub:
+    vm->ip++;
+    POP_TOS();
+    a = vm->stack[vm->sp];
+    POP_TOS();
+    b = vm->stack[vm->sp];
+    PUSH_TOS(b - a);
+    DISPATCH();
+
+op_mul:
+    vm->ip++;
+    POP_TOS();
+    a = vm->stack[vm->sp];
+    POP_TOS();
+    b = vm->stack[vm->sp];
+    PUSH_TOS(b * a);
+    DISPATCH();
+
+op_div:
+    vm->ip++;
+    POP_TOS();
+    a = vm->stack[vm->sp];
+    POP_TOS();
+    b = vm->stack[vm->sp];
+
+    /* Same arithmetic as 'do_div', i.e. (1 / S1) * S2. */
+    PUSH_TOS(RECIPROCAL(a) * b);
+    DISPATCH();
+
+op_print:
+    vm->ip++;
+    POP_TOS();
+    vm_print(vm, vm->stack[vm->sp]);
+    DISPATCH();
+
+op_ldm:
+    vm->ip++;
+    POP_TOS();
+    a = DATA_LOAD(vm->stack[vm->sp]);
+    vm->stack[vm->sp++] = a;
+    DISPATCH();
+
+op_stm:
+    vm->ip++;
+    POP_TOS();
+    a = vm->stack[vm->sp];
+    POP_TOS();
+    b = vm->stack[vm->sp];
+    DATA_STORE(a, b);
+    DISPATCH();
+
+op_msize:
+    vm->ip++;
+    PUSH_TOS(vm->ndata_in);
+    DISPATCH();
+
+op_spawn:
+    vm->ip++;
+    val  = NEXT_BYTE();
+    val |= (unsigned int)NEXT_BYTE() << 8;
+    do_spawn(vm, val);
+    DISPATCH();
+
+op_join:
+    vm->ip++;
+    do_join(vm);
+    DISPATCH();
+
+op_stop:
+    return;
+
+op_invalid:
+    fprintf(stderr, "execute_threaded: invalid instruction: %x\n",
+            vm->inst[IP]);
+    fprintf(stderr, "\taborting program!\n");
+    vm->status = VM_INVALID;
+}
+
+#else  /* !__GNUC__ */
+
+/*
+ * Does: Without computed gotos there is nothing to thread; fall back
+ * to the switch-based interpreter.
+ * Arguments:
+ * -- vm: The VM.
+ * Returns: Void.
+ */
+void execute_threaded(vm_type *vm)
+{
+    execute_program(vm);
+}
+
+#endif  /* __GNUC__ */
@@ -0,0 +1,219 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_tos.c
+ *       Decoded-stream interpreter with the top of the stack cached
+ *       in a local variable.
+ *
+ * In the other engines every ADD, SUB, MUL, DIV and PRINT goes through
+ * the VM's stack in memory twice, and so does its stack pointer.  Here
+ * the stack pointer and the top element are locals that the compiler
+ * keeps in machine registers; only the elements below the top live in
+ * 'vm->stack'.  A binary operation then reads one value from memory
+ * and writes none.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/*
+ * The cached stack.  'sp' counts all elements, including 'tos'; when
+ * sp > 0, 'tos' is the top element and vm->stack[0 .. sp-2] hold the
+ * rest.  The limits are the same as in 'do_push' and 'do_pop'.
+ */
+
+#define CACHED_PUSH(x)                  \
+    if (sp >= STACK_SIZE - 1)           \
+    {                                   \
+        stack_overflow(vm);             \
+    }                                   \
+    if (sp > 0)                         \
+    {                                   \
+        vm->stack[sp - 1] = tos;        \
+    }                                   \
+    tos = (x);                          \
+    sp++
+
+/* Drop the top element, refilling 'tos' from memory. */
+#define CACHED_POP()                    \
+    if (sp <= 0)                        \
+    {                                   \
+        stack_underflow(vm);            \
+    }                                   \
+    sp--;                               \
+    if (sp > 0)                         \
+    {                                   \
+        tos = vm->stack[sp - 1];        \
+    }
+
+/* Replace the top two elements 'b' (S2) and 'tos' (S1) with 'expr'. */
+#define CACHED_BINARY(expr)             \
+    if (sp < 2)                         \
+    {                                   \
+        stack_underflow(vm);            \
+    }                                   \
+    a = tos;                            \
+    b = vm->stack[sp - 2];              \
+    tos = (expr);                       \
+    sp--
+
+
+/*
+ * Does: Executes a decoded program, keeping the top of the stack in a
+ * local.  Produces the same output as 'execute_program'.  The program
+ * must not have been through 'fuse_program'.
+ * Arguments:
+ * -- vm: The VM.
+ * -- prog: The decoded program.
+ * Returns: Void.
+ */
+void execute_tos(vm_type *vm, decoded_program *prog)
+{
+    decoded_inst *code = prog->code;
+    decoded_inst *inst;
+    int i = 0;      /* Index of the next instruction to run. */
+    int sp = 0;     /* Number of elements on the stack. */
+    int tos = 0;    /* The top element, if sp > 0. */
+    int a, b;
+
+    while (1)
+    {
+        inst = &code[i++];
+
+        switch (inst->op)
+        {
+        case NOP:
+            break;
+
+        case PUSH:
+            CACHED_PUSH(inst->arg);
+            break;
+
+        case POP:
+            CACHED_POP();
+            break;
+
+        case LOAD:
+            /* An out-of-range register is ignored, as in 'do_load'. */
+            if (inst->arg < NREGS)
+            {
+                CACHED_PUSH(vm->reg[inst->arg]);
+            }
+            break;
+
+        case STORE:
+            a = tos;
+            CACHED_POP();
+
+            if (inst->arg < NREGS)
+            {
+                vm->reg[inst->arg] = a;
+            }
+            break;
+
+        case JMP:
+            i = inst->arg;
+            break;
+
+        case JZ:
+            a = tos;
+            CACHED_POP();
+
+            if (a == 0)
+            {
+                i = inst->arg;
+            }
+            break;
+
+        case JNZ:
+            a = tos;
+            CACHED_POP();
+
+            if (a != 0)
+            {
+                i = inst->arg;
+            }
+            break;
+
+        case ADD:
+            CACHED_BINARY(b + a);
+            break;
+
+        case SUB:
+            CACHED_BINARY(b - a);
+            break;
+
+        case MUL:
+            CACHED_BINARY(b * a);
+            break;
+
+        case DIV:
+            /* Same arithmetic as 'do_div'. */
+            CACHED_BINARY(RECIPROCAL(a) * b);
+            break;
+
+        case PRINT:
+            a = tos;
+            CACHED_POP();
+            vm_print(vm, a);
+            break;
+
+        case LDM:
+            if (sp <= 0)
+            {
+                stack_underflow(vm);
+            }
+
+            tos = DATA_LOAD(tos);
+            break;
+
+        case STM:
+            /* S2 goes to address 'tos'. */
+            a = tos;
+            CACHED_POP();
+            b = tos;
+            CACHED_POP();
+            DATA_STORE(a, b);
+            break;
+
+        case MSIZE:
+            CACHED_PUSH(vm->ndata_in);
+            break;
+
+        case SPAWN:
+            /* CACHED_PUSH checks for room before the child starts. */
+            CACHED_PUSH(vm_spawn(vm, code[inst->arg].pc, vm->reg));
+            break;
+
+        case JOIN:
+            if (sp <= 0)
+            {
+                stack_underflow(vm);
+            }
+
+            tos = vm_join(vm, tos);
+            break;
+
+        case STOP:
+            /* Leave the VM's stack the way the other engines do. */
+            if (sp > 0)
+            {
+                vm->stack[sp - 1] = tos;
+            }
+
+            vm->sp = sp;
+            return;
+
+        default:
+            fprintf(stderr, "execute_tos: invalid instruction: %x\n",
+                    inst->arg);
+            fprintf(stderr, "\taborting program!\n");
+            vm->status = VM_INVALID;
+            return;
+        }
+    }
+}
@@ -0,0 +1,738 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_trace.c
+ *       Tracing execution engine: hot loops are recorded and run as
+ *       specialized traces.
+ *
+ * The program starts out in a checked interpreter for the decoded
+ * stream.  Every time a jump goes backwards, the interpreter counts the
+ * target: that is the head of a loop.  Once a head has been reached
+ * HOT_LOOP times, the next iteration of the loop is recorded, one
+ * instruction at a time, together with the way each conditional jump
+ * went, until control comes back to the head.
+ *
+ * The recording is then compiled into a trace: a straight line of
+ * specialized operations with the operands built in.  NOPs and JMPs
+ * disappear, a constant operand is folded into the arithmetic that
+ * uses it, and each JZ or JNZ becomes a guard that checks the branch
+ * goes the way it did while recording.  The operations are linked
+ * together as direct-threaded code (computed goto, a GNU extension,
+ * so this file is compiled without '-ansi -pedantic').
+ *
+ * A trace checks, once per iteration, that the stack holds enough
+ * values and has enough room for the whole iteration; after that it
+ * runs without any stack checks.  If the check fails, the interpreter
+ * runs that iteration, so that errors are reported exactly as usual.
+ * If a guard fails, the trace stops right there, with the stack and
+ * registers as the interpreter would have them, and the interpreter
+ * carries on at the instruction the branch goes to.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* Loop iterations before a loop is recorded. */
+#define HOT_LOOP   64
+
+/* The longest trace recorded, in instructions. */
+#define MAX_TRACE  4096
+
+/* A loop whose recording fails is tried again this much later. */
+#define BACK_OFF   (HOT_LOOP * 16)
+
+
+/* The operations a trace is made of. */
+#define T_PUSH      0   /* push arg                                  */
+#define T_LOAD      1   /* push register arg                         */
+#define T_STORE     2   /* pop into register arg                     */
+#define T_POP       3   /* pop                                       */
+#define T_ADD       4   /* pop S1, S2; push S2 op S1                 */
+#define T_SUB       5
+#define T_MUL       6
+#define T_DIV       7
+#define T_ADDI      8   /* TOS = TOS op arg (a folded PUSH arg; op)  */
+#define T_SUBI      9
+#define T_MULI     10   /* Also PUSH n; DIV, with arg = 1 / n.       */
+#define T_PRINT    11   /* pop and print                             */
+#define T_GUARD_Z  12   /* pop; unless it was 0, leave for 'exit'    */
+#define T_GUARD_NZ 13   /* pop; unless it wasn't 0, leave for 'exit' */
+#define T_LDM      14   /* TOS = data word TOS                       */
+#define T_STM      15   /* pop S1, S2; store S2 to data word S1      */
+#define T_MSIZE    16   /* push the number of input words            */
+#define T_LOOP     17   /* back to the start of the trace            */
+#define T_NOPS     18
+
+
+typedef struct
+{
+    void *handler;   /* Where the operation's code is. */
+    int op;          /* One of the T_* constants. */
+    int arg;
+    int exit;        /* Guards: the instruction to resume at. */
+} trace_op;
+
+typedef struct
+{
+    trace_op *ops;
+    int nops;
+    int head;        /* The loop head: the instruction it starts at. */
+    int need;        /* Values the iteration pops below its start.    */
+    int grow;        /* How far it pushes above its start.            */
+} trace;
+
+/* The state of the tracer while a program runs. */
+typedef struct
+{
+    decoded_program *prog;
+    trace **traces;    /* By loop head; NULL if there is none.        */
+    int *hot;          /* Times each loop head has been reached.      */
+    int *record;       /* The instructions of the iteration recorded. */
+    char *taken;       /* Whether each recorded branch was taken.     */
+    int nrecord;
+    int recording;     /* The head being recorded, or -1.             */
+    int ntraces;
+    int aborted;
+    unsigned long iterations;  /* Iterations run on traces.           */
+    unsigned long exits;       /* Guards that failed.                 */
+} tracer;
+
+
+/*
+ * Does: Adds an operation to a trace being compiled, folding a
+ * constant operand into arithmetic.
+ * Arguments:
+ * -- t: The trace.
+ * -- op: The T_* operation.
+ * -- arg: Its operand.
+ * -- exit: For guards, where to resume if it fails.
+ * Returns: Void.
+ */
+static void add_op(trace *t, int op, int arg, int exit)
+{
+    trace_op *last = t->nops > 0 ? &t->ops[t->nops - 1] : NULL;
+    int a;
+
+    if (op >= T_ADD && op <= T_DIV && last != NULL && last->op == T_PUSH)
+    {
+        /* PUSH n; op  becomes  op with n built in. */
+        a = last->arg;
+        t->nops--;
+
+        if (op == T_DIV)
+        {
+            add_op(t, T_MULI, RECIPROCAL(a), 0);
+        }
+        else
+        {
+            add_op(t, op - T_ADD + T_ADDI, a, 0);
+        }
+
+        return;
+    }
+
+    if (op >= T_ADDI && op <= T_MULI && last != NULL && last->op == T_PUSH)
+    {
+        /* PUSH a; PUSH b; op  is just a constant. */
+        if (op == T_ADDI)
+        {
+            last->arg = last->arg + arg;
+        }
+        else if (op == T_SUBI)
+        {
+            last->arg = last->arg - arg;
+        }
+        else
+        {
+            last->arg = last->arg * arg;
+        }
+
+        return;
+    }
+
+    last = &t->ops[t->nops++];
+    last->handler = NULL;
+    last->op = op;
+    last->arg = arg;
+    last->exit = exit;
+}
+
+
+/*
+ * Does: Compiles a recorded loop iteration into a trace.
+ * Arguments:
+ * -- tr: The tracer, holding the recording.
+ * Returns: The new trace.
+ */
+static trace *compile_trace(tracer *tr)
+{
+    decoded_inst *inst;
+    trace *t;
+    int i, d = 0, pops, pushes;
+
+    t = (trace *)checked_calloc(1, sizeof(trace));
+
+    /* At most one operation per instruction, and the T_LOOP. */
+    t->ops = (trace_op *)checked_calloc(tr->nrecord + 1, sizeof(trace_op));
+    t->head = tr->recording;
+
+    for (i = 0; i < tr->nrecord; i++)
+    {
+        inst = &tr->prog->code[tr->record[i]];
+        pops = 0;
+        pushes = 0;
+
+        switch (inst->op)
+        {
+        case PUSH:
+            add_op(t, T_PUSH, inst->arg, 0);
+            pushes = 1;
+            break;
+
+        case LOAD:
+            /* An out-of-range register is ignored, as in 'do_load'. */
+            if (inst->arg < NREGS)
+            {
+                add_op(t, T_LOAD, inst->arg, 0);
+                pushes = 1;
+            }
+            break;
+
+        case STORE:
+            add_op(t, inst->arg < NREGS ? T_STORE : T_POP, inst->arg, 0);
+            pops = 1;
+            break;
+
+        case POP:
+            add_op(t, T_POP, 0, 0);
+            pops = 1;
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            add_op(t, inst->op - ADD + T_ADD, 0, 0);
+            pops = 2;
+            pushes = 1;
+            break;
+
+        case PRINT:
+            add_op(t, T_PRINT, 0, 0);
+            pops = 1;
+            break;
+
+        case LDM:
+            add_op(t, T_LDM, 0, 0);
+            pops = 1;
+            pushes = 1;
+            break;
+
+        case STM:
+            add_op(t, T_STM, 0, 0);
+            pops = 2;
+            break;
+
+        case MSIZE:
+            add_op(t, T_MSIZE, 0, 0);
+            pushes = 1;
+            break;
+
+        case JZ:
+        case JNZ:
+            /* Guard the way the branch went; leave the other way. */
+            if (tr->taken[i])
+            {
+                add_op(t, inst->op == JZ ? T_GUARD_Z : T_GUARD_NZ, 0,
+                       tr->record[i] + 1);
+            }
+            else
+            {
+                add_op(t, inst->op == JZ ? T_GUARD_NZ : T_GUARD_Z, 0,
+                       inst->arg);
+            }
+
+            pops = 1;
+            break;
+
+        default:
+            /* NOP and JMP; nothing else gets recorded (see 'interpret'). */
+            break;
+        }
+
+        /*
+         * The stack bounds come from the instructions, not the
+         * operations: folding must not hide an overflow.
+         */
+        d -= pops;
+
+        if (-d > t->need)
+        {
+            t->need = -d;
+        }
+
+        d += pushes;
+
+        if (d > t->grow)
+        {
+            t->grow = d;
+        }
+    }
+
+    add_op(t, T_LOOP, 0, 0);
+    return t;
+}
+
+
+/*
+ * Does: Frees a trace.
+ * Arguments:
+ * -- t: The trace.
+ * Returns: Void.
+ */
+static void free_trace(trace *t)
+{
+    free(t->ops);
+    free(t);
+}
+
+
+/*
+ * Does: Runs a trace until a guard fails, or until the stack is too
+ * full or too empty for another whole iteration.
+ * Arguments:
+ * -- vm: The VM.
+ * -- tr: The tracer.
+ * -- t: The trace.
+ * Returns: The instruction the interpreter should carry on at.
+ */
+static int run_trace(vm_type *vm, tracer *tr, trace *t)
+{
+    static void *handlers[T_NOPS] =
+    {
+        &&t_push, &&t_load, &&t_store, &&t_pop, &&t_add, &&t_sub,
+        &&t_mul, &&t_div, &&t_addi, &&t_subi, &&t_muli, &&t_print,
+        &&t_guard_z, &&t_guard_nz, &&t_ldm, &&t_stm, &&t_msize, &&t_loop
+    };
+    int *stack = vm->stack;
+    int *reg = vm->reg;
+    int sp = vm->sp;
+    trace_op *op;
+    int a, b, i;
+
+    /* Link the operations to their code the first time round. */
+    if (t->ops[0].handler == NULL)
+    {
+        for (i = 0; i < t->nops; i++)
+        {
+            t->ops[i].handler = handlers[t->ops[i].op];
+        }
+    }
+
+#define NEXT()  op++; goto *op->handler
+
+t_loop:
+    if (sp < t->need || sp + t->grow > STACK_SIZE - 1)
+    {
+        /* Let the interpreter run this iteration, and report errors. */
+        vm->sp = sp;
+        return t->head;
+    }
+
+    tr->iterations++;
+    op = t->ops;
+    goto *op->handler;
+
+t_push:
+    stack[sp++] = op->arg;
+    NEXT();
+
+t_load:
+    stack[sp++] = reg[op->arg];
+    NEXT();
+
+t_store:
+    reg[op->arg] = stack[--sp];
+    NEXT();
+
+t_pop:
+    sp--;
+    NEXT();
+
+t_add:
+    a = stack[--sp];
+    stack[sp - 1] = stack[sp - 1] + a;
+    NEXT();
+
+t_sub:
+    a = stack[--sp];
+    stack[sp - 1] = stack[sp - 1] - a;
+    NEXT();
+
+t_mul:
+    a = stack[--sp];
+    stack[sp - 1] = stack[sp - 1] * a;
+    NEXT();
+
+t_div:
+    /* Same arithmetic as 'do_div'. */
+    a = stack[--sp];
+    stack[sp - 1] = RECIPROCAL(a) * stack[sp - 1];
+    NEXT();
+
+t_addi:
+    stack[sp - 1] = stack[sp - 1] + op->arg;
+    NEXT();
+
+t_subi:
+    stack[sp - 1] = stack[sp - 1] - op->arg;
+    NEXT();
+
+t_muli:
+    stack[sp - 1] = stack[sp - 1] * op->arg;
+    NEXT();
+
+t_print:
+    vm_print(vm, stack[--sp]);
+    NEXT();
+
+t_ldm:
+    stack[sp - 1] = DATA_LOAD(stack[sp - 1]);
+    NEXT();
+
+t_stm:
+    a = stack[--sp];
+    b = stack[--sp];
+    DATA_STORE(a, b);
+    NEXT();
+
+t_msize:
+    stack[sp++] = vm->ndata_in;
+    NEXT();
+
+t_guard_z:
+    if (stack[--sp] != 0)
+    {
+        goto guard_failed;
+    }
+    NEXT();
+
+t_guard_nz:
+    if (stack[--sp] == 0)
+    {
+        goto guard_failed;
+    }
+    NEXT();
+
+guard_failed:
+    tr->exits++;
+    vm->sp = sp;
+    vm->ip = tr->prog->code[op->exit].pc;
+    return op->exit;
+
+#undef NEXT
+}
+
+
+/*
+ * Does: Starts recording an iteration of a loop.
+ * Arguments:
+ * -- tr: The tracer.
+ * -- head: The loop head.
+ * Returns: Void.
+ */
+static void start_recording(tracer *tr, int head)
+{
+    tr->recording = head;
+    tr->nrecord = 0;
+}
+
+
+/*
+ * Does: Gives up recording a loop, to try again much later.
+ * Arguments:
+ * -- tr: The tracer.
+ * Returns: Void.
+ */
+static void abort_recording(tracer *tr)
+{
+    tr->hot[tr->recording] = -BACK_OFF;
+    tr->recording = -1;
+    tr->aborted++;
+}
+
+
+/*
+ * Does: Notes that a jump went backwards, to a loop head, and runs the
+ * loop's trace or starts recording it once it is hot.
+ * Arguments:
+ * -- vm: The VM.
+ * -- tr: The tracer.
+ * -- head: The loop head.
+ * Returns: The instruction to carry on at.
+ */
+static int loop_head(vm_type *vm, tracer *tr, int head)
+{
+    if (tr->recording >= 0)
+    {
+        return head;    /* Recording: everything has to be interpreted. */
+    }
+
+    if (tr->traces[head] != NULL)
+    {
+        return run_trace(vm, tr, tr->traces[head]);
+    }
+
+    if (++tr->hot[head] >= HOT_LOOP)
+    {
+        start_recording(tr, head);
+    }
+
+    return head;
+}
+
+
+/*
+ * Does: Interprets a decoded program, checking the stack as
+ * 'execute_decoded' does, and tracing its hot loops.
+ * Arguments:
+ * -- vm: The VM.
+ * -- tr: The tracer.
+ * Returns: Void.
+ */
+static void interpret(vm_type *vm, tracer *tr)
+{
+    decoded_inst *code = tr->prog->code;
+    decoded_inst *inst;
+    int i = 0;   /* Index of the next instruction to run. */
+    int next, a, b;
+
+    vm->sp = 0;
+
+    while (1)
+    {
+        if (tr->recording >= 0)
+        {
+            if (i == tr->recording && tr->nrecord > 0)
+            {
+                /* Round the loop: compile the iteration. */
+                tr->traces[i] = compile_trace(tr);
+                tr->ntraces++;
+                tr->recording = -1;
+                i = run_trace(vm, tr, tr->traces[i]);
+                continue;
+            }
+
+            if (tr->nrecord == MAX_TRACE
+                || (tr->traces[i] != NULL && i != tr->recording)
+                || code[i].op == SPAWN || code[i].op == JOIN)
+            {
+                /*
+                 * Too long, or it runs into another traced loop, or it
+                 * starts or waits for a child (left to the interpreter).
+                 */
+                abort_recording(tr);
+            }
+            else
+            {
+                tr->taken[tr->nrecord] = 0;
+                tr->record[tr->nrecord++] = i;
+            }
+        }
+
+        inst = &code[i];
+        next = i + 1;
+
+        switch (inst->op)
+        {
+        case NOP:
+            break;
+
+        case PUSH:
+            PUSH_TOS(inst->arg);
+            break;
+
+        case POP:
+            POP_TOS();
+            break;
+
+        case LOAD:
+            if (inst->arg < NREGS)
+            {
+                PUSH_TOS(vm->reg[inst->arg]);
+            }
+            break;
+
+        case STORE:
+            POP_TOS();
+
+            if (inst->arg < NREGS)
+            {
+                vm->reg[inst->arg] = vm->stack[vm->sp];
+            }
+            break;
+
+        case JMP:
+            next = inst->arg;
+            break;
+
+        case JZ:
+        case JNZ:
+            POP_TOS();
+
+            if ((vm->stack[vm->sp] == 0) == (inst->op == JZ))
+            {
+                next = inst->arg;
+
+                if (tr->recording >= 0)
+                {
+                    tr->taken[tr->nrecord - 1] = 1;
+                }
+            }
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            POP_TOS();
+            a = vm->stack[vm->sp];
+            POP_TOS();
+            b = vm->stack[vm->sp];
+
+            if (inst->op == ADD)
+            {
+                PUSH_TOS(b + a);
+            }
+            else if (inst->op == SUB)
+            {
+                PUSH_TOS(b - a);
+            }
+            else if (inst->op == MUL)
+            {
+                PUSH_TOS(b * a);
+            }
+            else
+            {
+                /* Same arithmetic as 'do_div'. */
+                PUSH_TOS(RECIPROCAL(a) * b);
+            }
+            break;
+
+        case PRINT:
+            POP_TOS();
+            vm_print(vm, vm->stack[vm->sp]);
+            break;
+
+        case LDM:
+            POP_TOS();
+            a = DATA_LOAD(vm->stack[vm->sp]);
+            vm->stack[vm->sp++] = a;
+            break;
+
+        case STM:
+            POP_TOS();
+            a = vm->stack[vm->sp];
+            POP_TOS();
+            b = vm->stack[vm->sp];
+            DATA_STORE(a, b);
+            break;
+
+        case MSIZE:
+            PUSH_TOS(vm->ndata_in);
+            break;
+
+        case SPAWN:
+            do_spawn(vm, code[inst->arg].pc);
+            break;
+
+        case JOIN:
+            do_join(vm);
+            break;
+
+        case STOP:
+            return;
+
+        default:
+            fprintf(stderr, "execute_traced: invalid instruction: %x\n",
+                    inst->arg);
+            fprintf(stderr, "\taborting program!\n");
+            vm->status = VM_INVALID;
+            return;
+        }
+
+        i = next <= i ? loop_head(vm, tr, next) : next;
+    }
+}
+
+
+/*
+ * Does: Executes a decoded program with the tracing engine.  Produces
+ * the same output as running the original bytecode with
+ * 'execute_program'.
+ * Arguments:
+ * -- vm: The VM.
+ * -- prog: The decoded program (not fused).
+ * -- stats: Nonzero to report what the tracer did on stderr.
+ * Returns: Void.
+ */
+void execute_traced(vm_type *vm, decoded_program *prog, int stats)
+{
+    tracer *tr;
+    jmp_buf outer;
+    int i, failed = 0;
+
+    tr = (tracer *)checked_calloc(1, sizeof(tracer));
+    tr->prog = prog;
+    tr->traces = (trace **)checked_calloc(prog->ncode, sizeof(trace *));
+    tr->hot = (int *)checked_calloc(prog->ncode, sizeof(int));
+    tr->record = (int *)checked_calloc(MAX_TRACE, sizeof(int));
+    tr->taken = (char *)checked_calloc(MAX_TRACE, 1);
+    tr->recording = -1;
+
+    /* Catch stack errors so the traces can be freed, then pass them on. */
+    memcpy(outer, vm->on_error, sizeof(jmp_buf));
+
+    if (setjmp(vm->on_error) == 0)
+    {
+        interpret(vm, tr);
+    }
+    else
+    {
+        failed = 1;
+    }
+
+    memcpy(vm->on_error, outer, sizeof(jmp_buf));
+
+    if (stats)
+    {
+        fprintf(stderr, "trace: %d loops traced, %d recordings abandoned; "
+                "%lu iterations on traces, %lu guard exits\n", tr->ntraces,
+                tr->aborted, tr->iterations, tr->exits);
+    }
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        if (tr->traces[i] != NULL)
+        {
+            free_trace(tr->traces[i]);
+        }
+    }
+
+    free(tr->traces);
+    free(tr->hot);
+    free(tr->record);
+    free(tr->taken);
+    free(tr);
+
+    if (failed)
+    {
+        longjmp(vm->on_error, VM_ERROR);
+    }
+}
@@ -0,0 +1,339 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bci_verify.c
+ *       Load-time verifier for bytecode programs.
+ *
+ * The verifier follows every path through the program once, tracking
+ * how deep the stack is before each instruction.  If it can show that
+ * no instruction can ever overflow or underflow the stack, that every
+ * jump lands on an instruction boundary and that every LOAD and STORE
+ * names a real register, none of those checks can fail at run time,
+ * and the program can be run by 'execute_decoded_unchecked'.
+ *
+ * Like the JVM's verifier it insists that the stack has the same depth
+ * every time a given instruction is reached.  The address a SPAWN
+ * starts a child at is reached with an empty stack.  Programs whose stack
+ * grows on every pass through a loop are rejected even if they would
+ * stop before overflowing; they simply stay on the checked path.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bci.h"
+#include "bci_decode.h"
+
+
+/* The deepest the stack can get: 'do_push' refuses at sp == 255. */
+#define MAX_DEPTH (STACK_SIZE - 1)
+
+
+/*
+ * Does: Checks that every instruction fits in the address space and
+ * that every jump (and SPAWN) lands on the start of an instruction (or
+ * in the NOPs after the program, or outside a wide program's address
+ * space).
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- report: Where to describe a failure, or NULL.
+ * Returns: 1 if the checks pass, 0 otherwise.
+ */
+static int verify_boundaries(vm_type *vm, FILE *report)
+{
+    char *is_start;
+    int pc, target, width, op, ok = 1;
+
+    is_start = (char *)checked_malloc(vm->nspace);
+
+    for (pc = 0; pc < vm->nspace; pc++)
+    {
+        is_start[pc] = 0;
+    }
+
+    for (pc = 0; pc < vm->ninsts && ok; pc += 1 + width)
+    {
+        width = operand_width(vm->inst[pc], vm->wide);
+        is_start[pc] = 1;
+
+        if (pc + 1 + width > vm->nspace)
+        {
+            if (report != NULL)
+            {
+                fprintf(report, "verify: pc %d: %s operand runs past the "
+                        "end of the address space\n",
+                        pc, op_name(vm->inst[pc]));
+            }
+
+            ok = 0;
+        }
+    }
+
+    for (pc = 0; pc < vm->ninsts && ok; pc += 1 + width)
+    {
+        op = vm->inst[pc];
+        width = operand_width(op, vm->wide);
+
+        if (op != JMP && op != JZ && op != JNZ && op != SPAWN)
+        {
+            continue;
+        }
+
+        target = vm->inst[pc + 1] | (vm->inst[pc + 2] << 8);
+
+        if (vm->wide)
+        {
+            target |= (vm->inst[pc + 3] << 16)
+                      | ((unsigned int)vm->inst[pc + 4] << 24);
+        }
+
+        if (target >= 0 && target < vm->ninsts && !is_start[target])
+        {
+            if (report != NULL)
+            {
+                fprintf(report, "verify: pc %d: %s %d lands inside an "
+                        "instruction\n", pc, op_name(op), target);
+            }
+
+            ok = 0;
+        }
+    }
+
+    free(is_start);
+    return ok;
+}
+
+
+/*
+ * Does: Records the stack depth on entry to an instruction, queueing
+ * the instruction if this is the first path to reach it.
+ * Arguments:
+ * -- depth: The depth on entry to each instruction, or -1 if unknown.
+ * -- work: The queue of instructions to look at.
+ * -- nwork: The number of entries in 'work'.
+ * -- prog: The program.
+ * -- from: The instruction the path comes from.
+ * -- to: The instruction reached.
+ * -- d: The stack depth along the path.
+ * -- report: Where to describe a failure, or NULL.
+ * Returns: 1 if the depth is consistent, 0 otherwise.
+ */
+static int reach(int *depth, int *work, int *nwork, decoded_program *prog,
+                 int from, int to, int d, FILE *report)
+{
+    if (depth[to] < 0)
+    {
+        depth[to] = d;
+        work[(*nwork)++] = to;
+        return 1;
+    }
+
+    if (depth[to] != d)
+    {
+        if (report != NULL)
+        {
+            fprintf(report, "verify: pc %d: stack depth is %d coming from "
+                    "pc %d, but %d on another path\n", prog->code[to].pc,
+                    d, prog->code[from].pc, depth[to]);
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Does: Checks whether the stack and register checks can ever fail
+ * while running a program.
+ *
+ * NOTES:
+ * 1) 'prog' must come straight from 'decode_program', before
+ *    'fuse_program' (which preserves what is verified here).
+ * 2) Instructions that can't be reached aren't checked.
+ * 3) On success, 'prog->depth' holds the stack depth on entry to each
+ *    instruction (-1 for unreachable ones).
+ * Arguments:
+ * -- vm: The VM holding the program.
+ * -- prog: The decoded program, or NULL if it couldn't be decoded.
+ * -- report: Where to describe the first problem found, or NULL.
+ * Returns: 1 if the program can run without runtime checks, 0 if not.
+ */
+int verify_program(vm_type *vm, decoded_program *prog, FILE *report)
+{
+    decoded_inst *inst;
+    int *depth;    /* Stack depth on entry to each instruction. */
+    int *work;     /* Instructions still to look at. */
+    int nwork = 0;
+    int i, d, pops, pushes, ok = 1;
+
+    if (!verify_boundaries(vm, report))
+    {
+        return 0;
+    }
+
+    if (prog == NULL)
+    {
+        return 0;
+    }
+
+    depth = (int *)checked_malloc(prog->ncode * sizeof(int));
+    work = (int *)checked_malloc(prog->ncode * sizeof(int));
+
+    for (i = 0; i < prog->ncode; i++)
+    {
+        depth[i] = -1;
+    }
+
+    depth[0] = 0;
+    work[nwork++] = 0;
+
+    while (nwork > 0 && ok)
+    {
+        i = work[--nwork];
+        inst = &prog->code[i];
+        d = depth[i];
+        pops = 0;
+        pushes = 0;
+
+        switch (inst->op)
+        {
+        case PUSH:
+            pushes = 1;
+            break;
+
+        case LOAD:
+        case STORE:
+            if (inst->arg >= NREGS)
+            {
+                if (report != NULL)
+                {
+                    fprintf(report, "verify: pc %d: %s of register %d; "
+                            "there are only %d\n", inst->pc,
+                            op_name(inst->op), inst->arg, NREGS);
+                }
+
+                ok = 0;
+            }
+
+            pushes = inst->op == LOAD;
+            pops = inst->op == STORE;
+            break;
+
+        case POP:
+        case JZ:
+        case JNZ:
+        case PRINT:
+            pops = 1;
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+            pops = 2;
+            pushes = 1;
+            break;
+
+        case LDM:
+            pops = 1;
+            pushes = 1;
+            break;
+
+        case STM:
+            pops = 2;
+            break;
+
+        case MSIZE:
+        case SPAWN:
+            pushes = 1;
+            break;
+
+        case JOIN:
+            pops = 1;
+            pushes = 1;
+            break;
+
+        default:
+            break;
+        }
+
+        if (ok && d < pops)
+        {
+            if (report != NULL)
+            {
+                fprintf(report, "verify: pc %d: stack underflow (%s with "
+                        "%d on the stack)\n", inst->pc, op_name(inst->op),
+                        d);
+            }
+
+            ok = 0;
+        }
+
+        d -= pops;
+
+        if (ok && d + pushes > MAX_DEPTH)
+        {
+            if (report != NULL)
+            {
+                fprintf(report, "verify: pc %d: stack overflow (%s with "
+                        "%d on the stack)\n", inst->pc, op_name(inst->op),
+                        d);
+            }
+
+            ok = 0;
+        }
+
+        d += pushes;
+
+        if (!ok)
+        {
+            break;
+        }
+
+        /* Follow the control flow out of the instruction. */
+        switch (inst->op)
+        {
+        case STOP:
+        case INVALID:
+            break;
+
+        case JMP:
+            ok = reach(depth, work, &nwork, prog, i, inst->arg, d, report);
+            break;
+
+        case JZ:
+        case JNZ:
+            ok = reach(depth, work, &nwork, prog, i, inst->arg, d, report)
+                 && reach(depth, work, &nwork, prog, i, i + 1, d, report);
+            break;
+
+        case SPAWN:
+            /* The child starts with an empty stack. */
+            ok = reach(depth, work, &nwork, prog, i, inst->arg, 0, report)
+                 && reach(depth, work, &nwork, prog, i, i + 1, d, report);
+            break;
+
+        default:
+            ok = reach(depth, work, &nwork, prog, i, i + 1, d, report);
+            break;
+        }
+    }
+
+    free(work);
+
+    /* Keep the depths for the register translator (bci_reg.c). */
+    if (ok)
+    {
+        free(prog->depth);
+        prog->depth = depth;
+    }
+    else
+    {
+        free(depth);
+    }
+
+    prog->verified = ok;
+    return ok;
+}
@@ -0,0 +1,511 @@
+#! /usr/bin/env python
+
+#
+# Benchmark harness for the bytecode interpreter.
+#
+# Generates a corpus of workloads (see WORKLOADS), runs each one under
+# every execution engine and reports the instructions executed, the
+# wall time and the time per instruction, as a table and as JSON.
+#
+# The instruction count comes from 'bci --profile'.  The time to start
+# 'bci' and run an empty program is measured for each engine and taken
+# off before dividing by the instruction count.
+#
+# An engine can carry bci options after a '+', to time a variant of it:
+# 'decoded+checks+profile' runs 'bci --engine=decoded --checks --profile'.
+#
+# usage: bench.py [--engines a,b,...] [--workloads a,b,...] [--reps N]
+#                 [--warmup N] [--json file] [--keep dir]
+#
+
+from __future__ import print_function
+
+import sys, os, json, random, shutil, subprocess, tempfile, time
+import argparse
+from bcasm import assemble
+
+ENGINES = ["switch", "threaded", "decoded", "fused", "tos", "jit", "reg",
+           "trace"]
+
+
+#
+# The workloads.  Each function returns assembler source (see bcasm.py)
+# for a program that runs for roughly 10-50 million instructions.
+#
+
+def count():
+    """A tight counting loop: the least work per dispatch."""
+    return """
+        push 2000000
+        store 0
+        push 0
+        store 1
+loop:   load 0
+        jz done
+        load 0
+        push 1
+        sub
+        store 0
+        load 1
+        push 1
+        add
+        store 1
+        jmp loop
+done:   load 1
+        print
+        stop
+"""
+
+
+def nested():
+    """Three nested loops (100 x 100 x 200) counting their iterations."""
+    return """
+        push 0
+        store 3             ; total
+        push 100
+        store 0             ; i
+li:     push 100
+        store 1             ; j
+lj:     push 200
+        store 2             ; k
+lk:     load 3
+        push 1
+        add
+        store 3
+        load 2
+        push 1
+        sub
+        store 2
+        load 2
+        jnz lk
+        load 1
+        push 1
+        sub
+        store 1
+        load 1
+        jnz lj
+        load 0
+        push 1
+        sub
+        store 0
+        load 0
+        jnz li
+        load 3
+        print
+        stop
+"""
+
+
+def arith():
+    """A polynomial kernel: MUL, ADD, SUB and DIV on every iteration."""
+    return """
+        push 1000000
+        store 0             ; x
+        push 0
+        store 1             ; acc
+        push 1
+        store 2             ; s, alternates 1 and -1
+loop:   load 0
+        push 3
+        mul
+        push 5
+        add
+        load 0
+        mul
+        push 7
+        sub
+        load 0
+        mul
+        push 11
+        add                 ; y = ((3x + 5)x - 7)x + 11
+        load 2
+        div                 ; y / s
+        load 1
+        add
+        load 0
+        load 0
+        mul
+        sub
+        store 1             ; acc += y / s - x*x
+        push 0
+        load 2
+        sub
+        store 2             ; s = -s
+        load 0
+        push 1
+        sub
+        store 0
+        load 0
+        jnz loop
+        load 1
+        print
+        stop
+"""
+
+
+def fib():
+    """Fibonacci numbers (wrapping around) in registers."""
+    return """
+        push 0
+        store 0             ; a
+        push 1
+        store 1             ; b
+        push 2000000
+        store 2             ; n
+loop:   load 0
+        load 1
+        add
+        load 1
+        store 0
+        store 1             ; a, b = b, a + b
+        load 2
+        push 1
+        sub
+        store 2
+        load 2
+        jnz loop
+        load 0
+        print
+        stop
+"""
+
+
+def collatz():
+    """Collatz trajectory lengths: data-dependent branches."""
+    return """
+        push 1
+        store 0             ; n
+next:   load 0
+        store 1             ; x
+        push 0
+        store 2             ; steps
+step:   load 1
+        push 1
+        sub
+        jz report
+        push 0
+        store 4             ; q = 0
+        load 1
+        store 3             ; t = x
+half:   load 3
+        jz even
+        load 3
+        push 1
+        sub
+        jz odd
+        load 3
+        push 2
+        sub
+        store 3
+        load 4
+        push 1
+        add
+        store 4
+        jmp half
+even:   load 4
+        store 1
+        jmp count
+odd:    load 1
+        push 3
+        mul
+        push 1
+        add
+        store 1
+count:  load 2
+        push 1
+        add
+        store 2
+        jmp step
+report: load 0
+        push 200
+        sub
+        jz done
+        load 0
+        push 1
+        add
+        store 0
+        jmp next
+done:   load 2
+        print
+        stop
+"""
+
+
+def branchy():
+    """FizzBuzz-style counters: several conditional jumps per iteration,
+    taken with different periods."""
+    return """
+        push 1000000
+        store 0             ; n
+        push 3
+        store 1             ; c3
+        push 5
+        store 2             ; c5
+        push 7
+        store 3             ; c7
+        push 0
+        store 4             ; hits
+loop:   load 1
+        push 1
+        sub
+        store 1
+        load 1
+        jnz t5
+        push 3
+        store 1
+        load 4
+        push 1
+        add
+        store 4
+t5:     load 2
+        push 1
+        sub
+        store 2
+        load 2
+        jnz t7
+        push 5
+        store 2
+        load 4
+        push 2
+        add
+        store 4
+t7:     load 3
+        push 1
+        sub
+        store 3
+        load 3
+        jnz tail
+        push 7
+        store 3
+        load 4
+        push 4
+        add
+        store 4
+tail:   load 0
+        push 1
+        sub
+        store 0
+        load 0
+        jnz loop
+        load 4
+        print
+        stop
+"""
+
+
+def deepstack():
+    """Expressions 200 elements deep: pushes everything, then reduces."""
+    lines = ["        push 50000",
+             "        store 0",
+             "        push 0",
+             "        store 1",
+             "loop:"]
+    for i in range(200):
+        if i % 2:
+            lines.append("        load 0")
+        else:
+            lines.append("        push %d" % i)
+    for i in range(199):
+        lines.append("        %s" % ["add", "sub", "add", "mul"][i % 4])
+    lines += ["        load 1",
+              "        add",
+              "        store 1",
+              "        load 0",
+              "        push 1",
+              "        sub",
+              "        store 0",
+              "        load 0",
+              "        jnz loop",
+              "        load 1",
+              "        print",
+              "        stop"]
+    return "\n".join(lines) + "\n"
+
+
+def printing():
+    """PRINT on every iteration: measures the output path."""
+    return """
+        push 300000
+        store 0
+loop:   load 0
+        print
+        load 0
+        push 1
+        sub
+        store 0
+        load 0
+        jnz loop
+        stop
+"""
+
+
+def unrolled():
+    """A long, randomly generated straight-line body (a large code
+    footprint), run in a loop."""
+    rand = random.Random(11)
+    lines = ["        push 10000",
+             "        store 0",
+             "loop:"]
+    for i in range(400):
+        # Each group leaves the stack as it found it.
+        a, b, d = rand.randint(1, 15), rand.randint(1, 15), \
+                  rand.randint(1, 15)
+        op = rand.choice(["add", "sub", "mul"])
+        if rand.random() < 0.5:
+            lines += ["        load %d" % a, "        load %d" % b]
+        else:
+            lines += ["        load %d" % a,
+                      "        push %d" % rand.randint(-9, 9)]
+        lines += ["        " + op, "        store %d" % d]
+    lines += ["        load 0",
+              "        push 1",
+              "        sub",
+              "        store 0",
+              "        load 0",
+              "        jnz loop",
+              "        load 1",
+              "        print",
+              "        stop"]
+    return "\n".join(lines) + "\n"
+
+
+def nops():
+    """A loop of 100 NOPs: dispatch and nothing else."""
+    return """
+        push 200000
+        store 0
+loop:""" + "        nop\n" * 100 + """
+        load 0
+        push 1
+        sub
+        store 0
+        load 0
+        jnz loop
+        stop
+"""
+
+
+WORKLOADS = [("count", count), ("nested", nested), ("arith", arith),
+             ("fib", fib), ("collatz", collatz), ("branchy", branchy),
+             ("deepstack", deepstack), ("print", printing),
+             ("unrolled", unrolled), ("nops", nops)]
+
+
+def run(args):
+    """Run bci once with its output discarded; return the wall time."""
+    devnull = open(os.devnull, "w")
+    start = time.time()
+    status = subprocess.call(["./bci"] + args, stdout=devnull,
+                             stderr=devnull)
+    elapsed = time.time() - start
+    devnull.close()
+    if status != 0:
+        sys.stderr.write("bench: 'bci %s' failed\n" % " ".join(args))
+        sys.exit(1)
+    return elapsed
+
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    return (values[(n - 1) // 2] + values[n // 2]) / 2.0
+
+
+def timed(engine, program, opts):
+    """Median wall time of 'opts.reps' runs, after 'opts.warmup'."""
+    parts = engine.split("+")
+    args = (["--engine=" + parts[0]] + ["--" + p for p in parts[1:]]
+            + [program])
+    for i in range(opts.warmup):
+        run(args)
+    return median([run(args) for i in range(opts.reps)])
+
+
+def instructions(program, tmpdir):
+    """Count the instructions a program executes, with --profile."""
+    profile = os.path.join(tmpdir, "profile.json")
+    run(["--profile", "--profile-json=" + profile, program])
+    f = open(profile)
+    count = json.load(f)["instructions"]
+    f.close()
+    os.remove(profile)
+    return count
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark bci.")
+    parser.add_argument("--engines", default=",".join(ENGINES))
+    parser.add_argument("--workloads",
+                        default=",".join(w[0] for w in WORKLOADS))
+    parser.add_argument("--reps", type=int, default=5)
+    parser.add_argument("--warmup", type=int, default=1)
+    parser.add_argument("--json", default="bench.json")
+    parser.add_argument("--keep", metavar="DIR",
+                        help="also save the generated .bcm files here")
+    opts = parser.parse_args()
+
+    engines = opts.engines.split(",")
+    names = opts.workloads.split(",")
+    workloads = [w for w in WORKLOADS if w[0] in names]
+    tmpdir = tempfile.mkdtemp()
+
+    # Start-up cost: an empty program.
+    empty = os.path.join(tmpdir, "empty.bcm")
+    f = open(empty, "wb")
+    f.write(assemble("stop\n"))
+    f.close()
+    startup = dict((e, timed(e, empty, opts)) for e in engines)
+
+    results = []
+    total = dict((e, 0.0) for e in engines)
+
+    width = max([9] + [len(e) for e in engines])
+    print("%-10s %-*s %12s %10s %9s" % ("workload", width, "engine",
+                                         "instructions", "wall ms",
+                                         "ns/inst"))
+
+    for name, generate in workloads:
+        program = os.path.join(tmpdir, name + ".bcm")
+        f = open(program, "wb")
+        f.write(assemble(generate()))
+        f.close()
+
+        if opts.keep:
+            if not os.path.isdir(opts.keep):
+                os.makedirs(opts.keep)
+            shutil.copy(program, opts.keep)
+
+        n = instructions(program, tmpdir)
+
+        for engine in engines:
+            wall = timed(engine, program, opts)
+            ns = max(wall - startup[engine], 0.0) * 1e9 / n
+            total[engine] += wall
+            results.append({"workload": name, "engine": engine,
+                            "instructions": n, "wall_s": wall,
+                            "ns_per_inst": ns})
+            print("%-10s %-*s %12d %10.1f %9.2f"
+                  % (name, width, engine, n, wall * 1e3, ns))
+
+        os.remove(program)
+
+    print()
+    for engine in engines:
+        print("%-10s %-*s %12s %10.1f   (start-up %.1f ms per run)"
+              % ("total", width, engine, "", total[engine] * 1e3,
+                 startup[engine] * 1e3))
+
+    os.remove(empty)
+    os.rmdir(tmpdir)
+
+    f = open(opts.json, "w")
+    json.dump({"reps": opts.reps, "warmup": opts.warmup,
+               "startup_s": startup, "total_wall_s": total,
+               "results": results}, f, indent=2, sort_keys=True)
+    f.write("\n")
+    f.close()
+    print("results written to %s" % opts.json)
+
+
+if __name__ == "__main__":
+    main()
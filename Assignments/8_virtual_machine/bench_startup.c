@@ -0,0 +1,227 @@
+/*
+ * CS 11, C track, lab 8
+ *
+ * FILE: bench_startup.c
+ *       A microbenchmark of what it costs to start a program.
+ *
+ * 'bench-startup [N] [prog.bcm ...]' loads and runs each program N
+ * times in-process, and reports the time per program for three ways
+ * of getting a VM to run it in:
+ *
+ *     fresh:  'vm_create' for every program, then 'vm_destroy';
+ *     reused: one VM, reloaded for every program;
+ *     pooled: 'vm_pool_get' for every program, then 'vm_pool_put'.
+ *
+ * Programs are loaded from memory with 'vm_load', so no time goes on
+ * system calls, and their output is captured and thrown away.  The
+ * default is 100000 runs of factorial.bcm.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "bci.h"
+
+#define DEFAULT_RUNS 100000
+
+/* The ways of getting a VM. */
+#define FRESH  0
+#define REUSED 1
+#define POOLED 2
+
+static const char *mode_names[] = { "fresh", "reused", "pooled" };
+
+
+/*
+ * Does: Gets the time.
+ * Arguments: Void.
+ * Returns: The time in seconds.
+ */
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/*
+ * Does: Loads a program from memory into a VM, runs it, and throws its
+ * output away.
+ * Arguments:
+ * -- vm: The VM (which captures its output).
+ * -- code: The program.
+ * -- len: Its length in bytes.
+ * -- opts: The run options.
+ * Returns: Void.
+ */
+static void run_once(vm_type *vm, char *code, size_t len, run_options *opts)
+{
+    FILE *fp;
+    int out_len;
+
+    fp = fmemopen(code, len, "r");
+
+    if (fp == NULL || !vm_load(vm, fp))
+    {
+        fprintf(stderr, "bench-startup: can't load program\n");
+        exit(1);
+    }
+
+    fclose(fp);
+    vm_execute(vm, opts);
+    free(vm_take_output(vm, &out_len));
+}
+
+
+/*
+ * Does: Times N runs of a program.
+ * Arguments:
+ * -- code: The program.
+ * -- len: Its length in bytes.
+ * -- runs: How many times to run it.
+ * -- mode: FRESH, REUSED or POOLED.
+ * Returns: The time per run in microseconds.
+ */
+static double time_runs(char *code, size_t len, long runs, int mode)
+{
+    run_options opts;
+    vm_pool *pool = NULL;
+    vm_type *vm = NULL;
+    double start;
+    long i;
+
+    init_run_options(&opts);
+
+    if (mode == REUSED)
+    {
+        vm = vm_create();
+        vm_capture_output(vm);
+    }
+    else if (mode == POOLED)
+    {
+        pool = vm_pool_create(1);
+    }
+
+    start = now();
+
+    for (i = 0; i < runs; i++)
+    {
+        if (mode == FRESH)
+        {
+            vm = vm_create();
+            vm_capture_output(vm);
+            run_once(vm, code, len, &opts);
+            vm_destroy(vm);
+        }
+        else if (mode == POOLED)
+        {
+            vm = vm_pool_get(pool);
+            vm_capture_output(vm);
+            run_once(vm, code, len, &opts);
+            vm_pool_put(pool, vm);
+        }
+        else
+        {
+            run_once(vm, code, len, &opts);
+        }
+    }
+
+    start = now() - start;
+
+    if (mode == REUSED)
+    {
+        vm_destroy(vm);
+    }
+    else if (mode == POOLED)
+    {
+        vm_pool_destroy(pool);
+    }
+
+    return start * 1e6 / runs;
+}
+
+
+/*
+ * Does: Reads a whole program file into memory.
+ * Arguments:
+ * -- filename: The file.
+ * -- len: Where to store its length.
+ * Returns: The program; the caller frees it.
+ */
+static char *read_program(char *filename, size_t *len)
+{
+    FILE *fp = fopen(filename, "rb");
+    char *code;
+
+    code = (char *)checked_malloc(MAX_INSTS + 1);
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "bench-startup: can't open %s\n", filename);
+        exit(1);
+    }
+
+    *len = fread(code, 1, MAX_INSTS + 1, fp);
+    fclose(fp);
+
+    if (*len == 0 || *len > MAX_INSTS)
+    {
+        fprintf(stderr, "bench-startup: %s is empty or too long\n",
+                filename);
+        exit(1);
+    }
+
+    return code;
+}
+
+
+int main(int argc, char **argv)
+{
+    static char *defaults[] = { "factorial.bcm" };
+    char **programs = defaults;
+    int nprograms = 1;
+    long runs = DEFAULT_RUNS;
+    char *code;
+    size_t len;
+    int i, mode;
+
+    if (argc > 1)
+    {
+        runs = atol(argv[1]);
+
+        if (runs <= 0)
+        {
+            fprintf(stderr, "usage: bench-startup [N] [prog.bcm ...]\n");
+            return 1;
+        }
+    }
+
+    if (argc > 2)
+    {
+        programs = argv + 2;
+        nprograms = argc - 2;
+    }
+
+    printf("%-20s %10s %10s %10s  (us per program, %ld runs)\n",
+           "program", mode_names[FRESH], mode_names[REUSED],
+           mode_names[POOLED], runs);
+
+    for (i = 0; i < nprograms; i++)
+    {
+        code = read_program(programs[i], &len);
+        printf("%-20s", programs[i]);
+
+        for (mode = FRESH; mode <= POOLED; mode++)
+        {
+            printf(" %10.3f", time_runs(code, len, runs, mode));
+        }
+
+        printf("\n");
+        free(code);
+    }
+
+    return 0;
+}
@@ -8,26 +8,319 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bci.h"
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s filename\n", progname);
+    fprintf(stderr, "usage: %s [--engine=switch|threaded|decoded|fused|tos|"
+            "jit|reg|trace]\n"
+            "           [--jit] [--stats] [--no-cache] [--checks] "
+            "[--exec-trace]\n"
+            "           [--profile[=cycles]] [--profile-json=file]\n"
+            "           [--output=file | --discard-output] [--binary-output]\n"
+            "           [--data-in=file] [--data-out=file] [--data-words=N] "
+            "filename\n",
+            progname);
+    fprintf(stderr, "       %s --verify filename\n", progname);
+    fprintf(stderr, "       %s --emit-c filename > program.c\n", progname);
+    fprintf(stderr, "       %s [options] --batch dir|listfile [-j N] "
+            "[--quantum=N]\n", progname);
+    fprintf(stderr, "       %s [options] --fork-server=socket filename\n",
+            progname);
+    fprintf(stderr, "       %s [--stats] --simt=inputs.csv "
+            "[--simt-out=results.csv] filename\n", progname);
+}
+
+
+/*
+ * Does: Maps an engine name from the command line to its ENGINE_*
+ * constant.
+ * Arguments:
+ * -- name: The engine name.
+ * Returns: The engine constant, or -1 if the name is unknown.
+ */
+int parse_engine(char *name)
+{
+    if (strcmp(name, "switch") == 0)
+    {
+        return ENGINE_SWITCH;
+    }
+    else if (strcmp(name, "threaded") == 0)
+    {
+        return ENGINE_THREADED;
+    }
+    else if (strcmp(name, "decoded") == 0)
+    {
+        return ENGINE_DECODED;
+    }
+    else if (strcmp(name, "fused") == 0)
+    {
+        return ENGINE_FUSED;
+    }
+    else if (strcmp(name, "tos") == 0)
+    {
+        return ENGINE_TOS;
+    }
+    else if (strcmp(name, "jit") == 0)
+    {
+        return ENGINE_JIT;
+    }
+    else if (strcmp(name, "reg") == 0)
+    {
+        return ENGINE_REGISTER;
+    }
+    else if (strcmp(name, "trace") == 0)
+    {
+        return ENGINE_TRACE;
+    }
+
+    return -1;
 }
 
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    int i;
+    run_options opts;
+    char *filename = NULL;
+    char *batch = NULL;
+    char *server = NULL;
+    char *simt = NULL;
+    char *simt_out = NULL;
+    int nworkers = 0;
+    int verify = 0;
+    int emit_c = 0;
+    vm_type *vm;
+
+    init_run_options(&opts);
+
+    for (i = 1; i < argc; i++)
     {
+        if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            opts.engine = parse_engine(argv[i] + 9);
+
+            if (opts.engine < 0)
+            {
+                fprintf(stderr, "%s: unknown engine '%s'\n",
+                        argv[0], argv[i] + 9);
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--jit") == 0)
+        {
+            opts.engine = ENGINE_JIT;
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            opts.profile = PROFILE_COUNTS;
+        }
+        else if (strcmp(argv[i], "--profile=cycles") == 0)
+        {
+            opts.profile = PROFILE_CYCLES;
+        }
+        else if (strncmp(argv[i], "--profile-json=", 15) == 0)
+        {
+            opts.profile_json = argv[i] + 15;
+        }
+        else if (strcmp(argv[i], "--verify") == 0)
+        {
+            verify = 1;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            emit_c = 1;
+        }
+        else if (strcmp(argv[i], "--checks") == 0)
+        {
+            opts.checks = 1;
+        }
+        else if (strcmp(argv[i], "--exec-trace") == 0)
+        {
+            opts.exec_trace = 1;
+        }
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+        {
+            opts.output_file = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--discard-output") == 0)
+        {
+            opts.discard_output = 1;
+        }
+        else if (strcmp(argv[i], "--binary-output") == 0)
+        {
+            opts.binary_output = 1;
+        }
+        else if (strncmp(argv[i], "--data-in=", 10) == 0)
+        {
+            opts.data_in = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--data-out=", 11) == 0)
+        {
+            opts.data_out = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--data-words=", 13) == 0)
+        {
+            opts.data_words = atol(argv[i] + 13);
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            opts.cache = 0;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            opts.stats = 1;
+        }
+        else if (strncmp(argv[i], "--quantum=", 10) == 0)
+        {
+            opts.quantum = strtoul(argv[i] + 10, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--fork-server=", 14) == 0)
+        {
+            server = argv[i] + 14;
+        }
+        else if (strncmp(argv[i], "--simt=", 7) == 0)
+        {
+            simt = argv[i] + 7;
+        }
+        else if (strncmp(argv[i], "--simt-out=", 11) == 0)
+        {
+            simt_out = argv[i] + 11;
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            batch = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            nworkers = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0')
+        {
+            nworkers = atoi(argv[i] + 2);
+        }
+        else if (filename == NULL)
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    /* Every program in a batch would share one data memory. */
+    if (batch != NULL && (opts.data_in != NULL || opts.data_out != NULL))
+    {
+        fprintf(stderr, "%s: --batch has no data memory\n", argv[0]);
         usage(argv[0]);
         exit(1);
     }
 
-    run_program(argv[1]);
+    /* A batch prints every program's output itself, in list order. */
+    if (batch != NULL && (opts.output_file != NULL || opts.discard_output
+                          || opts.binary_output))
+    {
+        fprintf(stderr, "%s: --batch prints its own output\n", argv[0]);
+        usage(argv[0]);
+        exit(1);
+    }
 
-    return 0;
-}
+    /* Every program in a batch would write the same profile file. */
+    if (batch != NULL && opts.profile)
+    {
+        fprintf(stderr, "%s: --batch can't be profiled\n", argv[0]);
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (batch != NULL && filename == NULL)
+    {
+        return run_batch(batch, nworkers, &opts) == 0 ? 0 : 1;
+    }
+
+    if (filename == NULL || batch != NULL)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (verify)
+    {
+        /* Just report whether the program can run unchecked. */
+        vm = vm_create();
 
+        if (!vm_load_file(vm, filename))
+        {
+            exit(1);
+        }
 
+        if (vm_verify(vm, stdout))
+        {
+            printf("verify: ok\n");
+        }
+        else
+        {
+            verify = 0;
+        }
+
+        vm_destroy(vm);
+        return verify ? 0 : 1;
+    }
+
+    if (emit_c)
+    {
+        /* Translate the program to C instead of running it. */
+        vm = vm_create();
+
+        if (!vm_load_file(vm, filename) || !vm_emit_c(vm, filename, stdout))
+        {
+            exit(1);
+        }
+
+        vm_destroy(vm);
+        return 0;
+    }
+
+    if (server != NULL)
+    {
+        /* Run the program on request, in a child process per run. */
+        vm = vm_create();
+
+        if (!vm_load_file(vm, filename)
+            || !vm_map_data(vm, opts.data_in, opts.data_out,
+                            opts.data_words)
+            || !vm_serve(vm, &opts, server))
+        {
+            exit(1);
+        }
+
+        vm_destroy(vm);
+        return 0;
+    }
+
+    if (simt != NULL)
+    {
+        /* One run per row of starting registers, in lockstep. */
+        vm = vm_create();
+
+        if (!vm_load_file(vm, filename)
+            || !vm_map_data(vm, opts.data_in, opts.data_out,
+                            opts.data_words)
+            || run_simt(vm, &opts, simt, simt_out) != 0)
+        {
+            exit(1);
+        }
+
+        vm_destroy(vm);
+        return 0;
+    }
+
+    run_program_opts(filename, &opts);
+
+    return 0;
+}